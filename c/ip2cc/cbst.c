@@ -1,10 +1,16 @@
+#define _POSIX_C_SOURCE 200809L
+
 #include <cbst.h>
 
 #include <stdlib.h>     // for malloc()
 #include <string.h>     // for memcpy()
 #include <sys/param.h>  // for correct MIN()/MAX() macros
+#include <stdbool.h>
 
 #include <stdio.h>      // for printf()
+#include <assert.h>
+#include <pthread.h>
+#include <unistd.h>     // for sysconf()
  
 // Heap/tree movement:
 static inline int left(int i)   { return (i<<1)+1; }
@@ -20,6 +26,22 @@ static inline int is_p2(int i) {
     return __builtin_popcount(i)==1;
 }
 
+// In-order successor of the one-based index k in a tree of n
+// elements: the leftmost node of the right subtree if there is one,
+// otherwise the parent of the nearest ancestor that is a left child,
+// found by stripping the trailing ones (right turns) and the zero
+// above them:
+static inline size_t successor(size_t k, size_t n) {
+    if( (k<<1)+1 <= n ) {
+        k = (k<<1)+1;
+        while( (k<<1) <= n ) {
+            k <<= 1;
+        }
+        return k;
+    }
+    return k >> (__builtin_ctzl(~k)+1);
+}
+
 // Height of binary tree given size n
 static inline unsigned height(unsigned n) {
     return 8*sizeof(unsigned)-__builtin_clz(n);
@@ -47,64 +69,14 @@ size_t cbst_root(size_t n)
 }
 
 
-size_t cbst_index2(size_t nmemb, size_t value)
-{
-    size_t saved = value;
-    size_t index = 0;
-    size_t mask  = 1;
-    size_t contra = 1;
-
-    // Commute trailing ones to zeros:
-//    while( mask & value ) {
-//        value ^=mask;
-//        mask <<= 1;
-//    }
-
-    mask = 1 << (height(nmemb)-1);
-    cprintf("{%6zu (%6zu %5zx) (%6zu %5zx) (%6zu %6zu) %d}\n", saved, value, value, index, index, mask, contra, !!(mask&value));
-    while( mask ) {
-        if( mask & value ) {
-            index  = right(index);
-            value ^= mask; // Clear the bit we just tested
-        } else {
-            index = left(index);
-        }
-        mask >>= 1;
-        contra <<= 1;
-        cprintf("{%6zu (%6zu %5zx) (%6zu %5zx) (%6zu %6zu) %d}\n", saved, value, value, index, index, mask, contra, !!(mask&value));
-        if( value == mask-1 ) {
-            break;
-        }
-    }
-
-    cprintf("Final: {%6zu (%6zu %5zx) (%6zu %5zx) %5zx %zx}\n", nmemb, value, value, index, index, mask, mask&value);
-    return index;
-}
-
-
 // Compute the index in the CBST of size 'size' of a given 'value':
 size_t cbst_index(size_t nmemb, size_t value)
 {
     size_t index=0;
     size_t root=1;
 
-    size_t test=cbst_index2(nmemb, value);
-
-    if(cprint_on) {
-        cprint_on=1;
-    }
-
-    printf("\ncbst_index(%zu, %zu) %zx\n", nmemb, value, nmemb^value);
     while( root ) {
         root = cbst_root(nmemb);
-/*
-        if( is_p2(root+1) ) {
-            cprintf("  ");
-        } else {
-            cprint_on++;
-            cprintf(" @%d", cprint_on);
-        }
-*/
         cprintf("\t%zu ?= %zu (%zu, %zu)", value, root, nmemb, index);
         if( value > root ) {
             // Go right
@@ -124,11 +96,27 @@ size_t cbst_index(size_t nmemb, size_t value)
         }
     }
 
-    if( index!=test ) {
-        cprint_on = 1;
-    }
+    return index;
+}
+
 
-    cprintf( "%s %zu (%zu)\n\n", (index==test ? "BOOM!" : "Wah!!"), index, test);
+// Position the iterator at the element that is at position 'pos' in
+// sorted order. Only this costs a descent; thereafter the iterator
+// steps through the tree in order in amortized constant time:
+void cbst_iter_init(cbst_iter *it, size_t nmemb, size_t pos)
+{
+    it->nmemb = nmemb;
+    it->k     = pos < nmemb ? cbst_index(nmemb, pos)+1 : 0;
+}
+
+// Returns the CBST index of the current element and advances to the
+// next one in sorted order:
+size_t cbst_iter_next(cbst_iter *it)
+{
+    size_t index = it->k-1;
+
+    assert( it->k!=0 );
+    it->k = successor(it->k, it->nmemb);
     return index;
 }
 
@@ -150,38 +138,152 @@ size_t cbst_add(void* cbst, size_t nmemb, size_t size, size_t pos, const void* v
 }
 
 
-// Constructs a Complete Binary Search Tree from a sorted array:
+// Constructs a Complete Binary Search Tree from a sorted array, in
+// O(n), by walking the tree in order:
 void* cbst_from_sorted_array(const void *base, size_t nmemb, size_t size)
 {
-    unsigned i;
+    size_t i;
+    cbst_iter it;
     void *cbst = cbst_new(nmemb, size);
 
+    if( cbst==NULL ) {
+        return NULL;
+    }
+
+    cbst_iter_init(&it, nmemb, 0);
     for(i=0; i<nmemb; i++) {
-        cbst_add(cbst, nmemb, size, i, (char*)base+i*size);
+        memcpy((char*)cbst+cbst_iter_next(&it)*size, (const char*)base+i*size, size);
     }
     return cbst;
 }
 
-// Find the (value pointed at by) 'value':
+// One thread's share of cbst_place_sorted_array_mt(): a contiguous run
+// of the sorted input, placed by its own iterator:
+typedef struct {
+    void       *cbst;
+    const void *base;
+    size_t      nmemb;
+    size_t      size;
+    size_t      begin;
+    size_t      end;
+} cbst_chunk;
+
+static void* cbst_place_chunk(void *arg)
+{
+    cbst_chunk *c = arg;
+    cbst_iter   it;
+    size_t      i;
+
+    cbst_iter_init(&it, c->nmemb, c->begin);
+    for(i=c->begin; i<c->end; i++) {
+        memcpy((char*)c->cbst+cbst_iter_next(&it)*c->size, (const char*)c->base+i*c->size, c->size);
+    }
+    return NULL;
+}
+
+// Places a sorted array into 'cbst', which has room for 'nmemb'
+// elements, with the input split into 'nthreads' contiguous chunks
+// that are placed concurrently. Each chunk's slots, level by level,
+// are themselves contiguous, so the threads rarely share a cache line.
+// Zero threads means one per online CPU, as long as each has at least
+// CBST_MT_MIN_CHUNK elements; any other count is only capped at one
+// element per thread. The calling thread takes the first chunk itself,
+// and any chunk whose thread could not be started, so this cannot
+// fail:
+void cbst_place_sorted_array_mt(void *cbst, const void *base, size_t nmemb, size_t size, size_t nthreads)
+{
+    cbst_chunk *chunks;
+    pthread_t  *tids;
+    bool       *live;
+    cbst_chunk  all = { cbst, base, nmemb, size, 0, nmemb };
+    size_t      i;
+
+    if( nthreads==0 ) {
+        long ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+        nthreads = ncpu>0 ? (size_t)ncpu : 1;
+        nthreads = MIN(nthreads, MAX(nmemb/CBST_MT_MIN_CHUNK, 1));
+    }
+    nthreads = MIN(nthreads, nmemb);
+
+    chunks = nthreads>1 ? malloc(nthreads*sizeof(cbst_chunk)) : NULL;
+    tids   = nthreads>1 ? malloc(nthreads*sizeof(pthread_t)) : NULL;
+    live   = nthreads>1 ? calloc(nthreads, sizeof(bool)) : NULL;
+    if( chunks==NULL || tids==NULL || live==NULL ) {
+        cbst_place_chunk(&all);
+        goto out;
+    }
+
+    for(i=0; i<nthreads; i++) {
+        chunks[i]       = all;
+        chunks[i].begin = nmemb*i/nthreads;
+        chunks[i].end   = nmemb*(i+1)/nthreads;
+    }
+    for(i=1; i<nthreads; i++) {
+        live[i] = 0==pthread_create(tids+i, NULL, cbst_place_chunk, chunks+i);
+    }
+    for(i=0; i<nthreads; i++) {
+        if( !live[i] ) {
+            cbst_place_chunk(chunks+i);
+        }
+    }
+    for(i=1; i<nthreads; i++) {
+        if( live[i] ) {
+            pthread_join(tids[i], NULL);
+        }
+    }
+
+out:
+    free(live);
+    free(tids);
+    free(chunks);
+}
+
+// As cbst_from_sorted_array(), placing the elements with
+// cbst_place_sorted_array_mt():
+void* cbst_from_sorted_array_mt(const void *base, size_t nmemb, size_t size, size_t nthreads)
+{
+    void *cbst = cbst_new(nmemb, size);
+
+    if( cbst!=NULL ) {
+        cbst_place_sorted_array_mt(cbst, base, nmemb, size, nthreads);
+    }
+    return cbst;
+}
+
+// Recovers the sorted array from a CBST (an in-order traversal):
+void* cbst_to_sorted_array(const void *cbst, size_t nmemb, size_t size)
+{
+    size_t i;
+    cbst_iter it;
+    char *base = malloc(nmemb*size);
+
+    if( base==NULL ) {
+        return NULL;
+    }
+
+    cbst_iter_init(&it, nmemb, 0);
+    for(i=0; i<nmemb; i++) {
+        memcpy(base+i*size, (const char*)cbst+cbst_iter_next(&it)*size, size);
+    }
+    return base;
+}
+
+// Find the (value pointed at by) 'value' in the subtree at 'root':
 const void *cbst_find(const void *cbst, size_t nmemb, size_t size,
                       int (*compar)(const void *, const void *), const void *value, size_t root)
 {
-    int cmp;
+    const char *elem;
+    size_t      i;
 
     if( cbst==NULL || root >= nmemb) {
         return NULL;
     }
 
-    cmp = compar((char*)cbst+root*size, value);
-    if( cmp > 0 ) {
-        // root > value
-        return cbst_find(cbst, nmemb, size, compar, value, right(root));
-    } else if (cmp < 0 ) {
-        // root < value
-        return cbst_find(cbst, nmemb, size, compar, value, left(root));
+    i = cbst_descend(cbst, nmemb, size, compar, value, root);
+    if( i==nmemb ) {
+        return NULL;
     }
 
-    // root == value, return it:
-    return (char*)cbst+root*size;
+    elem = (const char*)cbst+i*size;
+    return compar(elem, value)==0 ? elem : NULL;
 }
-
@@ -3,10 +3,75 @@
 // For size_t:
 #include <stddef.h>
 
+// Fewest elements worth handing to a thread of its own:
+#define CBST_MT_MIN_CHUNK 65536
+
+// Visits the elements of a CBST in sorted order. Used to build a
+// CBST, one element at a time as records arrive, in O(n) overall:
+typedef struct cbst_iter cbst_iter;
+
+struct cbst_iter {
+    size_t nmemb;
+    size_t k;           // One-based index of the current element, or 0 at the end
+};
+
 size_t cbst_root(size_t nmemb);
 size_t cbst_index(size_t nmemb, size_t value);
+void   cbst_iter_init(cbst_iter *it, size_t nmemb, size_t pos);
+size_t cbst_iter_next(cbst_iter *it);
 void*  cbst_new(size_t nmemb, size_t size);
 size_t cbst_add(void* cbst, size_t nmemb, size_t size, size_t pos, const void* value);
 void*  cbst_from_sorted_array(const void *base, size_t nmemb, size_t size);
+void*  cbst_from_sorted_array_mt(const void *base, size_t nmemb, size_t size, size_t nthreads);
+void   cbst_place_sorted_array_mt(void *cbst, const void *base, size_t nmemb, size_t size, size_t nthreads);
+void*  cbst_to_sorted_array(const void *cbst, size_t nmemb, size_t size);
 const void* cbst_find(const void *cbst, size_t nmemb, size_t size,
                       int (*compar)(const void *, const void *), const void *value, size_t root);
+
+
+// Comparators follow the cbst_find() convention: compar(elem, value)
+// is positive if 'elem' precedes 'value', zero if it matches, and
+// negative if it follows.
+
+// Branchless descent from the subtree at 'root'. The next index is
+// computed arithmetically, going right whenever the element does not
+// follow 'value', so the path taken is recorded in the bits of the
+// (one-based) index. The last right turn, recovered by stripping the
+// trailing zeros and the one above them, is the greatest element that
+// does not follow 'value'. Returns its index, or 'nmemb' if there is
+// no such element in the subtree.
+static inline size_t cbst_descend(const void *cbst, size_t nmemb, size_t size,
+                                  int (*compar)(const void *, const void *),
+                                  const void *value, size_t root)
+{
+    size_t k = root+1;
+
+    while( k <= nmemb ) {
+        k = (k<<1) + (compar((const char*)cbst+(k-1)*size, value) >= 0);
+    }
+    k >>= __builtin_ctzl(k)+1;
+
+    // Anything above the starting node is outside the subtree:
+    return k > root ? k-1 : nmemb;
+}
+
+// Find the element matching 'value'. Being static inline, a call with
+// a known comparator lets the compiler inline the comparison too:
+static inline const void* cbst_search(const void *cbst, size_t nmemb, size_t size,
+                                      int (*compar)(const void *, const void *),
+                                      const void *value)
+{
+    const char *elem;
+    size_t      i;
+
+    if( cbst==NULL ) {
+        return NULL;
+    }
+
+    i = cbst_descend(cbst, nmemb, size, compar, value, 0);
+    if( i==nmemb ) {
+        return NULL;
+    }
+    elem = (const char*)cbst+i*size;
+    return compar(elem, value)==0 ? elem : NULL;
+}
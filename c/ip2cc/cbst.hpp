@@ -0,0 +1,413 @@
+#pragma once
+
+// Header-only C++ counterpart of cbst.h: an immutable sorted table laid
+// out for search, with the element type, the comparator and the layout
+// all template parameters, so the compiler sees through every copy and
+// every comparison. Requires C++17.
+//
+//     struct range { uint32_t lo, hi; char cc[3]; };
+//     struct by_lo {
+//         bool operator()(const range &r, uint32_t ip) const { return r.lo < ip; }
+//         bool operator()(uint32_t ip, const range &r) const { return ip < r.lo; }
+//     };
+//     cbst<range, by_lo> t(sorted.begin(), sorted.end());
+//     const range *r = t.floor(ip);   // The range that may hold 'ip'
+//
+// The comparator is used as std::lower_bound()'s and std::upper_bound()'s
+// are, comp(element, key) and comp(key, element), so std::less<> does
+// for elements that compare with their keys directly.
+
+#include <cstddef>
+#include <cstdint>
+#include <functional>   // For std::less<>
+#include <iterator>     // For std::distance()
+#include <memory>       // For std::unique_ptr
+#include <new>          // For std::align_val_t
+#include <type_traits>  // For std::decay_t
+#include <utility>      // For std::move(), std::declval()
+
+
+namespace cbst_detail {
+
+// The index math of cbst.c, inline. Indices are one-based, as in
+// cbst_descend(): the children of k are 2k and 2k+1.
+
+// Height of a tree of n elements:
+inline std::size_t height(std::size_t n) {
+    return 8*sizeof(unsigned long) - __builtin_clzl(n);
+}
+
+// As cbst_root(): the position in sorted order of the root of a
+// complete tree of n elements:
+inline std::size_t root(std::size_t n) {
+    if( n<=1 ) {
+        return 0;
+    }
+    std::size_t h = height(n);
+    std::size_t i = (std::size_t(1)<<(h-1))-1;
+    std::size_t w = n-i;
+    std::size_t k = std::size_t(1)<<(h-2);
+    return w<k ? i-(k-w) : i;
+}
+
+// As cbst_index(), one-based: where the element at sorted position
+// 'pos' goes:
+inline std::size_t index(std::size_t n, std::size_t pos) {
+    std::size_t k = 1, r;
+
+    for(;;) {
+        r = root(n);
+        if( pos > r ) {
+            k    = 2*k+1;
+            n   -= r+1;
+            pos -= r+1;
+        } else if( pos < r ) {
+            k = 2*k;
+            n = r;
+        } else {
+            return k;
+        }
+    }
+}
+
+// As in cbst.c: the in-order successor of k, 0 after the last:
+inline std::size_t successor(std::size_t k, std::size_t n) {
+    if( (k<<1)+1 <= n ) {
+        k = (k<<1)+1;
+        while( (k<<1) <= n ) {
+            k <<= 1;
+        }
+        return k;
+    }
+    return k >> (__builtin_ctzl(~k)+1);
+}
+
+// Visits the one-based slots of a tree of n elements in sorted order,
+// as cbst_iter does:
+template<class F>
+void in_order(std::size_t n, F &&f) {
+    std::size_t i, k = n>0 ? index(n, 0) : 0;
+
+    for(i=0; i<n; i++, k=successor(k, n)) {
+        f(i, k);
+    }
+}
+
+// Storage aligned to a cache line:
+template<class T>
+struct aligned_delete {
+    void operator()(T *p) const {
+        ::operator delete[](p, std::align_val_t(64));
+    }
+};
+
+template<class T>
+using aligned_array = std::unique_ptr<T[], aligned_delete<T>>;
+
+template<class T>
+aligned_array<T> make_aligned(std::size_t n) {
+    return aligned_array<T>(new (std::align_val_t(64)) T[n > 0 ? n : 1]());
+}
+
+struct identity {
+    template<class T>
+    const T& operator()(const T &x) const { return x; }
+};
+
+} // namespace cbst_detail
+
+
+// Layout policies. Each provides a store<T> that is built once from a
+// sorted random-access range and then searched; lower_bound() and
+// upper_bound() mean what they do for std::lower_bound() and
+// std::upper_bound() over the sorted elements, floor() is the last
+// element that does not follow the key, and each returns nullptr where
+// the standard algorithms would return the end.
+
+// The layout of cbst.h: the elements in heap order, searched without
+// branches as cbst_descend() does. data() is interchangeable with a
+// CBST built by cbst_from_sorted_array():
+struct eytzinger {
+    template<class T>
+    class store {
+        cbst_detail::aligned_array<T> a_;
+        std::size_t n_ = 0;
+
+        // The one-based descent; 'right' says whether to go past a[k]:
+        template<class Right>
+        std::size_t descend(Right right) const {
+            const T    *a = a_.get();
+            std::size_t k = 1;
+
+            while( k <= n_ ) {
+                __builtin_prefetch(a+16*k-1);
+                k = 2*k + right(a[k-1]);
+            }
+            return k;
+        }
+
+    public:
+        template<class It>
+        void build(It first, std::size_t n) {
+            n_ = n;
+            a_ = cbst_detail::make_aligned<T>(n);
+            cbst_detail::in_order(n, [&](std::size_t i, std::size_t k) { a_[k-1] = first[i]; });
+        }
+
+        std::size_t size() const { return n_; }
+        const T*    data() const { return a_.get(); }
+
+        // The last left turn is the answer; none if there was none:
+        template<class K, class C>
+        const T* lower_bound(const K &key, const C &comp) const {
+            std::size_t k = descend([&](const T &x) { return comp(x, key); });
+            k >>= __builtin_ctzl(~k)+1;
+            return k ? a_.get()+k-1 : nullptr;
+        }
+
+        template<class K, class C>
+        const T* upper_bound(const K &key, const C &comp) const {
+            std::size_t k = descend([&](const T &x) { return !comp(key, x); });
+            k >>= __builtin_ctzl(~k)+1;
+            return k ? a_.get()+k-1 : nullptr;
+        }
+
+        // The last right turn, as in cbst_descend():
+        template<class K, class C>
+        const T* floor(const K &key, const C &comp) const {
+            std::size_t k = descend([&](const T &x) { return !comp(key, x); });
+            k >>= __builtin_ctzl(k)+1;
+            return k ? a_.get()+k-1 : nullptr;
+        }
+
+        template<class K, class C>
+        bool equal(const T &x, const K &key, const C &comp) const {
+            return !comp(x, key) && !comp(key, x);
+        }
+    };
+};
+
+
+// Hot/cold split, as ip_soa does for ip2cc: the keys, as extracted by
+// KeyOf, in a dense heap-ordered array of their own, and the elements
+// in a parallel one that is read once, after the descent. The
+// comparator compares keys:
+template<class KeyOf = cbst_detail::identity>
+struct soa {
+    template<class T>
+    class store {
+        using key_type = std::decay_t<decltype(KeyOf()(std::declval<const T&>()))>;
+
+        cbst_detail::aligned_array<key_type> keys_;    // From index one
+        cbst_detail::aligned_array<T>        a_;
+        std::size_t n_ = 0;
+
+        template<class Right>
+        std::size_t descend(Right right) const {
+            const key_type *keys = keys_.get();
+            std::size_t     k    = 1;
+
+            while( k <= n_ ) {
+                __builtin_prefetch(keys+16*k);
+                k = 2*k + right(keys[k]);
+            }
+            return k;
+        }
+
+    public:
+        template<class It>
+        void build(It first, std::size_t n) {
+            n_    = n;
+            keys_ = cbst_detail::make_aligned<key_type>(n+1);
+            a_    = cbst_detail::make_aligned<T>(n);
+            cbst_detail::in_order(n, [&](std::size_t i, std::size_t k) {
+                a_[k-1]  = first[i];
+                keys_[k] = KeyOf()(a_[k-1]);
+            });
+        }
+
+        std::size_t size() const { return n_; }
+        const T*    data() const { return a_.get(); }
+
+        template<class K, class C>
+        const T* lower_bound(const K &key, const C &comp) const {
+            std::size_t k = descend([&](const key_type &x) { return comp(x, key); });
+            k >>= __builtin_ctzl(~k)+1;
+            return k ? a_.get()+k-1 : nullptr;
+        }
+
+        template<class K, class C>
+        const T* upper_bound(const K &key, const C &comp) const {
+            std::size_t k = descend([&](const key_type &x) { return !comp(key, x); });
+            k >>= __builtin_ctzl(~k)+1;
+            return k ? a_.get()+k-1 : nullptr;
+        }
+
+        template<class K, class C>
+        const T* floor(const K &key, const C &comp) const {
+            std::size_t k = descend([&](const key_type &x) { return !comp(key, x); });
+            k >>= __builtin_ctzl(k)+1;
+            return k ? a_.get()+k-1 : nullptr;
+        }
+
+        template<class K, class C>
+        bool equal(const T &x, const K &key, const C &comp) const {
+            return !comp(KeyOf()(x), key) && !comp(key, KeyOf()(x));
+        }
+    };
+};
+
+
+// A B-tree of B elements per node, B+1 children each, in breadth-first
+// order as ip_stree's layers are, so a search touches one node per
+// level and examines it with a fixed-length loop the compiler can
+// unroll or vectorize. Nodes past the last element are filled with
+// copies of it, which compare equal to it and so change no answer:
+template<std::size_t B = 16>
+struct kary {
+    static_assert(B > 0, "kary needs at least one element per node");
+
+    template<class T>
+    class store {
+        cbst_detail::aligned_array<T> a_;
+        std::size_t n_ = 0;
+        std::size_t nblocks_ = 0;
+
+        static std::size_t child(std::size_t k, std::size_t i) {
+            return k*(B+1)+i+1;
+        }
+
+        // Number of elements in block k that 'right' goes past:
+        template<class Right>
+        std::size_t rank(std::size_t k, Right right) const {
+            const T    *node = a_.get()+k*B;
+            std::size_t i, r = 0;
+
+            for(i=0; i<B; i++) {
+                r += right(node[i]);
+            }
+            return r;
+        }
+
+        template<class It>
+        void fill(It first, std::size_t k, std::size_t &t) {
+            std::size_t i;
+
+            if( k >= nblocks_ ) {
+                return;
+            }
+            for(i=0; i<B; i++) {
+                fill(first, child(k, i), t);
+                a_[k*B+i] = t<n_ ? first[t] : first[n_-1];
+                t++;
+            }
+            fill(first, child(k, B), t);
+        }
+
+        // The slot of the first element that 'right' does not go past:
+        template<class Right>
+        const T* first_not(Right right) const {
+            const T    *best = nullptr;
+            std::size_t k = 0, i;
+
+            while( k < nblocks_ ) {
+                __builtin_prefetch(a_.get()+child(k, 0)*B);
+                i = rank(k, right);
+                if( i < B ) {
+                    best = a_.get()+k*B+i;
+                }
+                k = child(k, i);
+            }
+            return best;
+        }
+
+    public:
+        template<class It>
+        void build(It first, std::size_t n) {
+            std::size_t t = 0;
+
+            n_       = n;
+            nblocks_ = (n+B-1)/B;
+            a_       = cbst_detail::make_aligned<T>(nblocks_*B);
+            fill(first, 0, t);
+        }
+
+        std::size_t size() const { return n_; }
+        const T*    data() const { return a_.get(); }
+
+        template<class K, class C>
+        const T* lower_bound(const K &key, const C &comp) const {
+            return first_not([&](const T &x) { return comp(x, key); });
+        }
+
+        template<class K, class C>
+        const T* upper_bound(const K &key, const C &comp) const {
+            return first_not([&](const T &x) { return !comp(key, x); });
+        }
+
+        // The last element passed on the way down:
+        template<class K, class C>
+        const T* floor(const K &key, const C &comp) const {
+            const T    *best = nullptr;
+            std::size_t k = 0, i;
+
+            while( k < nblocks_ ) {
+                i = rank(k, [&](const T &x) { return !comp(key, x); });
+                if( i > 0 ) {
+                    best = a_.get()+k*B+i-1;
+                }
+                k = child(k, i);
+            }
+            return best;
+        }
+
+        template<class K, class C>
+        bool equal(const T &x, const K &key, const C &comp) const {
+            return !comp(x, key) && !comp(key, x);
+        }
+    };
+};
+
+
+// The table itself. Elements are copied in, in sorted order, when it
+// is built, and never change afterwards:
+template<class T, class Compare = std::less<>, class Layout = eytzinger>
+class cbst {
+    typename Layout::template store<T> store_;
+    Compare comp_;
+
+public:
+    using value_type   = T;
+    using compare_type = Compare;
+    using layout_type  = Layout;
+
+    cbst() = default;
+
+    // From any sorted random-access range:
+    template<class It>
+    cbst(It first, It last, Compare comp = Compare()) : comp_(std::move(comp)) {
+        store_.build(first, static_cast<std::size_t>(std::distance(first, last)));
+    }
+
+    std::size_t size() const  { return store_.size(); }
+    bool        empty() const { return store_.size()==0; }
+
+    // The elements in the layout's own order:
+    const T*    data() const  { return store_.data(); }
+
+    template<class K>
+    const T* lower_bound(const K &key) const { return store_.lower_bound(key, comp_); }
+
+    template<class K>
+    const T* upper_bound(const K &key) const { return store_.upper_bound(key, comp_); }
+
+    template<class K>
+    const T* floor(const K &key) const { return store_.floor(key, comp_); }
+
+    // An element equivalent to 'key', or nullptr:
+    template<class K>
+    const T* find(const K &key) const {
+        const T *x = store_.lower_bound(key, comp_);
+        return x!=nullptr && store_.equal(*x, key, comp_) ? x : nullptr;
+    }
+};
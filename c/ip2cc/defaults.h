@@ -5,14 +5,24 @@
 #define IP2CC_DB_ROOT "."
 
 // Names of the environment variables that store the database file
-// paths:
+// paths, the server's socket and the shared memory database:
 #define IP2CC_TXTDB_ENVAR "IP2CC_TXTDB"
 #define IP2CC_BINDB_ENVAR "IP2CC_BINDB"
+#define IP2CC_TXTDB6_ENVAR "IP2CC_TXTDB6"
+#define IP2CC_SOCKET_ENVAR "IP2CC_SOCKET"
+#define IP2CC_SHM_ENVAR "IP2CC_SHM"
 
-// Default filenames for database files:
+// Default filenames for database files and the socket:
 #define IP2CC_TXTDB_NAME "ip2cc.txt"
 #define IP2CC_BINDB_NAME "ip2cc.bin"
+#define IP2CC_TXTDB6_NAME "ip2cc6.txt"
+#define IP2CC_SOCKET_NAME "ip2cc.sock"
 
-// Default fully-qualified paths for database files:
+// Default fully-qualified paths for database files and the socket:
 #define IP2CC_TXTDB_PATH IP2CC_DB_ROOT "/" IP2CC_TXTDB_NAME
 #define IP2CC_BINDB_PATH IP2CC_DB_ROOT "/" IP2CC_BINDB_NAME
+#define IP2CC_TXTDB6_PATH IP2CC_DB_ROOT "/" IP2CC_TXTDB6_NAME
+#define IP2CC_SOCKET_PATH IP2CC_DB_ROOT "/" IP2CC_SOCKET_NAME
+
+// Default name of the database published in shared memory:
+#define IP2CC_SHM_NAME "/ip2cc"
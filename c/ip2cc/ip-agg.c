@@ -0,0 +1,221 @@
+#include <ip-agg.h>
+#include <assert.h>
+
+#include <stdlib.h>     // For calloc(), free()
+#include <string.h>     // For memset()
+
+
+ip_agg* ip_agg_new(size_t nranges, size_t nranges6)
+{
+    ip_agg *agg = calloc(1, sizeof(ip_agg));
+
+    if( agg==NULL ) {
+        return NULL;
+    }
+    agg->nranges     = nranges;
+    agg->range_hits  = calloc(nranges ? nranges : 1, sizeof(uint64_t));
+    agg->nranges6    = nranges6;
+    agg->range6_hits = calloc(nranges6 ? nranges6 : 1, sizeof(uint64_t));
+    if( agg->range_hits==NULL || agg->range6_hits==NULL ) {
+        ip_agg_free(agg);
+        return NULL;
+    }
+    return agg;
+}
+
+
+void ip_agg_free(ip_agg *agg)
+{
+    if( agg!=NULL ) {
+        free(agg->range_hits);
+        free(agg->range6_hits);
+        free(agg);
+    }
+}
+
+
+void ip_agg_merge(ip_agg *into, const ip_agg *from)
+{
+    size_t i;
+
+    assert( into->nranges==from->nranges );
+    assert( into->nranges6==from->nranges6 );
+
+    into->total     += from->total;
+    into->unmatched += from->unmatched;
+    for(i=0; i<IP_AGG_NCC; i++) {
+        into->cc_hits[i] += from->cc_hits[i];
+    }
+    for(i=0; i<into->nranges; i++) {
+        into->range_hits[i] += from->range_hits[i];
+    }
+    for(i=0; i<into->nranges6; i++) {
+        into->range6_hits[i] += from->range6_hits[i];
+    }
+}
+
+
+// Whether count i ranks below count j; ties go to the lower IPv4
+// address so that the order does not depend on the engine's layout,
+// or otherwise to the lower index:
+static bool below(const uint64_t *counts, const ip_cbst_node *nodes, size_t i, size_t j)
+{
+    if( counts[i]!=counts[j] ) {
+        return counts[i] < counts[j];
+    }
+    return nodes!=NULL ? nodes[i].addr_lo > nodes[j].addr_lo : i > j;
+}
+
+// Restore the min-heap property below top[j]:
+static void sift_down(const uint64_t *counts, const ip_cbst_node *nodes, size_t *top, size_t m, size_t j)
+{
+    size_t c, t;
+
+    while( (c=2*j+1) < m ) {
+        if( c+1<m && below(counts, nodes, top[c+1], top[c]) ) {
+            c++;
+        }
+        if( !below(counts, nodes, top[c], top[j]) ) {
+            break;
+        }
+        t = top[j];
+        top[j] = top[c];
+        top[c] = t;
+        j = c;
+    }
+}
+
+// The indices of the (up to) k largest non-zero of n counts, largest
+// first, using a k-element min-heap; returns how many there are:
+static size_t top_k(const uint64_t *counts, const ip_cbst_node *nodes, size_t n, size_t k, size_t *top)
+{
+    size_t m = 0, i, j, t;
+
+    for(i=0; i<n && k>0; i++) {
+        if( counts[i]==0 ) {
+            continue;
+        }
+        if( m<k ) {
+            for(j=m++; j>0 && below(counts, nodes, i, top[(j-1)/2]); j=(j-1)/2) {
+                top[j] = top[(j-1)/2];
+            }
+            top[j] = i;
+        } else if( below(counts, nodes, top[0], i) ) {
+            top[0] = i;
+            sift_down(counts, nodes, top, m, 0);
+        }
+    }
+
+    // Heap-sort what is left, largest first:
+    for(i=m; i>1; i--) {
+        t = top[0];
+        top[0] = top[i-1];
+        top[i-1] = t;
+        sift_down(counts, nodes, top, i-1, 0);
+    }
+    return m;
+}
+
+
+// The code for index i as the database spells it, 'seen' being the
+// first spelling among the ranges hit, so that the country rows agree
+// with the range rows; upper case if no range was hit:
+static void cc_name(size_t i, const char *seen, char *cc)
+{
+    unsigned a = i/36, b = i%36;
+
+    if( i==IP_AGG_NCC-1 ) {
+        cc[0] = cc[1] = '?';
+    } else if( seen[0]!='\0' ) {
+        cc[0] = seen[0];
+        cc[1] = seen[1];
+    } else {
+        cc[0] = a<10 ? '0'+a : 'A'+a-10;
+        cc[1] = b<10 ? '0'+b : 'A'+b-10;
+    }
+    cc[2] = '\0';
+}
+
+// Count a hit range towards its country, and note how it is spelt:
+static void count_range(size_t *ranges, char (*seen)[3], const char *cc)
+{
+    size_t j = ip_agg_cc_index(cc);
+
+    ranges[j]++;
+    if( seen[j][0]=='\0' ) {
+        seen[j][0] = cc[0];
+        seen[j][1] = cc[1];
+    }
+}
+
+
+// Summarize: totals, then the top k countries by hits with the number
+// of distinct ranges hit in each, then the top k IPv4 and top k IPv6
+// ranges:
+void ip_agg_report(const ip_agg *agg, const ip_cbst_node *nodes, const ip6_cbst_node *nodes6, size_t k, bool csv, FILE *fp)
+{
+    size_t   ranges[IP_AGG_NCC];
+    char     seen[IP_AGG_NCC][3];
+    size_t  *top = NULL;
+    size_t   i, m, distinct = 0;
+    char     cc[3], lo[INET6_ADDRSTRLEN], hi[INET6_ADDRSTRLEN];
+    struct in_addr ip;
+
+    memset(ranges, 0, sizeof(ranges));
+    memset(seen, 0, sizeof(seen));
+    for(i=0; i<agg->nranges; i++) {
+        if( agg->range_hits[i] ) {
+            count_range(ranges, seen, nodes[i].cc);
+            distinct++;
+        }
+    }
+    for(i=0; i<agg->nranges6; i++) {
+        if( agg->range6_hits[i] ) {
+            count_range(ranges, seen, nodes6[i].cc);
+            distinct++;
+        }
+    }
+
+    top = malloc((k>IP_AGG_NCC ? k : IP_AGG_NCC)*sizeof(size_t));
+    assert( top!=NULL );
+
+    if( csv ) {
+        fprintf(fp, "kind,cc,hits,ranges,lo,hi\n");
+        fprintf(fp, "total,,%llu,%zu,,\n", (unsigned long long)agg->total, distinct);
+        fprintf(fp, "unmatched,,%llu,,,\n", (unsigned long long)agg->unmatched);
+    } else {
+        fprintf(fp, "%llu addresses, %llu unmatched, %zu distinct ranges\n\n",
+                (unsigned long long)agg->total, (unsigned long long)agg->unmatched, distinct);
+        fprintf(fp, "%-4s %12s %8s\n", "cc", "hits", "ranges");
+    }
+
+    m = top_k(agg->cc_hits, NULL, IP_AGG_NCC, k, top);
+    for(i=0; i<m; i++) {
+        cc_name(top[i], seen[top[i]], cc);
+        fprintf(fp, csv ? "country,%s,%llu,%zu,,\n" : "%-4s %12llu %8zu\n",
+                cc, (unsigned long long)agg->cc_hits[top[i]], ranges[top[i]]);
+    }
+
+    if( !csv ) {
+        fprintf(fp, "\n%-4s %12s  %s\n", "cc", "hits", "range");
+    }
+    m = top_k(agg->range_hits, nodes, agg->nranges, k, top);
+    for(i=0; i<m; i++) {
+        const ip_cbst_node *node = nodes+top[i];
+        ip.s_addr = htonl(node->addr_lo);
+        inet_ntop(AF_INET, &ip, lo, sizeof(lo));
+        ip.s_addr = htonl(node->addr_hi);
+        inet_ntop(AF_INET, &ip, hi, sizeof(hi));
+        fprintf(fp, csv ? "range,%s,%llu,,%s,%s\n" : "%-4s %12llu  %s-%s\n",
+                node->cc, (unsigned long long)agg->range_hits[top[i]], lo, hi);
+    }
+    m = top_k(agg->range6_hits, NULL, agg->nranges6, k, top);
+    for(i=0; i<m; i++) {
+        const ip6_cbst_node *node = nodes6+top[i];
+        fprintf(fp, csv ? "range,%s,%llu,,%s,%s\n" : "%-4s %12llu  %s-%s\n",
+                node->cc, (unsigned long long)agg->range6_hits[top[i]],
+                ip6_cbst_ntop(node->addr_lo, lo), ip6_cbst_ntop(node->addr_hi, hi));
+    }
+
+    free(top);
+}
@@ -0,0 +1,69 @@
+#pragma once
+
+#include <stdio.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <ip-cbst.h>
+#include <ip6-cbst.h>
+
+// Country codes map to a dense index, two characters of 0-9 or a-z,
+// case-folded, so that codes such as MaxMind's "A1" and "A2" keep
+// their own slot; the last slot counts any other code:
+#define IP_AGG_NCC (36*36+1)
+
+// Default number of countries and ranges to report:
+#define IP_AGG_TOPK 10
+
+typedef struct ip_agg ip_agg;
+
+// Hit counters for one thread; each thread counts into its own, and
+// they are merged once at the end:
+struct ip_agg {
+    uint64_t  total;
+    uint64_t  unmatched;
+    uint64_t  cc_hits[IP_AGG_NCC];
+    uint64_t *range_hits;   // Indexed by position in the engine's nodes
+    size_t    nranges;
+    uint64_t *range6_hits;  // Indexed by position in the IPv6 CBST
+    size_t    nranges6;
+};
+
+ip_agg* ip_agg_new(size_t nranges, size_t nranges6);
+void    ip_agg_free(ip_agg *agg);
+void    ip_agg_merge(ip_agg *into, const ip_agg *from);
+void    ip_agg_report(const ip_agg *agg, const ip_cbst_node *nodes, const ip6_cbst_node *nodes6, size_t k, bool csv, FILE *fp);
+
+// 0-9 for a digit, 10-35 for a letter, 36 for anything else:
+static inline unsigned ip_agg_cc_char(char c) {
+    unsigned d = (unsigned char)c - '0';
+    unsigned l = ((unsigned char)c | 0x20) - 'a';
+    return d<10 ? d : l<26 ? l+10 : 36;
+}
+
+static inline unsigned ip_agg_cc_index(const char *cc) {
+    unsigned a = ip_agg_cc_char(cc[0]);
+    unsigned b = ip_agg_cc_char(cc[1]);
+    return a<36 && b<36 ? a*36+b : IP_AGG_NCC-1;
+}
+
+// Count one lookup result; 'nodes' is the array that 'node' is in:
+static inline void ip_agg_add(ip_agg *agg, const ip_cbst_node *nodes, const ip_cbst_node *node) {
+    agg->total++;
+    if( node==NULL ) {
+        agg->unmatched++;
+        return;
+    }
+    agg->cc_hits[ip_agg_cc_index(node->cc)]++;
+    agg->range_hits[node-nodes]++;
+}
+
+static inline void ip_agg_add6(ip_agg *agg, const ip6_cbst_node *nodes, const ip6_cbst_node *node) {
+    agg->total++;
+    if( node==NULL ) {
+        agg->unmatched++;
+        return;
+    }
+    agg->cc_hits[ip_agg_cc_index(node->cc)]++;
+    agg->range6_hits[node-nodes]++;
+}
@@ -0,0 +1,18 @@
+#pragma once
+
+#include <stddef.h>
+#include <ip-cbst.h>
+
+// A database compiled into the program. ip2cc-gen turns the text
+// databases into a C file that defines the functions below: the whole
+// image, header included, as one static const array, so that it is
+// mapped with the program's text and shared by every process running
+// it, and a lookup with the top levels of the tree written out as
+// compares against constants.
+
+// The IPv4 CBST, laid out as ip_cbst_load() would return it; the IPv6
+// one is found with ip_cbst_ip6(). It must not be freed:
+const ip_cbst_node* ip_builtin_cbst(size_t *nmemb);
+
+// As ip_cbst_lookup_ip() over ip_builtin_cbst():
+const ip_cbst_node* ip_builtin_lookup_ip(in_addr_t ip);
@@ -0,0 +1,151 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include <ip-cache.h>
+#include <assert.h>
+
+#include <stdlib.h>     // For posix_memalign(), free()
+#include <string.h>     // For memset()
+
+// Sets are picked by a multiplicative hash of the prefix, so that
+// neighbouring networks, which are often busy together, do not all
+// land in one set:
+static inline ip_cache_set* set_of(ip_cache *cache, uint32_t prefix)
+{
+    return cache->sets + ((prefix*0x9e3779b1u) >> (32-IP_CACHE_SET_BITS));
+}
+
+
+ip_cache* ip_cache_new(size_t n, unsigned prefix)
+{
+    ip_cache *cache;
+    size_t i;
+
+    assert( prefix>=8 && prefix<=32 );
+
+    if( 0!=posix_memalign((void**)&cache, 64, n*sizeof(ip_cache)) ) {
+        return NULL;
+    }
+    memset(cache, 0, n*sizeof(ip_cache));
+    for(i=0; i<n; i++) {
+        cache[i].shift = 32-prefix;
+    }
+    return cache;
+}
+
+
+static const ip_cbst_node* probe(ip_cache *cache, uint32_t prefix)
+{
+    ip_cache_set *set = set_of(cache, prefix);
+    int i;
+
+    for(i=0; i<IP_CACHE_WAYS; i++) {
+        if( set->prefix[i]==prefix && set->node[i]!=NULL ) {
+            set->used |= 1u<<i;
+            return set->node[i];
+        }
+    }
+    return NULL;
+}
+
+
+// Keeps the answer for an address if its range has the whole of the
+// address's prefix in it. Stores come after a whole batch has been
+// probed, so the same prefix may come up several times, and it takes
+// the addresses that are seen once, which are most of them, as long
+// to go by as the busy ones; a way that has had a hit since the clock
+// hand last passed it is skipped, once:
+static void store(ip_cache *cache, in_addr_t ip, const ip_cbst_node *node)
+{
+    uint32_t      prefix = ip >> cache->shift;
+    uint32_t      first  = (uint32_t)((uint64_t)prefix << cache->shift);
+    uint32_t      last   = first | (uint32_t)(((uint64_t)1 << cache->shift) - 1);
+    ip_cache_set *set;
+    uint32_t      i;
+
+    if( node==NULL || node->addr_lo > first || last > node->addr_hi ) {
+        return;
+    }
+    set = set_of(cache, prefix);
+    for(i=0; i<IP_CACHE_WAYS; i++) {
+        if( set->prefix[i]==prefix && set->node[i]!=NULL ) {
+            return;
+        }
+    }
+    for(i=set->next; set->used & (1u<<i); i=(i+1)%IP_CACHE_WAYS) {
+        set->used &= ~(1u<<i);
+    }
+    set->prefix[i] = prefix;
+    set->node[i]   = node;
+    set->next      = (i+1)%IP_CACHE_WAYS;
+    cache->stores++;
+}
+
+
+// The hits are answered as they are found; the misses are gathered up
+// and handed to the engine together, so that they still have its
+// interleaving, then stored:
+static void lookup_chunk(ip_cache *cache, const ip_engine *engine,
+                         const in_addr_t *ips, const ip_cbst_node **out, size_t n)
+{
+    const ip_cbst_node *node;
+    size_t i, nmiss = 0;
+
+    for(i=0; i<n; i++) {
+        node = probe(cache, ips[i] >> cache->shift);
+        if( node!=NULL ) {
+            out[i] = node;
+        } else {
+            cache->miss_ip[nmiss] = ips[i];
+            cache->miss_at[nmiss] = i;
+            nmiss++;
+        }
+    }
+
+    ip_engine_lookup_batch(engine, cache->miss_ip, cache->miss_node, nmiss);
+    for(i=0; i<nmiss; i++) {
+        out[cache->miss_at[i]] = cache->miss_node[i];
+        store(cache, cache->miss_ip[i], cache->miss_node[i]);
+    }
+
+    cache->lookups += n;
+    cache->hits    += n-nmiss;
+}
+
+
+void ip_cache_lookup_batch(ip_cache *cache, const ip_engine *engine, uint64_t generation,
+                           const in_addr_t *ips, const ip_cbst_node **out, size_t n)
+{
+    size_t i;
+
+    if( generation!=cache->generation ) {
+        memset(cache->sets, 0, sizeof(cache->sets));
+        cache->generation = generation;
+    }
+    for(i=0; i<n; i+=IP_CACHE_CHUNK) {
+        lookup_chunk(cache, engine, ips+i, out+i, n-i < IP_CACHE_CHUNK ? n-i : IP_CACHE_CHUNK);
+    }
+}
+
+
+// Sums the threads' caches:
+void ip_cache_report(const ip_cache *cache, size_t n, FILE *fp)
+{
+    uint64_t lookups = 0, hits = 0, stores = 0;
+    size_t t;
+
+    for(t=0; t<n; t++) {
+        lookups += cache[t].lookups;
+        hits    += cache[t].hits;
+        stores  += cache[t].stores;
+    }
+    fprintf(fp, "/%u cache: %llu lookups, %llu hits (%.1f%%), %llu stores\n",
+            n>0 ? 32-cache[0].shift : IP_CACHE_PREFIX, (unsigned long long)lookups,
+            (unsigned long long)hits, lookups>0 ? 100.0*hits/lookups : 0.0,
+            (unsigned long long)stores);
+}
+
+
+void ip_cache_free(ip_cache *cache)
+{
+    free(cache);
+}
@@ -0,0 +1,59 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <ip-cbst.h>
+#include <ip-engine.h>
+
+// A small set-associative cache of results in front of an engine, for
+// --cache. Real traffic is skewed: a few networks send most of it, so
+// the same prefixes come up again and again. An entry maps a prefix,
+// a /24 by default, to the range that holds all of it, and a prefix
+// that straddles two ranges, or a gap, is never stored; whatever
+// address in it is looked up, the answer is the same, so a hit is
+// always right. Each thread that looks addresses up has a cache of its
+// own, and a set is one cache line: a hit is one L1 access.
+#define IP_CACHE_PREFIX   24
+#define IP_CACHE_SET_BITS 8
+#define IP_CACHE_SETS     (1<<IP_CACHE_SET_BITS)
+#define IP_CACHE_WAYS     4
+
+// Batches are taken this many addresses at a time, so that what one
+// chunk stores is there for the next:
+#define IP_CACHE_CHUNK    64
+
+typedef struct ip_cache     ip_cache;
+typedef struct ip_cache_set ip_cache_set;
+
+struct ip_cache_set {
+    uint32_t            prefix[IP_CACHE_WAYS];  // The address shifted right
+    const ip_cbst_node *node[IP_CACHE_WAYS];    // NULL where the way is empty
+    uint32_t            used;                   // A bit per way, set by hits
+    uint32_t            next;                   // Where the clock hand is
+} __attribute__((aligned(64)));
+
+struct ip_cache {
+    ip_cache_set        sets[IP_CACHE_SETS];
+    unsigned            shift;                      // 32 less the prefix length
+    uint64_t            generation;                 // Of the nodes held
+    in_addr_t           miss_ip[IP_CACHE_CHUNK];    // The misses in a chunk,
+    const ip_cbst_node *miss_node[IP_CACHE_CHUNK];  // what they are in,
+    uint32_t            miss_at[IP_CACHE_CHUNK];    // and where they came from
+    uint64_t            lookups;
+    uint64_t            hits;
+    uint64_t            stores;
+};
+
+// 'n' empty caches over prefixes of 'prefix' bits, from 8 to 32:
+ip_cache* ip_cache_new(size_t n, unsigned prefix);
+
+// As ip_engine_lookup_batch(), answering what it can from the cache.
+// The cache holds pointers into the engine's nodes, so it must only
+// ever be used with one engine, or be told of a new one by a change
+// of 'generation':
+void      ip_cache_lookup_batch(ip_cache *cache, const ip_engine *engine, uint64_t generation,
+                                const in_addr_t *ips, const ip_cbst_node **out, size_t n);
+
+void      ip_cache_report(const ip_cache *cache, size_t n, FILE *fp);
+void      ip_cache_free(ip_cache *cache);
@@ -1,22 +1,137 @@
 #define _POSIX_C_SOURCE 200809L
+#define _GNU_SOURCE 1           // For MAP_ANONYMOUS, MAP_POPULATE, copy_file_range()
 
 #include <defaults.h>
 #include <ip-cbst.h>
+#include <ip6-cbst.h>
+#include <ip-parse.h>
 #include <assert.h>
 
 #include <stdbool.h>    // For C99 bool/true/false
 #include <stdio.h>      // For fopen(), etc.
 #include <string.h>     // For strncat()
 #include <stdlib.h>     // For exit(), getenv()
+#include <sys/param.h>  // For MIN()
+#include <limits.h>     // For PATH_MAX
 
 // For stat()
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <unistd.h>
 
+#include <pthread.h>
+#include <sys/mman.h>   // For mmap(), shm_open()
+#include <sys/file.h>   // For flock()
+#include <fcntl.h>      // For O_* constants
+#include <errno.h>
+
+#ifndef MAP_POPULATE
+#define MAP_POPULATE 0
+#endif
+
+
+// Where the IPv6 nodes start, relative to the IPv4 ones:
+static inline size_t offset6_of(size_t nmemb) {
+    return (nmemb*sizeof(ip_cbst_node) + IP_CBST_ALIGN-1) & ~(size_t)(IP_CBST_ALIGN-1);
+}
+
+// Fills in everything but the checksums:
+static void init_header(ip_cbst_header *hdr, size_t nmemb, size_t nmemb6) {
+    memset(hdr, 0, sizeof(ip_cbst_header));
+    memcpy(hdr->magic, IP_CBST_MAGIC, sizeof(hdr->magic));
+    hdr->version    = IP_CBST_VERSION;
+    hdr->endian     = IP_CBST_ENDIAN;
+    hdr->node_size  = sizeof(ip_cbst_node);
+    hdr->layout     = IP_CBST_LAYOUT_CBST;
+    hdr->nmemb      = nmemb;
+    hdr->node6_size = sizeof(ip6_cbst_node);
+    hdr->nmemb6     = nmemb6;
+    hdr->offset6    = offset6_of(nmemb);
+}
+
+static inline ip_cbst_header *header_of(const ip_cbst_node *cbst) {
+    return (ip_cbst_header*)((char*)cbst - IP_CBST_HDR_SIZE);
+}
+
+// Size of the whole image, header included:
+static inline size_t image_size(size_t nmemb, size_t nmemb6) {
+    return IP_CBST_HDR_SIZE + offset6_of(nmemb) + nmemb6*sizeof(ip6_cbst_node);
+}
+
+
+// Trees live behind an IP_CBST_HDR_SIZE header, exactly as they are
+// laid out on disk, whether they were built in memory or mapped from a
+// binary database, so that ip_cbst_free() can release either:
+static ip_cbst_node* image_new(size_t nmemb, size_t nmemb6) {
+    void *image;
+
+    image = mmap(NULL, image_size(nmemb, nmemb6), PROT_READ|PROT_WRITE,
+                 MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+    if( image==MAP_FAILED ) {
+        return NULL;
+    }
+    init_header(image, nmemb, nmemb6);
+
+    return (ip_cbst_node*)((char*)image + IP_CBST_HDR_SIZE);
+}
 
 ip_cbst_node* ip_cbst_new(size_t nmemb) {
-    return cbst_new(nmemb, sizeof(ip_cbst_node));
+    return image_new(nmemb, 0);
+}
+
+
+void ip_cbst_free(const ip_cbst_node *cbst) {
+    if( cbst!=NULL ) {
+        munmap(header_of(cbst), image_size(header_of(cbst)->nmemb, header_of(cbst)->nmemb6));
+    }
+}
+
+
+// Gives the pages that hold only IPv4 nodes back, for an engine that
+// keeps everything it answers from in an index of its own. The header
+// and the IPv6 tree are left as they are, and 'cbst' must still be
+// released with ip_cbst_free(), but its IPv4 nodes must not be read
+// again; those of a mapped file would be read back in:
+void ip_cbst_release_ip4(const ip_cbst_node *cbst) {
+    size_t page = sysconf(_SC_PAGESIZE);
+    size_t len  = header_of(cbst)->nmemb*sizeof(ip_cbst_node) / page * page;
+
+    if( len>0 ) {
+        madvise((void*)cbst, len, MADV_DONTNEED);
+    }
+}
+
+
+// The IPv6 tree that shares an image with 'cbst':
+const ip6_cbst_node* ip_cbst_ip6(const ip_cbst_node *cbst, size_t *nmemb6) {
+    const ip_cbst_header *hdr = header_of(cbst);
+
+    assert( nmemb6!=NULL );
+    *nmemb6 = hdr->nmemb6;
+    return (const ip6_cbst_node*)((const char*)cbst + hdr->offset6);
+}
+
+
+// FNV-1a over 64-bit words, so that verifying a mapped database costs
+// about as much as reading it:
+static uint64_t checksum(const void *buf, size_t len) {
+    const unsigned char *p = buf;
+    uint64_t h = 0xcbf29ce484222325ULL;
+    uint64_t w;
+    size_t   i;
+
+    for(i=0; i+sizeof(w)<=len; i+=sizeof(w)) {
+        memcpy(&w, p+i, sizeof(w));
+        h = (h ^ w) * 0x100000001b3ULL;
+    }
+    for(; i<len; i++) {
+        h = (h ^ p[i]) * 0x100000001b3ULL;
+    }
+    return h;
+}
+
+uint64_t ip_cbst_checksum(const ip_cbst_node *cbst, size_t nmemb) {
+    return checksum(cbst, nmemb*sizeof(ip_cbst_node));
 }
 
 size_t ip_cbst_add_node(ip_cbst_node *root, size_t nmemb, size_t pos, const ip_cbst_node *node) {
@@ -27,13 +142,16 @@ size_t ip_cbst_add_node(ip_cbst_node *root, size_t nmemb, size_t pos, const ip_c
     return cbst_add(root, nmemb, sizeof(ip_cbst_node), pos, node);
 }
 
+// Returns the index at which the record was placed, or 'nmemb' if
+// either address is not a dotted quad:
 size_t ip_cbst_add_dq(ip_cbst_node *root, size_t nmemb, size_t pos, 
                       const char *dq_lo, const char *dq_hi, const char *cc)
 {
     ip_cbst_node node;
 
-    node.addr_lo = ntohl(inet_addr(dq_lo));
-    node.addr_hi = ntohl(inet_addr(dq_hi));
+    if( 0==ip_parse_dq_str(dq_lo, &node.addr_lo) || 0==ip_parse_dq_str(dq_hi, &node.addr_hi) ) {
+        return nmemb;
+    }
     node.cc[0] = cc[0];
     node.cc[1] = cc[1];
     node.cc[2] = '\0';
@@ -57,52 +175,108 @@ int ip_cbst_compar(const void* node, const void* ipp) {
 }
 
 
+// Specialization of cbst_descend() for IPv4 ranges. Only 'addr_lo' is
+// examined on the way down; 'addr_hi' is checked once at the end:
 const ip_cbst_node* ip_cbst_lookup_ip(const ip_cbst_node *root, size_t nmemb, in_addr_t ip) {
+    const ip_cbst_node *node;
+    size_t k = 1;
+
     if( root==NULL ) {
         return NULL;
     }
 
-    return cbst_find(root, nmemb, sizeof(ip_cbst_node), ip_cbst_compar, &ip, 0);
+    while( k <= nmemb ) {
+        k = (k<<1) + (root[k-1].addr_lo <= ip);
+    }
+    k >>= __builtin_ctzl(k)+1;
+
+    if( k==0 ) {
+        // Below the lowest range
+        return NULL;
+    }
+    node = root+k-1;
+    return ip <= node->addr_hi ? node : NULL;
 }
 
 
-const ip_cbst_node* ip_cbst_lookup_dq(const ip_cbst_node *root, size_t nmemb, const char* dq) {
-    in_addr_t ip =  ntohl(inet_addr(dq));
-    return ip_cbst_lookup_ip(root, nmemb, ip);
-}
+// Batched lookup: IP_CBST_BATCH queries descend the tree in lockstep,
+// one level at a time, and each step prefetches the query's
+// grandchildren. The prefetches for a whole group are in flight while
+// the rest of the group is stepped, so the cache misses overlap rather
+// than being paid one query at a time.
+void ip_cbst_lookup_batch(const ip_cbst_node *root, size_t nmemb,
+                          const in_addr_t *ips, const ip_cbst_node **out, size_t n)
+{
+    size_t k[IP_CBST_BATCH];
+    size_t i, j, m, d, h;
 
+    assert( n==0 || ips!=NULL );
+    assert( n==0 || out!=NULL );
 
-static size_t count_lines(FILE *fp) {
-    rewind(fp);
-    int c;
-    size_t n=0;
+    if( root==NULL || nmemb==0 ) {
+        for(i=0; i<n; i++) {
+            out[i] = NULL;
+        }
+        return;
+    }
+
+    // Levels in the tree; all but the last are full:
+    h = 8*sizeof(size_t)-__builtin_clzl(nmemb);
 
-    while( EOF!=(c=getc(fp)) ) {
-        if(c=='\n') {
-            n++;
+    for(i=0; i<n; i+=m) {
+        m = MIN(n-i, IP_CBST_BATCH);
+
+        for(j=0; j<m; j++) {
+            k[j] = 1;
+        }
+        for(d=1; d<h; d++) {
+            for(j=0; j<m; j++) {
+                k[j] = (k[j]<<1) + (root[k[j]-1].addr_lo <= ips[i+j]);
+                __builtin_prefetch(root+(k[j]<<2)-1);
+            }
+        }
+        // The bottom level may be partial:
+        for(j=0; j<m; j++) {
+            if( k[j] <= nmemb ) {
+                k[j] = (k[j]<<1) + (root[k[j]-1].addr_lo <= ips[i+j]);
+            }
+            k[j] >>= __builtin_ctzl(k[j])+1;
+            if( k[j]==0 || ips[i+j] > root[k[j]-1].addr_hi ) {
+                out[i+j] = NULL;
+            } else {
+                out[i+j] = root+k[j]-1;
+            }
         }
     }
-    rewind(fp);
-    return n;
 }
 
 
-static char *next_word(char *str) {
-    while( *str!=' ' && *str!='\0' ) {
-        str++;
-    }
-    if( *str=='\0' ) {
+// Generic path, for comparison with the specialization above:
+const ip_cbst_node* ip_cbst_lookup_ip_generic(const ip_cbst_node *root, size_t nmemb, in_addr_t ip) {
+    return cbst_search(root, nmemb, sizeof(ip_cbst_node), ip_cbst_compar, &ip);
+}
+
+
+const ip_cbst_node* ip_cbst_lookup_dq(const ip_cbst_node *root, size_t nmemb, const char* dq) {
+    in_addr_t ip;
+
+    if( 0==ip_parse_dq_str(dq, &ip) ) {
         return NULL;
     }
-    str++;
-    if( *str!='\0' ) {
-        return str;
-    }
-    return NULL;
+    return ip_cbst_lookup_ip(root, nmemb, ip);
 }
 
-char *ip_cbst_append_cidr(char *buf, in_addr_t lo, in_addr_t hi) {
+
+// Thread-safe inet_ntoa() of a host-order address:
+static const char *ntoa(in_addr_t addr, char *buf) {
     struct in_addr ip;
+
+    ip.s_addr = htonl(addr);
+    return inet_ntop(AF_INET, &ip, buf, INET_ADDRSTRLEN);
+}
+
+char *ip_cbst_append_cidr(char *buf, in_addr_t lo, in_addr_t hi) {
+    char dq[INET_ADDRSTRLEN];
     size_t len=0, naddrs=0, nbits=0, ncidr=0;
 
     naddrs = hi-lo + 1;
@@ -118,9 +292,8 @@ char *ip_cbst_append_cidr(char *buf, in_addr_t lo, in_addr_t hi) {
 
         if( ncidr & naddrs ) {
             // Append CIDR block to buf
-            ip.s_addr=htonl(lo);
             len=strlen(buf);
-            snprintf(buf+len, 20, " %s/%zu", inet_ntoa(ip), 32-nbits);
+            snprintf(buf+len, 20, " %s/%zu", ntoa(lo, dq), 32-nbits);
 //            printf("%zu, ", 32-nbits);
 
             // Adjust low address to account for this bit:
@@ -141,18 +314,16 @@ char *ip_cbst_append_cidr(char *buf, in_addr_t lo, in_addr_t hi) {
 // To be safe, buf must be a few hundred bytes long
 char *ip_cbst_address_range(const ip_cbst_node *node, char *buf) 
 {
-    struct in_addr ip;
+    char dq[INET_ADDRSTRLEN];
     size_t len, naddrs;
 
     assert(node!=NULL);
     assert(buf!=NULL);
 
     *buf='\0';
-    ip.s_addr=htonl(node->addr_lo);
-    strncat(buf, inet_ntoa(ip), 16);
+    strncat(buf, ntoa(node->addr_lo, dq), 16);
     strncat(buf, "-", 2);
-    ip.s_addr=htonl(node->addr_hi);
-    strncat(buf, inet_ntoa(ip), 16);
+    strncat(buf, ntoa(node->addr_hi, dq), 16);
     strncat(buf, " ", 2);
     len = strlen(buf);
     naddrs = node->addr_hi-node->addr_lo;
@@ -227,90 +398,442 @@ int ip_cbst_stat_dbfile(const char *first, const char *second, const char *envar
 
 
 
+// Parses one line of the IPv4 text database, "lo hi cc", into 'out';
+// -1 if it is malformed:
+static int parse_line(const char *p, size_t len, void *out)
+{
+    ip_cbst_node *node = out;
+    size_t m, k;
+
+    m = ip_parse_dq(p, len, &node->addr_lo);
+    if( m==0 || m+1>=len || p[m]!=' ' ) {
+        return -1;
+    }
+    k = ip_parse_dq(p+m+1, len-m-1, &node->addr_hi);
+    if( k==0 || m+k+4>len || p[m+1+k]!=' ' ) {
+        return -1;
+    }
+    node->cc[0] = p[m+k+2];
+    node->cc[1] = p[m+k+3];
+    node->cc[2] = '\0';
+    node->flag  = 0;
+    return 0;
+}
+
+// The same for IPv6 ranges:
+static int parse_line6(const char *p, size_t len, void *out)
+{
+    ip6_cbst_node *node = out;
+    size_t m, k;
+
+    m = ip_parse_ip6(p, len, &node->addr_lo);
+    if( m==0 || m+1>=len || p[m]!=' ' ) {
+        return -1;
+    }
+    k = ip_parse_ip6(p+m+1, len-m-1, &node->addr_hi);
+    if( k==0 || m+k+4>len || p[m+1+k]!=' ' ) {
+        return -1;
+    }
+    node->cc[0] = p[m+k+2];
+    node->cc[1] = p[m+k+3];
+    node->cc[2] = '\0';
+    node->flag  = 0;
+    return 0;
+}
+
+
+// A text database, mapped and cut at line boundaries into chunks that
+// are counted, then parsed, by threads of their own. The lines are
+// sorted, so once every chunk is counted, the first line of each has a
+// known position in sorted order, and each thread parses its lines
+// straight into their places in the tree with an iterator of its own:
+typedef struct {
+    const char *begin;
+    const char *end;
+    size_t      first;      // Sorted position of the first line
+    size_t      nlines;
+    void       *cbst;
+    size_t      nmemb;
+    size_t      size;
+    int       (*parse)(const char *line, size_t len, void *node);
+    const char *bad;        // First malformed line, if any
+} text_chunk;
+
+typedef struct {
+    const char *name;
+    char       *map;
+    size_t      len;
+    text_chunk *chunks;
+    size_t      nchunks;
+    size_t      nlines;
+} text_db;
+
+// Counts the lines in a chunk; the last may lack its newline:
+static void* count_chunk(void *arg)
+{
+    text_chunk *c = arg;
+    const char *p = c->begin, *nl;
+
+    c->nlines = 0;
+    while( p < c->end && NULL!=(nl=memchr(p, '\n', c->end-p)) ) {
+        c->nlines++;
+        p = nl+1;
+    }
+    if( p < c->end ) {
+        c->nlines++;
+    }
+    return NULL;
+}
+
+static void* parse_chunk(void *arg)
+{
+    text_chunk *c = arg;
+    const char *p = c->begin, *nl;
+    cbst_iter   it;
+    size_t      len;
+
+    cbst_iter_init(&it, c->nmemb, c->first);
+    for(; p < c->end; p=nl+1) {
+        nl  = memchr(p, '\n', c->end-p);
+        nl  = nl!=NULL ? nl : c->end;
+        len = nl-p;
+        if( 0!=c->parse(p, len, (char*)c->cbst+cbst_iter_next(&it)*c->size) ) {
+            c->bad = p;
+            break;
+        }
+    }
+    return NULL;
+}
+
+// Runs 'fn' on every chunk, the calling thread taking the first, and
+// any whose thread could not be started:
+static void run_chunks(void* (*fn)(void*), text_chunk *chunks, size_t n)
+{
+    pthread_t tids[IP_CBST_LOAD_THREADS];
+    bool      live[IP_CBST_LOAD_THREADS];
+    size_t    i;
+
+    for(i=1; i<n; i++) {
+        live[i] = 0==pthread_create(tids+i, NULL, fn, chunks+i);
+    }
+    for(i=0; i<n; i++) {
+        if( i==0 || !live[i] ) {
+            fn(chunks+i);
+        }
+    }
+    for(i=1; i<n; i++) {
+        if( live[i] ) {
+            pthread_join(tids[i], NULL);
+        }
+    }
+}
+
+// Maps the file and counts its lines. Returns 0, or -1 with errno set
+// and a message printed:
+static int text_open(text_db *t, FILE *fp, const char *name)
+{
+    struct stat st;
+    const char *cut, *nl;
+    long        ncpu;
+    size_t      i, n;
+
+    memset(t, 0, sizeof(text_db));
+    t->name = name;
+    if( fp==NULL ) {
+        return 0;
+    }
+    if( 0!=fstat(fileno(fp), &st) ) {
+        perror(name);
+        return -1;
+    }
+    t->len = st.st_size;
+    if( t->len==0 ) {
+        return 0;
+    }
+    t->map = mmap(NULL, t->len, PROT_READ, MAP_PRIVATE|MAP_POPULATE, fileno(fp), 0);
+    if( t->map==MAP_FAILED ) {
+        perror(name);
+        return -1;
+    }
+
+    ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+    n = MIN((size_t)(ncpu>0 ? ncpu : 1), t->len/IP_CBST_LOAD_CHUNK+1);
+    n = MIN(n, IP_CBST_LOAD_THREADS);
+    t->chunks = calloc(n, sizeof(text_chunk));
+    if( t->chunks==NULL ) {
+        perror(name);
+        return -1;
+    }
+
+    cut = t->map;
+    for(i=0; i<n && cut < t->map+t->len; i++) {
+        t->chunks[i].begin = cut;
+        cut = t->map + t->len*(i+1)/n;
+        if( cut < t->chunks[i].begin ) {
+            cut = t->chunks[i].begin;
+        }
+        nl  = i+1<n ? memchr(cut, '\n', t->map+t->len-cut) : NULL;
+        cut = nl!=NULL ? nl+1 : t->map+t->len;
+        t->chunks[i].end = cut;
+    }
+    t->nchunks = i;
+
+    run_chunks(count_chunk, t->chunks, t->nchunks);
+    for(i=0; i<t->nchunks; i++) {
+        t->chunks[i].first = t->nlines;
+        t->nlines += t->chunks[i].nlines;
+    }
+    return 0;
+}
+
+// Parses every line into its place in 'cbst', which has room for them
+// all. Returns 0, or -1 with errno set to EINVAL if a line is
+// malformed, which is named in a message:
+static int text_parse(text_db *t, void *cbst, size_t size,
+                      int (*parse)(const char *line, size_t len, void *node))
+{
+    const char *nl;
+    size_t i;
+
+    for(i=0; i<t->nchunks; i++) {
+        t->chunks[i].cbst  = cbst;
+        t->chunks[i].nmemb = t->nlines;
+        t->chunks[i].size  = size;
+        t->chunks[i].parse = parse;
+    }
+    run_chunks(parse_chunk, t->chunks, t->nchunks);
+
+    for(i=0; i<t->nchunks; i++) {
+        if( t->chunks[i].bad!=NULL ) {
+            nl = memchr(t->chunks[i].bad, '\n', t->chunks[i].end-t->chunks[i].bad);
+            fprintf(stderr, "%s: malformed line: %.*s\n", t->name,
+                    (int)((nl!=NULL ? nl : t->chunks[i].end) - t->chunks[i].bad), t->chunks[i].bad);
+            errno = EINVAL;
+            return -1;
+        }
+    }
+    return 0;
+}
+
+static void text_close(text_db *t)
+{
+    if( t->map!=NULL && t->map!=MAP_FAILED ) {
+        munmap(t->map, t->len);
+    }
+    free(t->chunks);
+}
+
+
+// Builds one image from the IPv4 text database and, if there is one,
+// the IPv6 text database. Each is mapped, counted and parsed in
+// parallel chunks, straight into the image. Returns NULL with errno
+// set, and a message printed, if the IPv4 database cannot be read or
+// either has a malformed line:
 const ip_cbst_node* ip_cbst_load_text(const char *filename, size_t* nmemb)
 {
     FILE    *fp      = NULL;    // Text database file
-    char    *line    = NULL;    // Current line in file
-    size_t   len     = 0;       // Length of current line
-    ssize_t  n_read  = 0;       // Number of bytes read
-    size_t   n_lines = 0;       // Number of lines in file
-
-    char    *dq_lo = NULL;      // Low IP address as dotted quad
-    char    *dq_hi = NULL;      // High IP address as dotted quad
-    char    *cc = NULL;         // Two-character country code
+    FILE    *fp6     = NULL;    // IPv6 text database file, if any
+    text_db  text, text6;
+    const char *name = filename!=NULL ? filename : IP2CC_TXTDB_NAME;
 
     ip_cbst_node *cbst = NULL;  // CBST we will return
-    size_t line_nr = 0;         // Current line number in file (starting at zero)
-    size_t index   = 0;         // Index at which record was placed in CBST
-    (void) index;
-    
+    size_t        nmemb6;
+    int           ok, err;
 
     assert( nmemb!=NULL );
+    memset(&text6, 0, sizeof(text6));
     fp = ip_cbst_open_dbfile(filename, IP2CC_TXTDB_NAME, IP2CC_TXTDB_ENVAR, "r", false);
-    assert( fp!=NULL );
-
-    n_lines = count_lines(fp);
-    cbst = ip_cbst_new(n_lines);
-
-    line_nr = 0;
-    while( -1 != (n_read=getline(&line, &len, fp)) ) {
-//        printf("line_nr: %zu", line_nr);
-        dq_lo = line;
-        dq_hi = next_word(line);
-        *(dq_hi-1)='\0';
-        cc    = next_word(dq_hi); 
-        *(cc-1)='\0';
-        index = ip_cbst_add_dq(cbst, n_lines, line_nr, dq_lo, dq_hi, cc);
-        line_nr++;
-//        printf(", index: %zu\n", index);
+    if( fp==NULL ) {
+        perror(name);
+        return NULL;
     }
+    fp6 = ip_cbst_open_dbfile(NULL, IP2CC_TXTDB6_NAME, IP2CC_TXTDB6_ENVAR, "r", false);
+
+    ok = 0==text_open(&text, fp, name) && 0==text_open(&text6, fp6, IP2CC_TXTDB6_NAME);
+    err = errno;
     fclose(fp);
-    free(line);
+    if( fp6!=NULL ) {
+        fclose(fp6);
+    }
+
+    if( ok ) {
+        cbst = image_new(text.nlines, text6.nlines);
+        if( cbst==NULL ) {
+            perror(name);
+        }
+        ok  = cbst!=NULL
+              && 0==text_parse(&text, cbst, sizeof(ip_cbst_node), parse_line)
+              && 0==text_parse(&text6, (ip6_cbst_node*)ip_cbst_ip6(cbst, &nmemb6),
+                               sizeof(ip6_cbst_node), parse_line6);
+        err = errno;
+    }
+    text_close(&text);
+    text_close(&text6);
+
+    if( !ok ) {
+        ip_cbst_free(cbst);
+        errno = err;
+        return NULL;
+    }
+    *nmemb = text.nlines;
+    return cbst;
+}
+
+
+// The whole IP_CBST_HDR_SIZE header for the image, checksums included:
+static void make_header(char *hdr, const ip_cbst_node *cbst, size_t nmemb)
+{
+    ip_cbst_header *h = (ip_cbst_header*)hdr;
+    const ip6_cbst_node *cbst6;
+    size_t nmemb6;
+
+    assert( cbst!=NULL );
+    assert( nmemb==header_of(cbst)->nmemb );
+
+    cbst6 = ip_cbst_ip6(cbst, &nmemb6);
+    memset(hdr, 0, IP_CBST_HDR_SIZE);
+    init_header(h, nmemb, nmemb6);
+    h->checksum  = ip_cbst_checksum(cbst, nmemb);
+    h->checksum6 = checksum(cbst6, nmemb6*sizeof(ip6_cbst_node));
+}
+
+
+// Writes the header and both trees, and the padding between them, to
+// 'fp'; -1 on a write error:
+static int write_image(FILE *fp, const ip_cbst_node *cbst, size_t nmemb)
+{
+    char hdr[IP_CBST_HDR_SIZE];
+    size_t nmemb6, size;
+
+    make_header(hdr, cbst, nmemb);
+    ip_cbst_ip6(cbst, &nmemb6);
+    size = image_size(nmemb, nmemb6) - IP_CBST_HDR_SIZE;
+
+    if( 1 != fwrite(hdr, sizeof(hdr), 1, fp)
+        || (size>0 && 1 != fwrite(cbst, size, 1, fp)) ) {
+        return -1;
+    }
+    return 0;
+}
+
 
-    *nmemb = n_lines;
+// Maps the image in 'fd' read-only and checks that this build can use
+// it; the checksums are only verified if 'verify' is set. Returns NULL
+// if the image is not usable, naming it in a message if it is not a
+// database at all:
+static const ip_cbst_node* map_image(int fd, int flags, bool verify, const char *name, size_t *nmemb)
+{
+    void           *map = NULL;
+    ip_cbst_header *hdr = NULL;
+    ip_cbst_node   *cbst = NULL;
+    struct stat     st;
+
+    if( 0!=fstat(fd, &st) || (size_t)st.st_size < IP_CBST_HDR_SIZE ) {
+        return NULL;
+    }
+    map = mmap(NULL, st.st_size, PROT_READ, flags, fd, 0);
+    if( map==MAP_FAILED ) {
+        return NULL;
+    }
+
+    hdr  = map;
+    cbst = (ip_cbst_node*)((char*)map + IP_CBST_HDR_SIZE);
+    if( 0!=memcmp(hdr->magic, IP_CBST_MAGIC, sizeof(hdr->magic))
+        || hdr->version   != IP_CBST_VERSION
+        || hdr->endian    != IP_CBST_ENDIAN
+        || hdr->node_size != sizeof(ip_cbst_node)
+        || hdr->layout    != IP_CBST_LAYOUT_CBST
+        || hdr->node6_size!= sizeof(ip6_cbst_node)
+        || hdr->offset6   != offset6_of(hdr->nmemb)
+        || image_size(hdr->nmemb, hdr->nmemb6) != (size_t)st.st_size
+        || (verify && hdr->checksum  != ip_cbst_checksum(cbst, hdr->nmemb))
+        || (verify && hdr->checksum6 != checksum((char*)cbst + hdr->offset6, hdr->nmemb6*sizeof(ip6_cbst_node))) ) {
+        fprintf(stderr, "%s: not a usable ip2cc database\n", name);
+        munmap(map, st.st_size);
+        return NULL;
+    }
+
+    *nmemb = hdr->nmemb;
     return cbst;
 }
 
 
-void ip_cbst_save_bin(const ip_cbst_node *cbst, size_t nmemb, const char *filename)
+// Writes the image to a temporary file and renames it into place, so
+// that processes with the old database mapped keep a consistent view
+// of it. The first of the names that can be written is used. Returns
+// 0, or -1 with errno set if none can be:
+int ip_cbst_save_bin(const ip_cbst_node *cbst, size_t nmemb, const char *filename)
 {
     FILE *fp = NULL;
-    
-    assert( cbst!=NULL );
-    fp = ip_cbst_open_dbfile(filename, IP2CC_BINDB_NAME, IP2CC_BINDB_ENVAR, "wb", false); 
-    assert(fp!=NULL);
-    
-    fwrite(&nmemb, sizeof(size_t), 1, fp);
-    fwrite(cbst, sizeof(ip_cbst_node), nmemb, fp);
+    const char *files[3];
+    char tmpname[PATH_MAX];
+    size_t i;
+    int err = ENOENT;
 
-    fclose(fp);
+    files[0] = filename;
+    files[1] = IP2CC_BINDB_NAME;
+    files[2] = getenv(IP2CC_BINDB_ENVAR);
+
+    for(i=0; i<3; i++) {
+        if( files[i]==NULL ) {
+            continue;
+        }
+        snprintf(tmpname, sizeof(tmpname), "%s.%ld.tmp", files[i], (long)getpid());
+        fp = fopen(tmpname, "wb");
+        if( fp==NULL ) {
+            err = errno;
+            continue;
+        }
+        if( 0 != write_image(fp, cbst, nmemb)
+            || 0 != fclose(fp)
+            || 0 != rename(tmpname, files[i]) ) {
+            err = errno;
+            perror(tmpname);
+            unlink(tmpname);
+            continue;
+        }
+        return 0;
+    }
+    errno = err;
+    return -1;
 }
 
 
-const ip_cbst_node* ip_cbst_load_bin(const char *filename, size_t *nmemb)
+// Maps a binary database in place. Only the header and the size of the
+// file are checked, so that no more of it is read than lookups touch;
+// the checksums, which cover every page, are only verified if 'verify'
+// is set. Returns NULL if the file cannot be opened or is not a
+// database this build can use, in which case the caller should rebuild
+// it from the text:
+const ip_cbst_node* ip_cbst_load_bin(const char *filename, size_t *nmemb, bool verify)
 {
-    FILE         *fp   = NULL;
-    ip_cbst_node *cbst = NULL;
+    FILE               *fp   = NULL;
+    const ip_cbst_node *cbst = NULL;
 
     assert(nmemb!=NULL);
     fp = ip_cbst_open_dbfile(filename, IP2CC_BINDB_NAME, IP2CC_BINDB_ENVAR, "rb", false);
-    assert(fp!=NULL);
-    
-    fread(nmemb, sizeof(size_t), 1, fp);
-    cbst = ip_cbst_new(*nmemb);
-    fread(cbst, sizeof(ip_cbst_node), *nmemb, fp);
-
+    if( fp==NULL ) {
+        return NULL;
+    }
+    cbst = map_image(fileno(fp), MAP_PRIVATE, verify,
+                     filename!=NULL ? filename : IP2CC_BINDB_NAME, nmemb);
     fclose(fp);
 
     return cbst;
 }
 
 
-const ip_cbst_node* ip_cbst_load(const char *stub, size_t *nmemb)
+// Loads the text database if it is newer than the binary one, or
+// there is no usable binary one, and saves it as binary for next time;
+// otherwise maps the binary one, verifying its checksums if 'verify' is
+// set. Returns NULL, with errno set and a message printed, if neither
+// can be loaded:
+const ip_cbst_node* ip_cbst_load(const char *stub, size_t *nmemb, bool verify)
 {
 //    int len = 0;
     struct stat bin_stat;
     struct stat txt_stat;
+    struct stat txt6_stat;
     const ip_cbst_node* cbst = NULL;
 
     // FIXME
@@ -319,20 +842,382 @@ const ip_cbst_node* ip_cbst_load(const char *stub, size_t *nmemb)
 
     if( ip_cbst_stat_dbfile(NULL, IP2CC_BINDB_NAME, IP2CC_BINDB_ENVAR, &bin_stat, false) ) {
         // Presume that file does not exist
-        cbst = ip_cbst_load_text(NULL, nmemb);
-        ip_cbst_save_bin(cbst, *nmemb, NULL);
+        cbst = NULL;
     } else if(  ip_cbst_stat_dbfile(NULL, IP2CC_TXTDB_NAME, IP2CC_TXTDB_ENVAR, &txt_stat, false) ) {
         // Neither the .db (text) or .bin (binary) versions are stat()-able
         perror("failed to stat() any data files");
-        exit(EXIT_FAILURE);
-    } else {
-        if( txt_stat.st_mtime > bin_stat.st_mtime ) {
-            cbst = ip_cbst_load_text(NULL, nmemb);
-            ip_cbst_save_bin(cbst, *nmemb, NULL);
-        } else {
-            cbst = ip_cbst_load_bin(NULL, nmemb);
-        }
+        return NULL;
+    } else if( txt_stat.st_mtime <= bin_stat.st_mtime
+               && (0!=ip_cbst_stat_dbfile(NULL, IP2CC_TXTDB6_NAME, IP2CC_TXTDB6_ENVAR, &txt6_stat, false)
+                   || txt6_stat.st_mtime <= bin_stat.st_mtime) ) {
+        cbst = ip_cbst_load_bin(NULL, nmemb, verify);
     }
 
+    if( cbst==NULL ) {
+        cbst = ip_cbst_load_text(NULL, nmemb);
+        if( cbst!=NULL && 0!=ip_cbst_save_bin(cbst, *nmemb, NULL) ) {
+            // Still usable; the next process rebuilds it too
+            perror("cannot save the binary database");
+        }
+    }
     return cbst;
 }
+
+
+// Writes the nodes of 'new' that differ from those of 'old', which are
+// 'n' nodes of 'size' bytes at 'offset' in 'fd', one pwrite() for each
+// contiguous run of them; -1 on a write error:
+static int write_changes(int fd, off_t offset, const char *old, const char *new,
+                         size_t n, size_t size, ip_cbst_update_stats *stats)
+{
+    size_t i, j;
+
+    for(i=0; i<n; i=j) {
+        if( 0==memcmp(old+i*size, new+i*size, size) ) {
+            j = i+1;
+            continue;
+        }
+        for(j=i+1; j<n && 0!=memcmp(old+j*size, new+j*size, size); j++)
+            ;
+        if( (ssize_t)((j-i)*size) != pwrite(fd, new+i*size, (j-i)*size, offset+i*size) ) {
+            return -1;
+        }
+        stats->changed += j-i;
+        stats->slices++;
+        stats->bytes   += (j-i)*size;
+    }
+    return 0;
+}
+
+
+// Copies all of 'in' to 'out', in the kernel, and where the filesystem
+// can share extents between files without copying the data at all; -1
+// on an error:
+static int copy_file(int in, int out, size_t len)
+{
+    ssize_t n;
+
+    while( len>0 ) {
+        n = copy_file_range(in, NULL, out, NULL, len, 0);
+        if( n<=0 ) {
+            if( n==0 ) {
+                errno = EIO;    // The file shrank under us
+            }
+            return -1;
+        }
+        len -= n;
+    }
+    return 0;
+}
+
+
+// Brings the binary database up to date with the text one, writing as
+// little as it can. The text is read into a new image, which is
+// compared with the binary database node by node; since both are laid
+// out by the same iterator, trees with the same number of nodes differ
+// exactly where the sorted ranges do, and only the runs of nodes that
+// changed, and the header, are written. If either count changed, every
+// node after the first difference moves, so the whole database is
+// rewritten with ip_cbst_save_bin() instead.
+//
+// The file is never written in place, since processes that have it
+// mapped would see a tree that is half old and half new: the changes
+// go into a copy of it, which is renamed over it once it is complete,
+// as ip_cbst_save_bin() does. The copy is made with copy_file_range(),
+// which on filesystems that share extents copies nothing but what is
+// written. Returns 0, or -1 with errno set:
+int ip_cbst_update(const char *filename, ip_cbst_update_stats *stats)
+{
+    const ip_cbst_node  *cbst = NULL, *old = NULL;
+    const ip6_cbst_node *cbst6, *old6;
+    const char *files[3], *name = NULL;
+    char   hdr[IP_CBST_HDR_SIZE];
+    char   tmpname[PATH_MAX];
+    size_t nmemb, nmemb6, old_nmemb = 0, old_nmemb6 = 0, i;
+    int    fd = -1, tmp = -1, ret = -1, err;
+
+    assert( stats!=NULL );
+    memset(stats, 0, sizeof(ip_cbst_update_stats));
+    tmpname[0] = '\0';
+
+    cbst = ip_cbst_load_text(NULL, &nmemb);
+    if( cbst==NULL ) {
+        return -1;
+    }
+    cbst6 = ip_cbst_ip6(cbst, &nmemb6);
+    stats->nmemb  = nmemb;
+    stats->nmemb6 = nmemb6;
+    stats->size   = image_size(nmemb, nmemb6);
+
+    // The database to update, found as ip_cbst_load_bin() finds it:
+    files[0] = filename;
+    files[1] = IP2CC_BINDB_NAME;
+    files[2] = getenv(IP2CC_BINDB_ENVAR);
+    for(i=0; i<3 && fd<0; i++) {
+        if( files[i]!=NULL ) {
+            name = files[i];
+            fd   = open(name, O_RDONLY|O_CLOEXEC);
+        }
+    }
+    if( fd>=0 ) {
+        old = map_image(fd, MAP_SHARED, true, name, &old_nmemb);
+    }
+    if( old!=NULL ) {
+        old6 = ip_cbst_ip6(old, &old_nmemb6);
+        stats->old_nmemb  = old_nmemb;
+        stats->old_nmemb6 = old_nmemb6;
+    }
+
+    if( old==NULL || old_nmemb!=nmemb || old_nmemb6!=nmemb6 ) {
+        stats->rebuilt = true;
+        stats->changed = nmemb+nmemb6;
+        stats->bytes   = stats->size;
+        ret = ip_cbst_save_bin(cbst, nmemb, filename);
+        goto out;
+    }
+
+    // Nothing changed; the file is only marked as up to date, so that
+    // it is not taken to be older than the text:
+    if( 0==memcmp(old, cbst, nmemb*sizeof(ip_cbst_node))
+        && 0==memcmp(old6, cbst6, nmemb6*sizeof(ip6_cbst_node)) ) {
+        ret = utimensat(AT_FDCWD, name, NULL, 0);
+        goto out;
+    }
+
+    snprintf(tmpname, sizeof(tmpname), "%s.%ld.tmp", name, (long)getpid());
+    tmp = open(tmpname, O_WRONLY|O_CREAT|O_TRUNC|O_CLOEXEC, 0644);
+    if( tmp<0 ) {
+        tmpname[0] = '\0';
+        goto out;
+    }
+    if( 0!=copy_file(fd, tmp, stats->size)
+        || 0!=write_changes(tmp, IP_CBST_HDR_SIZE, (const char*)old, (const char*)cbst,
+                            nmemb, sizeof(ip_cbst_node), stats)
+        || 0!=write_changes(tmp, IP_CBST_HDR_SIZE+offset6_of(nmemb), (const char*)old6,
+                            (const char*)cbst6, nmemb6, sizeof(ip6_cbst_node), stats) ) {
+        goto out;
+    }
+    make_header(hdr, cbst, nmemb);
+    if( (ssize_t)sizeof(hdr) != pwrite(tmp, hdr, sizeof(hdr), 0) ) {
+        goto out;
+    }
+    stats->bytes += sizeof(hdr);
+    err = close(tmp);
+    tmp = -1;
+    if( 0!=err || 0!=rename(tmpname, name) ) {
+        goto out;
+    }
+    tmpname[0] = '\0';
+    ret = 0;
+
+out:
+    err = errno;
+    if( tmp>=0 ) {
+        close(tmp);
+    }
+    if( tmpname[0]!='\0' ) {
+        unlink(tmpname);
+    }
+    ip_cbst_free(old);
+    ip_cbst_free(cbst);
+    if( fd>=0 ) {
+        close(fd);
+    }
+    errno = err;
+    return ret;
+}
+
+// Shared memory. Each published image is a POSIX shared memory object
+// of its own, "<name>.<generation>", written once and never changed;
+// the object "<name>" holds only an ip_cbst_shm naming the current
+// generation. Publishing writes the next image, swaps the generation
+// and unlinks the image before it. Readers that still have an old one
+// mapped keep it until they unmap it, so no reader ever waits, and no
+// process needs a copy of its own.
+
+// The name of an image, in a buffer of IMAGE_NAME_MAX:
+#define IMAGE_NAME_MAX (IP_CBST_SHM_NAME_MAX+24)
+
+static void image_name(char *buf, const char *name, uint64_t generation) {
+    snprintf(buf, IMAGE_NAME_MAX, "%s.%llu", name, (unsigned long long)generation);
+}
+
+
+// Publishes the image under 'name' (which must start with '/'), as the
+// generation after the current one. Publishers take turns by locking
+// the control object. Returns 0, or -1 with errno set:
+int ip_cbst_publish(const ip_cbst_node *cbst, size_t nmemb, const char *name)
+{
+    char           buf[IMAGE_NAME_MAX];
+    ip_cbst_shm   *ctl = MAP_FAILED;
+    uint64_t       generation;
+    FILE          *fp  = NULL;
+    int            fd  = -1, image_fd = -1, ret = -1;
+
+    assert( cbst!=NULL );
+    assert( name!=NULL );
+
+    if( strlen(name) >= IP_CBST_SHM_NAME_MAX ) {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+    fd = shm_open(name, O_RDWR|O_CREAT|O_CLOEXEC, 0644);
+    if( fd<0 || 0!=flock(fd, LOCK_EX) || 0!=ftruncate(fd, sizeof(ip_cbst_shm)) ) {
+        goto out;
+    }
+    ctl = mmap(NULL, sizeof(ip_cbst_shm), PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0);
+    if( ctl==MAP_FAILED ) {
+        goto out;
+    }
+    if( 0!=memcmp(ctl->magic, IP_CBST_SHM_MAGIC, sizeof(ctl->magic)) ) {
+        memcpy(ctl->magic, IP_CBST_SHM_MAGIC, sizeof(ctl->magic));
+        ctl->generation = 0;
+    }
+    generation = ctl->generation+1;
+
+    image_name(buf, name, generation);
+    shm_unlink(buf);    // Left by a publisher that failed
+    image_fd = shm_open(buf, O_RDWR|O_CREAT|O_EXCL|O_CLOEXEC, 0644);
+    if( image_fd<0 ) {
+        goto out;
+    }
+    fp = fdopen(image_fd, "wb");
+    if( fp==NULL ) {
+        close(image_fd);
+        shm_unlink(buf);
+        goto out;
+    }
+    if( 0!=write_image(fp, cbst, nmemb) || 0!=fclose(fp) ) {
+        shm_unlink(buf);
+        goto out;
+    }
+
+    // The image is complete before readers can see its generation:
+    __atomic_store_n(&ctl->generation, generation, __ATOMIC_RELEASE);
+    if( generation>1 ) {
+        image_name(buf, name, generation-1);
+        shm_unlink(buf);
+    }
+    ret = 0;
+
+out:
+    if( ctl!=MAP_FAILED ) {
+        munmap(ctl, sizeof(ip_cbst_shm));
+    }
+    if( fd>=0 ) {
+        close(fd);  // Also drops the lock
+    }
+    return ret;
+}
+
+
+// Attaches to the images published under 'name', mapping the current
+// one, which is the caller's to free with ip_cbst_free(). Returns 0, or
+// -1 if there is none yet. A publisher creates the control object
+// before it sizes it, so one that is too small is waited for, briefly:
+int ip_cbst_shared_open(ip_cbst_shared *sh, const char *name)
+{
+    const struct timespec pause = { 0, 1000000 };
+    struct stat st;
+    int fd, tries;
+
+    assert( sh!=NULL );
+    assert( name!=NULL );
+
+    memset(sh, 0, sizeof(ip_cbst_shared));
+    if( strlen(name) >= IP_CBST_SHM_NAME_MAX ) {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+    strcpy(sh->name, name);
+
+    fd = shm_open(name, O_RDONLY|O_CLOEXEC, 0);
+    if( fd<0 ) {
+        return -1;
+    }
+    for(tries=0; ; tries++) {
+        if( 0!=fstat(fd, &st) ) {
+            close(fd);
+            return -1;
+        }
+        if( (size_t)st.st_size >= sizeof(ip_cbst_shm) ) {
+            break;
+        }
+        if( tries==IP_CBST_SHM_TRIES ) {
+            close(fd);
+            errno = ENOENT;
+            return -1;
+        }
+        nanosleep(&pause, NULL);
+    }
+    sh->ctl = mmap(NULL, sizeof(ip_cbst_shm), PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if( sh->ctl==MAP_FAILED
+        || 0!=memcmp(sh->ctl->magic, IP_CBST_SHM_MAGIC, sizeof(sh->ctl->magic)) ) {
+        if( sh->ctl!=MAP_FAILED ) {
+            munmap((void*)sh->ctl, sizeof(ip_cbst_shm));
+        }
+        sh->ctl = NULL;
+        errno = ENOENT;
+        return -1;
+    }
+    ip_cbst_shared_refresh(sh);
+
+    return sh->cbst!=NULL ? 0 : -1;
+}
+
+
+// Maps the current generation if it is not the one already mapped;
+// true if it did. A check costs one load from the control object. The
+// tree mapped before is left as it is, since lookups may still be
+// using it: like the new one, it is the caller's to free with
+// ip_cbst_free() once they are done; see ip_reload_follow():
+bool ip_cbst_shared_refresh(ip_cbst_shared *sh)
+{
+    char                buf[IMAGE_NAME_MAX];
+    const ip_cbst_node *cbst;
+    uint64_t            generation;
+    size_t              nmemb;
+    int                 fd;
+
+    assert( sh!=NULL && sh->ctl!=NULL );
+
+    for(;;) {
+        generation = __atomic_load_n(&sh->ctl->generation, __ATOMIC_ACQUIRE);
+        if( generation==sh->generation ) {
+            return false;
+        }
+        image_name(buf, sh->name, generation);
+        fd = shm_open(buf, O_RDONLY|O_CLOEXEC, 0);
+        if( fd>=0 ) {
+            break;
+        }
+        // Already replaced by a newer one; try again, unless the old
+        // generation is still the current one after all:
+        if( errno!=ENOENT ) {
+            return false;
+        }
+    }
+
+    // It was checked when it was published:
+    cbst = map_image(fd, MAP_SHARED|MAP_POPULATE, false, buf, &nmemb);
+    close(fd);
+    if( cbst==NULL ) {
+        return false;
+    }
+
+    sh->cbst       = cbst;
+    sh->nmemb      = nmemb;
+    sh->generation = generation;
+    return true;
+}
+
+
+// Detaches from the control object; the trees mapped stay mapped:
+void ip_cbst_shared_close(ip_cbst_shared *sh)
+{
+    if( sh!=NULL && sh->ctl!=NULL ) {
+        munmap((void*)sh->ctl, sizeof(ip_cbst_shm));
+        memset(sh, 0, sizeof(ip_cbst_shared));
+    }
+}
@@ -1,10 +1,21 @@
 #pragma once
 
 #include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
 #include <arpa/inet.h>
 #include <cbst.h>
 
+// Number of queries that ip_cbst_lookup_batch() walks in lockstep:
+#define IP_CBST_BATCH 16
+
+// Fewest bytes of text worth loading in a thread of their own, and the
+// most threads ip_cbst_load_text() uses:
+#define IP_CBST_LOAD_CHUNK   (1<<20)
+#define IP_CBST_LOAD_THREADS 64
+
 typedef struct ip_cbst_node ip_cbst_node;
+typedef struct ip6_cbst_node ip6_cbst_node;    // See ip6-cbst.h
 
 struct ip_cbst_node {
     in_addr_t  addr_hi;
@@ -13,15 +24,95 @@ struct ip_cbst_node {
     char       flag;
 };
 
+// Binary database format: a header, padded to IP_CBST_HDR_SIZE so that
+// the nodes start on a page boundary, followed by the IPv4 CBST as it
+// is laid out in memory and then, at the next IP_CBST_ALIGN boundary,
+// the IPv6 one. The file is mapped and used in place:
+#define IP_CBST_MAGIC       "IP2CCBIN"
+#define IP_CBST_VERSION     2
+#define IP_CBST_ENDIAN      0x01020304u
+#define IP_CBST_HDR_SIZE    4096
+#define IP_CBST_LAYOUT_CBST 1
+#define IP_CBST_ALIGN       64
+
+typedef struct ip_cbst_header ip_cbst_header;
+
+struct ip_cbst_header {
+    char      magic[8];     // IP_CBST_MAGIC, without the NUL
+    uint32_t  version;      // IP_CBST_VERSION
+    uint32_t  endian;       // IP_CBST_ENDIAN, in the writer's byte order
+    uint32_t  node_size;    // sizeof(ip_cbst_node)
+    uint32_t  layout;       // IP_CBST_LAYOUT_*
+    uint64_t  nmemb;        // Number of nodes
+    uint64_t  checksum;     // ip_cbst_checksum() of the nodes
+    uint32_t  node6_size;   // sizeof(ip6_cbst_node)
+    uint32_t  reserved;
+    uint64_t  nmemb6;       // Number of IPv6 nodes
+    uint64_t  offset6;      // Bytes from the first IPv4 node to the first IPv6 one
+    uint64_t  checksum6;    // Of the IPv6 nodes
+};
+
+// What ip_cbst_update() did:
+typedef struct ip_cbst_update_stats ip_cbst_update_stats;
+
+struct ip_cbst_update_stats {
+    size_t  old_nmemb;      // Nodes before, 0 if there was no usable database
+    size_t  old_nmemb6;
+    size_t  nmemb;          // Nodes after
+    size_t  nmemb6;
+    size_t  changed;        // Nodes written
+    size_t  slices;         // Contiguous runs of them
+    size_t  bytes;          // Bytes written, header included
+    size_t  size;           // Bytes in the whole database
+    bool    rebuilt;        // The counts changed, so everything was written
+};
+
+// A database published in shared memory; see ip_cbst_publish(). The
+// control object is no more than this, and readers only ever load
+// 'generation':
+#define IP_CBST_SHM_MAGIC    "IP2CCSHM"
+#define IP_CBST_SHM_NAME_MAX 256
+
+// Milliseconds a reader waits for a new control object to be sized:
+#define IP_CBST_SHM_TRIES    100
+
+typedef struct ip_cbst_shm    ip_cbst_shm;
+typedef struct ip_cbst_shared ip_cbst_shared;
+
+struct ip_cbst_shm {
+    char      magic[8];     // IP_CBST_SHM_MAGIC, without the NUL
+    uint64_t  generation;   // The current image; 0 before the first
+};
+
+// A reader's view of a published database:
+struct ip_cbst_shared {
+    char                 name[IP_CBST_SHM_NAME_MAX];
+    const ip_cbst_shm   *ctl;
+    uint64_t             generation;    // Of the image mapped last
+    const ip_cbst_node  *cbst;          // That image; the caller's to free
+    size_t               nmemb;
+};
+
 ip_cbst_node*       ip_cbst_new(size_t nmemb);
+void                ip_cbst_free(const ip_cbst_node *cbst);
+void                ip_cbst_release_ip4(const ip_cbst_node *cbst);
+uint64_t            ip_cbst_checksum(const ip_cbst_node *cbst, size_t nmemb);
 size_t              ip_cbst_add_node(ip_cbst_node *root, size_t nmemb, size_t pos, const ip_cbst_node *node);
 size_t              ip_cbst_add_dq(ip_cbst_node *root, size_t nmemb, size_t pos, const char *dq_lo, const char *dq_hi, const char *cc);
 const ip_cbst_node* ip_cbst_lookup_ip(const ip_cbst_node *root, size_t nmemb, const in_addr_t ip);
+const ip_cbst_node* ip_cbst_lookup_ip_generic(const ip_cbst_node *root, size_t nmemb, const in_addr_t ip);
+void                ip_cbst_lookup_batch(const ip_cbst_node *root, size_t nmemb, const in_addr_t *ips, const ip_cbst_node **out, size_t n);
 const ip_cbst_node* ip_cbst_lookup_dq(const ip_cbst_node *root, size_t nmemb, const char* dq);
 
-const ip_cbst_node* ip_cbst_load_txt(const char *filename, size_t* nmemb);
-const ip_cbst_node* ip_cbst_load_bin(const char *filename, size_t *nmemb);
-const ip_cbst_node* ip_cbst_load(const char *stub, size_t *nmemb);
-void                ip_cbst_save_bin(const ip_cbst_node *cbst, size_t nmemb, const char *filename);
+const ip_cbst_node* ip_cbst_load_text(const char *filename, size_t* nmemb);
+const ip_cbst_node* ip_cbst_load_bin(const char *filename, size_t *nmemb, bool verify);
+const ip_cbst_node* ip_cbst_load(const char *stub, size_t *nmemb, bool verify);
+int                 ip_cbst_save_bin(const ip_cbst_node *cbst, size_t nmemb, const char *filename);
+int                 ip_cbst_update(const char *filename, ip_cbst_update_stats *stats);
+int                 ip_cbst_publish(const ip_cbst_node *cbst, size_t nmemb, const char *name);
+int                 ip_cbst_shared_open(ip_cbst_shared *sh, const char *name);
+bool                ip_cbst_shared_refresh(ip_cbst_shared *sh);
+void                ip_cbst_shared_close(ip_cbst_shared *sh);
+const ip6_cbst_node* ip_cbst_ip6(const ip_cbst_node *cbst, size_t *nmemb6);
 
 char*               ip_cbst_address_range(const ip_cbst_node *node, char *buf);
@@ -0,0 +1,272 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include <ip-compact.h>
+#include <assert.h>
+
+#include <errno.h>
+#include <stdlib.h>     // For posix_memalign(), calloc(), free()
+#include <string.h>     // For memset()
+#include <sys/param.h>  // For MIN()
+
+
+typedef struct {
+    uint32_t  lo;
+    uint8_t   code;
+} segment;
+
+// The code for 'cc', adding it to the dictionary if it is new; 0 if
+// the dictionary is full. 'map' is indexed by the two characters:
+static uint8_t encode(ip_compact *compact, uint8_t *map, const char *cc)
+{
+    unsigned i = (unsigned char)cc[0] << 8 | (unsigned char)cc[1];
+
+    if( map[i]==0 ) {
+        if( compact->ncodes==IP_COMPACT_NCODES ) {
+            return 0;
+        }
+        map[i] = compact->ncodes++;
+        compact->dict[map[i]][0] = cc[0];
+        compact->dict[map[i]][1] = cc[1];
+        compact->dict[map[i]][2] = '\0';
+    }
+    return map[i];
+}
+
+// Coalesces the sorted ranges into segments; returns how many, or 0
+// with errno EOVERFLOW if there are too many countries to encode. 'seg'
+// has room for 2*nmemb+1:
+static size_t coalesce(ip_compact *compact, const ip_cbst_node *sorted, size_t nmemb, segment *seg)
+{
+    uint8_t *map = NULL;
+    uint64_t next = 0;      // One past the end of the last segment
+    size_t   i, n = 0;
+    uint8_t  code;
+
+    map = calloc(1<<16, 1);
+    if( map==NULL ) {
+        return 0;
+    }
+    for(i=0; i<nmemb; i++) {
+        code = encode(compact, map, sorted[i].cc);
+        if( code==0 ) {
+            errno = EOVERFLOW;
+            n = 0;
+            break;
+        }
+        if( sorted[i].addr_lo > next || n==0 ) {
+            if( sorted[i].addr_lo > next ) {
+                seg[n].lo   = next;
+                seg[n].code = IP_COMPACT_GAP;
+                n++;
+            }
+        } else if( seg[n-1].code==code ) {
+            // Extends the last segment
+            next = (uint64_t)sorted[i].addr_hi+1;
+            continue;
+        }
+        seg[n].lo   = sorted[i].addr_lo;
+        seg[n].code = code;
+        n++;
+        next = (uint64_t)sorted[i].addr_hi+1;
+    }
+    if( (n>0 || nmemb==0) && next <= UINT32_MAX ) {
+        seg[n].lo   = next;
+        seg[n].code = IP_COMPACT_GAP;
+        n++;
+    }
+
+    free(map);
+    return n;
+}
+
+
+ip_compact* ip_compact_new(const ip_cbst_node *sorted, size_t nmemb)
+{
+    ip_compact *compact = NULL;
+    segment    *seg     = NULL;
+    cbst_iter   it;
+    size_t      i, k;
+
+    assert( sorted!=NULL || nmemb==0 );
+
+    compact = calloc(1, sizeof(ip_compact));
+    seg     = malloc((2*nmemb+1)*sizeof(segment));
+    if( compact==NULL || seg==NULL ) {
+        free(compact);
+        free(seg);
+        return NULL;
+    }
+    compact->ncodes = 1;
+    memcpy(compact->dict[IP_COMPACT_GAP], "--", 3);
+
+    compact->nmemb = coalesce(compact, sorted, nmemb, seg);
+    if( compact->nmemb==0
+        || 0!=posix_memalign((void**)&compact->keys, 64, (compact->nmemb+1)*sizeof(uint32_t))
+        || NULL==(compact->codes=malloc(compact->nmemb+1))
+        || NULL==(compact->nodes=calloc(compact->nmemb, sizeof(ip_cbst_node))) ) {
+        free(seg);
+        ip_compact_free(compact);
+        return NULL;
+    }
+
+    compact->keys[0]  = 0;
+    compact->codes[0] = IP_COMPACT_GAP;
+    cbst_iter_init(&it, compact->nmemb, 0);
+    for(i=0; i<compact->nmemb; i++) {
+        k = cbst_iter_next(&it);
+        compact->keys[k+1]  = seg[i].lo;
+        compact->codes[k+1] = seg[i].code;
+    }
+
+    free(seg);
+    return compact;
+}
+
+
+ip_compact* ip_compact_from_cbst(const ip_cbst_node *cbst, size_t nmemb)
+{
+    ip_cbst_node *sorted  = NULL;
+    ip_compact   *compact = NULL;
+
+    sorted = cbst_to_sorted_array(cbst, nmemb, sizeof(ip_cbst_node));
+    if( sorted==NULL && nmemb>0 ) {
+        return NULL;
+    }
+    compact = ip_compact_new(sorted, nmemb);
+    free(sorted);
+
+    return compact;
+}
+
+
+void ip_compact_free(ip_compact *compact)
+{
+    if( compact!=NULL ) {
+        free(compact->keys);
+        free(compact->codes);
+        free(compact->nodes);
+        free(compact);
+    }
+}
+
+
+// The path that the search for 'ip' takes, one bit per level, a 1 for
+// each step right; see segment_at() and segment_after(). The first segment
+// starts at 0, so there always is one:
+static inline size_t descend(const ip_compact *compact, in_addr_t ip)
+{
+    const uint32_t *keys = compact->keys;
+    size_t k = 1;
+
+    while( k <= compact->nmemb ) {
+        __builtin_prefetch(keys+(k<<4));
+        k = (k<<1) + (keys[k] <= ip);
+    }
+    return k;
+}
+
+// The (one-based) segment 'ip' is in is where the path last went
+// right, its key being the last one not above 'ip':
+static inline size_t segment_at(size_t path)
+{
+    return path >> (__builtin_ctzl(path)+1);
+}
+
+// and the one after it, where the path last went left; 0 if it never
+// did, so that the segment runs to the end of the address space:
+static inline size_t segment_after(size_t path)
+{
+    return path >> (__builtin_ctzl(~path)+1);
+}
+
+// The range of the segment at the end of 'path', or NULL if that is a
+// gap. Threads that race to fill in the same range store the same
+// values, and the flag is set last, so a range is read only once all
+// of it is there:
+static const ip_cbst_node* range(const ip_compact *compact, size_t path)
+{
+    size_t        k = segment_at(path), next;
+    ip_cbst_node *node;
+    const char   *cc;
+
+    if( compact->codes[k]==IP_COMPACT_GAP ) {
+        return NULL;
+    }
+    node = compact->nodes+k-1;
+    if( __atomic_load_n(&node->flag, __ATOMIC_ACQUIRE)==0 ) {
+        next = segment_after(path);
+        cc   = compact->dict[compact->codes[k]];
+        __atomic_store_n(&node->addr_lo, compact->keys[k], __ATOMIC_RELAXED);
+        __atomic_store_n(&node->addr_hi, next>0 ? compact->keys[next]-1 : UINT32_MAX, __ATOMIC_RELAXED);
+        __atomic_store_n(&node->cc[0], cc[0], __ATOMIC_RELAXED);
+        __atomic_store_n(&node->cc[1], cc[1], __ATOMIC_RELAXED);
+        __atomic_store_n(&node->flag, 1, __ATOMIC_RELEASE);
+    }
+    return node;
+}
+
+
+// The country code alone, from the five-byte segments; NULL if 'ip' is
+// in a gap:
+const char* ip_compact_lookup_cc(const ip_compact *compact, in_addr_t ip)
+{
+    uint8_t code;
+
+    if( compact==NULL ) {
+        return NULL;
+    }
+    code = compact->codes[segment_at(descend(compact, ip))];
+    return code!=IP_COMPACT_GAP ? compact->dict[code] : NULL;
+}
+
+
+const ip_cbst_node* ip_compact_lookup_ip(const ip_compact *compact, in_addr_t ip)
+{
+    if( compact==NULL ) {
+        return NULL;
+    }
+    return range(compact, descend(compact, ip));
+}
+
+
+// As ip_soa_lookup_batch():
+void ip_compact_lookup_batch(const ip_compact *compact, const in_addr_t *ips,
+                             const ip_cbst_node **out, size_t n)
+{
+    const uint32_t *keys;
+    size_t k[IP_CBST_BATCH];
+    size_t i, j, m, d, h;
+
+    assert( n==0 || ips!=NULL );
+    assert( n==0 || out!=NULL );
+
+    if( compact==NULL ) {
+        for(i=0; i<n; i++) {
+            out[i] = NULL;
+        }
+        return;
+    }
+
+    keys = compact->keys;
+    h = 8*sizeof(size_t)-__builtin_clzl(compact->nmemb);
+
+    for(i=0; i<n; i+=m) {
+        m = MIN(n-i, IP_CBST_BATCH);
+
+        for(j=0; j<m; j++) {
+            k[j] = 1;
+        }
+        for(d=1; d<h; d++) {
+            for(j=0; j<m; j++) {
+                __builtin_prefetch(keys+(k[j]<<2));
+                k[j] = (k[j]<<1) + (keys[k[j]] <= ips[i+j]);
+            }
+        }
+        for(j=0; j<m; j++) {
+            if( k[j] <= compact->nmemb ) {
+                k[j] = (k[j]<<1) + (keys[k[j]] <= ips[i+j]);
+            }
+            out[i+j] = range(compact, k[j]);
+        }
+    }
+}
@@ -0,0 +1,45 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <ip-cbst.h>
+
+// Country codes are stored as one-byte indexes into a dictionary; code
+// 0 marks a gap between ranges:
+#define IP_COMPACT_NCODES 256
+#define IP_COMPACT_GAP    0
+
+typedef struct ip_compact ip_compact;
+
+// The ranges coalesced and re-encoded for size. Adjacent ranges with
+// the same country are merged, and what is left is stored as a
+// partition of the whole address space: each segment runs from its own
+// 'addr_lo' to the next one's, so no 'addr_hi' is needed, and the space
+// between ranges is a segment of its own with code IP_COMPACT_GAP. A
+// segment is five bytes, a key and a code, in two parallel arrays in
+// CBST order from index one, as for ip_soa.
+//
+// ip_compact_lookup_ip() must still answer with a range that stays put,
+// as ip_cbst_lookup_ip() does, so 'nodes' has room for one per segment,
+// but it is only zeroed: a segment's range is derived from its key, the
+// key of its successor in sorted order, which the descent passes on the
+// way, and its code, the first time that it is the answer, and its
+// 'flag' set. Pages of it that are never answered from are never
+// touched, and a lookup that only wants the country reads just the
+// five-byte segments:
+struct ip_compact {
+    uint32_t      *keys;        // keys[k] is the first address of segment k
+    uint8_t       *codes;       // codes[k] is its country's code
+    char           dict[IP_COMPACT_NCODES][3];
+    unsigned       ncodes;      // Codes in use, the gap included
+    ip_cbst_node  *nodes;       // nodes[k-1] is segment k, once answered
+    size_t         nmemb;       // Number of segments, gaps included
+};
+
+ip_compact*         ip_compact_new(const ip_cbst_node *sorted, size_t nmemb);
+ip_compact*         ip_compact_from_cbst(const ip_cbst_node *cbst, size_t nmemb);
+void                ip_compact_free(ip_compact *compact);
+const char*         ip_compact_lookup_cc(const ip_compact *compact, in_addr_t ip);
+const ip_cbst_node* ip_compact_lookup_ip(const ip_compact *compact, in_addr_t ip);
+void                ip_compact_lookup_batch(const ip_compact *compact, const in_addr_t *ips,
+                                            const ip_cbst_node **out, size_t n);
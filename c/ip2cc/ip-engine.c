@@ -0,0 +1,287 @@
+#include <ip-engine.h>
+#include <ip-stree.h>
+#include <ip-soa.h>
+#include <ip-jump.h>
+#include <ip-poptrie.h>
+#include <ip-compact.h>
+#ifdef IP2CC_BUILTIN
+#include <ip-builtin.h>
+#endif
+#include <assert.h>
+
+#include <errno.h>
+#include <stdlib.h>     // For calloc(), free()
+#include <string.h>     // For strcmp()
+
+
+// Batches for engines without a batched path of their own:
+static void lookup_batch_each(const ip_engine *engine, const in_addr_t *ips,
+                              const ip_cbst_node **out, size_t n)
+{
+    size_t i;
+
+    for(i=0; i<n; i++) {
+        out[i] = engine->lookup(engine, ips[i]);
+    }
+}
+
+
+// The CBST, searched directly:
+static const ip_cbst_node* cbst_lookup(const ip_engine *engine, in_addr_t ip) {
+    return ip_cbst_lookup_ip(engine->cbst, engine->nmemb, ip);
+}
+
+static void cbst_lookup_batch(const ip_engine *engine, const in_addr_t *ips,
+                              const ip_cbst_node **out, size_t n) {
+    ip_cbst_lookup_batch(engine->cbst, engine->nmemb, ips, out, n);
+}
+
+
+// The S-tree:
+static void *stree_build(const ip_cbst_node *cbst, size_t nmemb, const char *arg) {
+    (void)arg;
+    return ip_stree_from_cbst(cbst, nmemb);
+}
+
+static const ip_cbst_node* stree_lookup(const ip_engine *engine, in_addr_t ip) {
+    return ip_stree_lookup_ip(engine->index, ip);
+}
+
+static const ip_cbst_node* stree_nodes(const void *index, size_t *nnodes) {
+    *nnodes = ((const ip_stree*)index)->nmemb;
+    return ((const ip_stree*)index)->nodes;
+}
+
+static void stree_free(void *index) {
+    ip_stree_free(index);
+}
+
+
+// The CBST with its keys split out:
+static void *soa_build(const ip_cbst_node *cbst, size_t nmemb, const char *arg) {
+    (void)arg;
+    return ip_soa_new(cbst, nmemb);
+}
+
+static const ip_cbst_node* soa_lookup(const ip_engine *engine, in_addr_t ip) {
+    return ip_soa_lookup_ip(engine->index, ip);
+}
+
+static void soa_lookup_batch(const ip_engine *engine, const in_addr_t *ips,
+                             const ip_cbst_node **out, size_t n) {
+    ip_soa_lookup_batch(engine->index, ips, out, n);
+}
+
+static void soa_free(void *index) {
+    ip_soa_free(index);
+}
+
+
+// The jump table; the argument is the number of prefix bits:
+static void *jump_build(const ip_cbst_node *cbst, size_t nmemb, const char *arg) {
+    unsigned bits = arg!=NULL ? strtoul(arg, NULL, 10) : IP_JUMP_BITS;
+    return ip_jump_from_cbst(cbst, nmemb, bits);
+}
+
+static const ip_cbst_node* jump_lookup(const ip_engine *engine, in_addr_t ip) {
+    return ip_jump_lookup_ip(engine->index, ip);
+}
+
+static void jump_free(void *index) {
+    ip_jump_free(index);
+}
+
+
+// The prefix trie; the argument, if any, is a file of CIDR prefixes to
+// load instead of the ranges:
+static void *poptrie_build(const ip_cbst_node *cbst, size_t nmemb, const char *arg) {
+    if( arg!=NULL && *arg!='\0' ) {
+        return ip_poptrie_load_cidr(arg);
+    }
+    return ip_poptrie_from_cbst(cbst, nmemb);
+}
+
+static const ip_cbst_node* poptrie_lookup(const ip_engine *engine, in_addr_t ip) {
+    return ip_poptrie_lookup_ip(engine->index, ip);
+}
+
+static const ip_cbst_node* poptrie_nodes(const void *index, size_t *nnodes) {
+    *nnodes = ((const ip_poptrie*)index)->nmemb;
+    return ((const ip_poptrie*)index)->nodes;
+}
+
+static void poptrie_free(void *index) {
+    ip_poptrie_free(index);
+}
+
+
+// The ranges coalesced, with one-byte country codes:
+static void *compact_build(const ip_cbst_node *cbst, size_t nmemb, const char *arg) {
+    (void)arg;
+    return ip_compact_from_cbst(cbst, nmemb);
+}
+
+static const ip_cbst_node* compact_lookup(const ip_engine *engine, in_addr_t ip) {
+    return ip_compact_lookup_ip(engine->index, ip);
+}
+
+static void compact_lookup_batch(const ip_engine *engine, const in_addr_t *ips,
+                                 const ip_cbst_node **out, size_t n) {
+    ip_compact_lookup_batch(engine->index, ips, out, n);
+}
+
+static const ip_cbst_node* compact_nodes(const void *index, size_t *nnodes) {
+    *nnodes = ((const ip_compact*)index)->nmemb;
+    return ((const ip_compact*)index)->nodes;
+}
+
+static void compact_free(void *index) {
+    ip_compact_free(index);
+}
+
+
+#ifdef IP2CC_BUILTIN
+// The database compiled into the program, with its top levels
+// unrolled. It can only be built over that database, so that a rebuilt
+// one is never answered from the compiled-in one:
+static void *builtin_build(const ip_cbst_node *cbst, size_t nmemb, const char *arg) {
+    size_t n;
+
+    (void)arg;
+    return cbst==ip_builtin_cbst(&n) && nmemb==n ? (void*)cbst : NULL;
+}
+
+static const ip_cbst_node* builtin_lookup(const ip_engine *engine, in_addr_t ip) {
+    (void)engine;
+    return ip_builtin_lookup_ip(ip);
+}
+#endif
+
+
+// 'standalone' engines keep everything that they answer from in their
+// index, and do not read the CBST once they are built:
+static const struct {
+    const char *name;
+    void *(*build)(const ip_cbst_node *cbst, size_t nmemb, const char *arg);
+    const ip_cbst_node* (*lookup)(const ip_engine *engine, in_addr_t ip);
+    void (*lookup_batch)(const ip_engine *engine, const in_addr_t *ips,
+                         const ip_cbst_node **out, size_t n);
+    const ip_cbst_node* (*nodes)(const void *index, size_t *nnodes);
+    void (*free_index)(void *index);
+    bool standalone;
+} engines[] = {
+    { "cbst",    NULL,          cbst_lookup,    cbst_lookup_batch,    NULL,          NULL,         false },
+    { "soa",     soa_build,     soa_lookup,     soa_lookup_batch,     NULL,          soa_free,     false },
+    { "stree",   stree_build,   stree_lookup,   lookup_batch_each,    stree_nodes,   stree_free,   true  },
+    { "jump",    jump_build,    jump_lookup,    lookup_batch_each,    NULL,          jump_free,    false },
+    { "poptrie", poptrie_build, poptrie_lookup, lookup_batch_each,    poptrie_nodes, poptrie_free, true  },
+    { "compact", compact_build, compact_lookup, compact_lookup_batch, compact_nodes, compact_free, true  },
+#ifdef IP2CC_BUILTIN
+    { "builtin", builtin_build, builtin_lookup, lookup_batch_each,    NULL,          NULL,         false },
+#endif
+};
+
+#define N_ENGINES (sizeof(engines)/sizeof(engines[0]))
+
+
+// Build the engine called 'name' (the CBST if NULL) over 'cbst'. The
+// name may be followed by ':' and an argument for the engine, e.g.
+// "jump:20". Returns NULL with errno ENOENT if there is no such
+// engine, or with errno as the engine left it if it could not be built:
+ip_engine* ip_engine_new(const char *name, const ip_cbst_node *cbst, size_t nmemb)
+{
+    ip_engine  *engine = NULL;
+    const char *arg    = NULL;
+    size_t      i, len;
+
+    if( name==NULL ) {
+        name = engines[0].name;
+    }
+    len = strcspn(name, ":");
+    if( name[len]==':' ) {
+        arg = name+len+1;
+    }
+    for(i=0; i<N_ENGINES; i++) {
+        if( len==strlen(engines[i].name) && 0==strncmp(name, engines[i].name, len) ) {
+            break;
+        }
+    }
+    if( i==N_ENGINES ) {
+        errno = ENOENT;
+        return NULL;
+    }
+
+    engine = calloc(1, sizeof(ip_engine));
+    if( engine==NULL ) {
+        return NULL;
+    }
+    engine->name         = engines[i].name;
+    engine->cbst         = cbst;
+    engine->nodes        = cbst;
+    engine->nnodes       = nmemb;
+    engine->nmemb        = nmemb;
+    engine->lookup       = engines[i].lookup;
+    engine->lookup_batch = engines[i].lookup_batch;
+    engine->free_index   = engines[i].free_index;
+    engine->standalone   = engines[i].standalone;
+
+    if( engines[i].build!=NULL ) {
+        engine->index = engines[i].build(cbst, nmemb, arg);
+        if( engine->index==NULL ) {
+            free(engine);
+            return NULL;
+        }
+    }
+    if( engines[i].nodes!=NULL ) {
+        engine->nodes = engines[i].nodes(engine->index, &engine->nnodes);
+    }
+
+    return engine;
+}
+
+
+// Frees the engine and its index, but not the CBST it was built over:
+void ip_engine_free(ip_engine *engine)
+{
+    if( engine==NULL ) {
+        return;
+    }
+    if( engine->free_index!=NULL ) {
+        engine->free_index(engine->index);
+    }
+    free(engine);
+}
+
+
+// Builds the engine called 'name' over a CBST that the caller owns and
+// will use for nothing else, so that an engine that keeps what it needs
+// in its index can be had instead of the CBST, rather than as well as
+// it: the CBST's IPv4 nodes are released. It must still be freed, and
+// its IPv6 tree can still be used:
+ip_engine* ip_engine_new_owned(const char *name, const ip_cbst_node *cbst, size_t nmemb)
+{
+    ip_engine *engine = ip_engine_new(name, cbst, nmemb);
+
+    if( engine!=NULL && engine->standalone ) {
+        ip_cbst_release_ip4(cbst);
+    }
+    return engine;
+}
+
+
+// Space-separated list of the engine names, for usage messages:
+const char* ip_engine_names(void)
+{
+    static char names[128];
+    size_t i;
+
+    if( names[0]=='\0' ) {
+        for(i=0; i<N_ENGINES; i++) {
+            if( i>0 ) {
+                strcat(names, " ");
+            }
+            strcat(names, engines[i].name);
+        }
+    }
+    return names;
+}
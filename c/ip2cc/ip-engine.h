@@ -0,0 +1,38 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdbool.h>
+#include <ip-cbst.h>
+
+typedef struct ip_engine ip_engine;
+
+// A lookup engine: some index built from a loaded CBST that answers
+// the same question as ip_cbst_lookup_ip(). The CBST itself is the
+// default engine; the others are alternative layouts:
+struct ip_engine {
+    const char          *name;
+    const ip_cbst_node  *cbst;
+    const ip_cbst_node  *nodes;     // The nodes that lookups point into
+    size_t               nnodes;
+    size_t               nmemb;
+    void                *index;
+    const ip_cbst_node* (*lookup)(const ip_engine *engine, in_addr_t ip);
+    void               (*lookup_batch)(const ip_engine *engine, const in_addr_t *ips,
+                                       const ip_cbst_node **out, size_t n);
+    void               (*free_index)(void *index);
+    bool                 standalone;    // Never reads 'cbst' once built
+};
+
+ip_engine*  ip_engine_new(const char *name, const ip_cbst_node *cbst, size_t nmemb);
+ip_engine*  ip_engine_new_owned(const char *name, const ip_cbst_node *cbst, size_t nmemb);
+void        ip_engine_free(ip_engine *engine);
+const char* ip_engine_names(void);
+
+static inline const ip_cbst_node* ip_engine_lookup(const ip_engine *engine, in_addr_t ip) {
+    return engine->lookup(engine, ip);
+}
+
+static inline void ip_engine_lookup_batch(const ip_engine *engine, const in_addr_t *ips,
+                                          const ip_cbst_node **out, size_t n) {
+    engine->lookup_batch(engine, ips, out, n);
+}
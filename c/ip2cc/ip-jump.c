@@ -0,0 +1,136 @@
+#include <ip-jump.h>
+#include <assert.h>
+
+#include <stdlib.h>     // For malloc(), free()
+
+
+// The smallest subtree holding both nodes, by one-based index: nodes
+// on deeper levels have greater indexes, so the greater of the two is
+// moved up until they meet:
+static size_t common_root(size_t a, size_t b)
+{
+    while( a!=b ) {
+        if( a>b ) {
+            a >>= 1;
+        } else {
+            b >>= 1;
+        }
+    }
+    return a;
+}
+
+
+// Ranges 'q' (one-based index of the last range that starts at or
+// below prefix 'p', 0 if none) to 'r' (the same for the next prefix,
+// at 'next') are the candidates for prefix 'p'; 'nq' and 'nr' are how
+// many ranges start at or below each:
+static uint32_t entry(const ip_jump *jump, size_t q, size_t nq, size_t r, size_t nr, uint64_t next)
+{
+    // A range that starts exactly on the next prefix is counted there
+    // but can never match in this one:
+    if( nr==nq || (nr==nq+1 && jump->cbst[r-1].addr_lo==next) ) {
+        return IP_JUMP_DIRECT | q;
+    }
+    if( q==0 ) {
+        // Below the lowest range, which is the leftmost node:
+        q = cbst_index(jump->nmemb, 0)+1;
+    }
+    return common_root(q, r)-1;
+}
+
+
+// One sweep over the prefixes and the ranges together, visiting the
+// ranges in sorted order:
+ip_jump* ip_jump_from_cbst(const ip_cbst_node *cbst, size_t nmemb, unsigned bits)
+{
+    ip_jump  *jump = NULL;
+    cbst_iter it;
+    size_t    p, size, q = 0, n = 0, last_q = 0, last_n = 0, next = 0;
+    uint64_t  start;
+
+    assert( cbst!=NULL || nmemb==0 );
+    assert( nmemb <= IP_JUMP_MASK );
+
+    if( bits<1 || bits>IP_JUMP_MAX_BITS ) {
+        return NULL;
+    }
+
+    jump = calloc(1, sizeof(ip_jump));
+    if( jump==NULL ) {
+        return NULL;
+    }
+    size        = (size_t)1 << bits;
+    jump->bits  = bits;
+    jump->cbst  = cbst;
+    jump->nmemb = nmemb;
+    jump->table = malloc(size*sizeof(uint32_t));
+    if( jump->table==NULL ) {
+        ip_jump_free(jump);
+        return NULL;
+    }
+
+    cbst_iter_init(&it, nmemb, 0);
+    if( nmemb>0 ) {
+        next = cbst_iter_next(&it);
+    }
+    for(p=0; p<=size; p++) {
+        start = (uint64_t)p << (32-bits);
+        while( n<nmemb && cbst[next].addr_lo <= start ) {
+            q = next+1;
+            if( ++n < nmemb ) {
+                next = cbst_iter_next(&it);
+            }
+        }
+        if( p>0 ) {
+            jump->table[p-1] = entry(jump, last_q, last_n, q, n, start);
+            jump->ndirect   += jump->table[p-1]>>31;
+        }
+        last_q = q;
+        last_n = n;
+    }
+
+    return jump;
+}
+
+
+void ip_jump_free(ip_jump *jump)
+{
+    if( jump!=NULL ) {
+        free(jump->table);
+        free(jump);
+    }
+}
+
+
+// Whether a range might hold 'ip', for cbst_descend(); inlined there:
+static int lo_compar(const void *node, const void *ip)
+{
+    return ((const ip_cbst_node*)node)->addr_lo <= *(const in_addr_t*)ip ? 0 : -1;
+}
+
+const ip_cbst_node* ip_jump_lookup_ip(const ip_jump *jump, in_addr_t ip)
+{
+    const ip_cbst_node *node;
+    uint32_t e;
+    size_t   i;
+
+    if( jump==NULL ) {
+        return NULL;
+    }
+
+    e = jump->table[ip >> (32-jump->bits)];
+    if( e & IP_JUMP_DIRECT ) {
+        e &= IP_JUMP_MASK;
+        if( e==0 ) {
+            return NULL;
+        }
+        node = jump->cbst+e-1;
+    } else {
+        i = cbst_descend(jump->cbst, jump->nmemb, sizeof(ip_cbst_node), lo_compar, &ip, e);
+        if( i==jump->nmemb ) {
+            return NULL;
+        }
+        node = jump->cbst+i;
+    }
+    return ip <= node->addr_hi ? node : NULL;
+}
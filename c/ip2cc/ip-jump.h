@@ -0,0 +1,35 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <ip-cbst.h>
+
+// Default and largest number of address bits used to index the table:
+#define IP_JUMP_BITS     16
+#define IP_JUMP_MAX_BITS 24
+
+// Set in an entry when at most one range can match in its prefix:
+#define IP_JUMP_DIRECT   0x80000000u
+#define IP_JUMP_MASK     0x7fffffffu
+
+typedef struct ip_jump ip_jump;
+
+// A direct-indexed table in front of the CBST, which it searches in
+// place rather than keeping ranges of its own. The ranges that an
+// address in prefix 'p' can fall in are a run in sorted order, and so
+// all lie in one subtree; entry 'p' is the index of the root of the
+// smallest such subtree, where the search starts. When the run holds
+// at most one candidate, the entry is flagged IP_JUMP_DIRECT and holds
+// the candidate's index plus one, or 0 if there is none, and no search
+// is needed:
+struct ip_jump {
+    uint32_t           *table;      // 2^bits entries
+    unsigned            bits;
+    const ip_cbst_node *cbst;       // The ranges, which it does not own
+    size_t              nmemb;
+    size_t              ndirect;    // Number of entries flagged IP_JUMP_DIRECT
+};
+
+ip_jump*            ip_jump_from_cbst(const ip_cbst_node *cbst, size_t nmemb, unsigned bits);
+void                ip_jump_free(ip_jump *jump);
+const ip_cbst_node* ip_jump_lookup_ip(const ip_jump *jump, in_addr_t ip);
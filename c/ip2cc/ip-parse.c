@@ -0,0 +1,279 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include <ip-parse.h>
+
+#include <string.h>     // For memcpy(), strnlen()
+#include <stdint.h>
+
+#if defined(__SSSE3__)
+#include <immintrin.h>
+#endif
+
+
+#if defined(__SSSE3__)
+
+// Shuffle masks, one for each combination of field lengths (1-3 each),
+// that move the digits of field f to the low end of 32-bit lane f,
+// ones digit last, with zeros in front:
+static uint8_t shuffles[81][16];
+
+__attribute__((constructor))
+static void init_shuffles(void)
+{
+    unsigned l[4], f, i, j, start;
+
+    for(i=0; i<81; i++) {
+        l[0] = i/27%3+1;
+        l[1] = i/9%3+1;
+        l[2] = i/3%3+1;
+        l[3] = i%3+1;
+        memset(shuffles[i], 0x80, 16);
+        start = 0;
+        for(f=0; f<4; f++) {
+            for(j=0; j<l[f]; j++) {
+                shuffles[i][4*f+4-l[f]+j] = start+j;
+            }
+            start += l[f]+1;
+        }
+    }
+}
+
+
+// Classify 16 bytes at once: the first three dots fix the field
+// lengths, and one shuffle, one multiply-add per digit pair and one per
+// field pair converts all four fields together:
+// Bytes at and beyond 'limit' (at most 16) are ignored:
+static size_t parse_dq_simd(const char *s, unsigned limit, in_addr_t *ip)
+{
+    const __m128i v    = _mm_loadu_si128((const __m128i*)s);
+    const __m128i zero = _mm_set1_epi8('0');
+    unsigned dots   = _mm_movemask_epi8(_mm_cmpeq_epi8(v, _mm_set1_epi8('.')));
+    unsigned digits = _mm_movemask_epi8(_mm_and_si128(_mm_cmpgt_epi8(v, _mm_set1_epi8('0'-1)),
+                                                      _mm_cmplt_epi8(v, _mm_set1_epi8('9'+1))));
+    unsigned d1, d2, d3, l1, l2, l3, l4, len;
+    __m128i  x;
+
+    dots   &= (1u<<limit)-1;
+    digits &= (1u<<limit)-1;
+
+    if( __builtin_popcount(dots) < 3 ) {
+        return 0;
+    }
+    d1 = __builtin_ctz(dots);
+    dots &= dots-1;
+    d2 = __builtin_ctz(dots);
+    dots &= dots-1;
+    d3 = __builtin_ctz(dots);
+
+    l1 = d1;
+    l2 = d2-d1-1;
+    l3 = d3-d2-1;
+    l4 = __builtin_ctz(~(digits >> (d3+1)));
+    len = d3+1+l4;
+
+    // Every field 1-3 digits long and nothing but digits between dots:
+    if( l1-1>2 || l2-1>2 || l3-1>2 || l4-1>2
+        || (digits | 1u<<d1 | 1u<<d2 | 1u<<d3) != (digits | ((1u<<len)-1)) ) {
+        return 0;
+    }
+
+    x = _mm_shuffle_epi8(_mm_sub_epi8(v, zero),
+                         _mm_loadu_si128((const __m128i*)shuffles[(l1-1)*27+(l2-1)*9+(l3-1)*3+(l4-1)]));
+    // [0, h, t, o] -> [100h, 10t+o] -> [100h+10t+o] in each lane:
+    x = _mm_maddubs_epi16(x, _mm_set1_epi32(0x010a6400));
+    x = _mm_madd_epi16(x, _mm_set1_epi16(1));
+
+    if( _mm_movemask_epi8(_mm_cmpgt_epi32(x, _mm_set1_epi32(255))) ) {
+        return 0;
+    }
+    // Narrow to bytes; the first field ends up in the lowest byte:
+    x = _mm_packus_epi16(_mm_packs_epi32(x, x), x);
+    *ip = __builtin_bswap32(_mm_cvtsi128_si32(x));
+
+    return len;
+}
+
+#else
+
+static inline int is_digit(char c) {
+    return (unsigned char)(c-'0') < 10;
+}
+
+// One field at a time, for targets without SSSE3:
+static size_t parse_dq_scalar(const char *s, size_t len, in_addr_t *ip)
+{
+    const char *p = s, *end = s+len;
+    in_addr_t   a = 0;
+    unsigned    v, nd, f;
+
+    for(f=0; f<4; f++) {
+        if( f>0 ) {
+            if( p>=end || *p!='.' ) {
+                return 0;
+            }
+            p++;
+        }
+        v  = 0;
+        nd = 0;
+        while( p<end && is_digit(*p) && nd<4 ) {
+            v = v*10 + (*p-'0');
+            p++;
+            nd++;
+        }
+        if( nd==0 || nd>3 || v>255 ) {
+            return 0;
+        }
+        a = a<<8 | v;
+    }
+
+    *ip = a;
+    return p-s;
+}
+
+#endif
+
+
+#if defined(__SSSE3__)
+// A 16-byte load that does not cross a page boundary cannot fault, even
+// if it reads past the end of the input:
+static inline int load_ok(const char *s) {
+    return ((uintptr_t)s & 4095) <= 4096-16;
+}
+#endif
+
+
+// Parses a dotted quad (four decimal fields of 1-3 digits, each no
+// more than 255) at the start of the 'len' bytes at 's', which need not
+// be NUL-terminated. Leading zeros are decimal, not octal as for
+// inet_aton(): "010.0.0.1" is 10.0.0.1. Returns the number of bytes
+// parsed, or 0 if they do not start with a dotted quad; the caller
+// decides what may follow:
+size_t ip_parse_dq(const char *s, size_t len, in_addr_t *ip)
+{
+#if defined(__SSSE3__)
+    char buf[16];
+
+    // With nothing to parse, 's' may be just past the end of a mapping:
+    if( len >= sizeof(buf) || (len > 0 && load_ok(s)) ) {
+        return parse_dq_simd(s, len < sizeof(buf) ? len : sizeof(buf), ip);
+    }
+    // At the end of a page, work on a copy rather than reading past it:
+    memset(buf, 0, sizeof(buf));
+    memcpy(buf, s, len);
+    return parse_dq_simd(buf, len, ip);
+#else
+    return parse_dq_scalar(s, len, ip);
+#endif
+}
+
+
+// As ip_parse_dq(), for a NUL-terminated string:
+size_t ip_parse_dq_str(const char *s, in_addr_t *ip)
+{
+#if defined(__SSSE3__)
+    if( load_ok(s) ) {
+        // The NUL stops the parse like any other non-digit:
+        return parse_dq_simd(s, 16, ip);
+    }
+#endif
+    return ip_parse_dq(s, strnlen(s, IP_PARSE_DQ_MAX+1), ip);
+}
+
+
+// 0-15 for a hex digit, 16 for anything else:
+static inline unsigned hex_value(char c) {
+    unsigned d = (unsigned char)c - '0';
+    unsigned l = ((unsigned char)c | 0x20) - 'a';
+    return d<10 ? d : l<6 ? l+10 : 16;
+}
+
+
+// Parses an IPv6 address in any of the RFC 4291 text forms (up to
+// eight hex groups, at most one "::", optionally ending in a dotted
+// quad) at the start of the 'len' bytes at 's'. Parsing stops at the
+// first byte that cannot continue the address. Returns the number of
+// bytes parsed, or 0 if they do not start with an address:
+size_t ip_parse_ip6(const char *s, size_t len, ip6_addr *ip)
+{
+    const char *p = s, *end = s+len, *group;
+    uint16_t    w[8];
+    unsigned    n = 0, gap = 8, nd, v, h, i;
+    in_addr_t   v4;
+    size_t      m;
+
+    if( len>=2 && p[0]==':' && p[1]==':' ) {
+        gap = 0;
+        p  += 2;
+    }
+
+    while( n<8 ) {
+        group = p;
+        for(v=0, nd=0; p<end && (h=hex_value(*p))<16; nd++, p++) {
+            v = v<<4 | h;
+        }
+        if( nd==0 ) {
+            // Only a leading "::" can be followed by nothing
+            if( gap==0 && n==0 ) {
+                break;
+            }
+            return 0;
+        }
+        if( p+1<end && *p=='.' && hex_value(p[1])<10 ) {
+            // The last 32 bits as a dotted quad
+            if( n>6 || 0==(m=ip_parse_dq(group, end-group, &v4)) ) {
+                return 0;
+            }
+            w[n++] = v4>>16;
+            w[n++] = v4&0xffff;
+            p = group+m;
+            break;
+        }
+        if( nd>4 ) {
+            return 0;
+        }
+        w[n++] = v;
+
+        if( n==8 || p+1>=end || *p!=':' ) {
+            break;
+        }
+        if( p[1]==':' ) {
+            if( gap<8 ) {
+                // A second "::" is not part of the address
+                break;
+            }
+            gap = n;
+            p  += 2;
+            if( p>=end || hex_value(*p)>=16 ) {
+                break;
+            }
+        } else if( hex_value(p[1])<16 ) {
+            p++;
+        } else {
+            break;
+        }
+    }
+
+    if( gap==8 ? n!=8 : n>7 ) {
+        return 0;
+    }
+    if( gap<8 ) {
+        // Move the groups after the "::" to the end, and zero the gap:
+        for(i=n; i-->gap; ) {
+            w[i+8-n] = w[i];
+        }
+        for(i=gap; i<gap+8-n; i++) {
+            w[i] = 0;
+        }
+    }
+
+    ip->hi = (uint64_t)w[0]<<48 | (uint64_t)w[1]<<32 | (uint64_t)w[2]<<16 | w[3];
+    ip->lo = (uint64_t)w[4]<<48 | (uint64_t)w[5]<<32 | (uint64_t)w[6]<<16 | w[7];
+    return p-s;
+}
+
+
+// As ip_parse_ip6(), for a NUL-terminated string:
+size_t ip_parse_ip6_str(const char *s, ip6_addr *ip)
+{
+    return ip_parse_ip6(s, strnlen(s, IP_PARSE_IP6_MAX+1), ip);
+}
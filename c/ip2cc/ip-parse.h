@@ -0,0 +1,25 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <arpa/inet.h>
+
+// Longest dotted quad, "255.255.255.255":
+#define IP_PARSE_DQ_MAX 15
+
+// Longest IPv6 address, "ffff:ffff:ffff:ffff:ffff:ffff:255.255.255.255":
+#define IP_PARSE_IP6_MAX 45
+
+typedef struct ip6_addr ip6_addr;
+
+// An IPv6 address as two host-order halves, so that addresses compare
+// as a pair of 64-bit integers:
+struct ip6_addr {
+    uint64_t  hi;
+    uint64_t  lo;
+};
+
+size_t ip_parse_dq(const char *s, size_t len, in_addr_t *ip);
+size_t ip_parse_dq_str(const char *s, in_addr_t *ip);
+size_t ip_parse_ip6(const char *s, size_t len, ip6_addr *ip);
+size_t ip_parse_ip6_str(const char *s, ip6_addr *ip);
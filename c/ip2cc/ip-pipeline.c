@@ -0,0 +1,449 @@
+#define _GNU_SOURCE 1           // For memrchr()
+
+#include <ip-pipeline.h>
+#include <assert.h>
+
+#include <stdarg.h>
+#include <stdint.h>
+#include <stdlib.h>     // For malloc(), realloc(), free()
+#include <string.h>     // For memcpy(), memrchr()
+#include <limits.h>     // For INT_MAX
+#include <pthread.h>
+#include <unistd.h>     // For syscall()
+#include <sys/syscall.h>
+#include <linux/futex.h>
+
+// Times a stage that is waiting tries its queue again before it
+// sleeps:
+#define SPINS 64
+
+
+// Single-producer, single-consumer ring of block pointers. Each end
+// owns one index and only reads the other's, so neither needs a lock;
+// the indices are on separate cache lines so the two ends do not
+// contend for one. An end that has to wait, for a block or for room,
+// sleeps on 'event', which the other end bumps whenever it pushes or
+// pops:
+typedef struct {
+    ip_block **slot;
+    size_t     mask;
+    size_t     head __attribute__((aligned(64)));   // Next to pop
+    size_t     tail __attribute__((aligned(64)));   // Next to push
+    uint32_t   event __attribute__((aligned(64)));  // The futex
+    uint32_t   sleepers;                            // Ends asleep on it
+} spsc;
+
+static void spsc_init(spsc *q, size_t size)
+{
+    // Round up to a power of two:
+    size_t n = 1;
+    while( n < size ) {
+        n <<= 1;
+    }
+    q->slot = malloc(n*sizeof(ip_block*));
+    assert( q->slot!=NULL );
+    q->mask = n-1;
+    q->head = 0;
+    q->tail = 0;
+    q->event    = 0;
+    q->sleepers = 0;
+}
+
+static void spsc_free(spsc *q)
+{
+    free(q->slot);
+}
+
+static bool spsc_push(spsc *q, ip_block *b)
+{
+    size_t t = q->tail;
+
+    if( t - __atomic_load_n(&q->head, __ATOMIC_ACQUIRE) > q->mask ) {
+        return false;
+    }
+    q->slot[t & q->mask] = b;
+    __atomic_store_n(&q->tail, t+1, __ATOMIC_RELEASE);
+    return true;
+}
+
+static ip_block* spsc_pop(spsc *q)
+{
+    size_t    h = q->head;
+    ip_block *b;
+
+    if( h == __atomic_load_n(&q->tail, __ATOMIC_ACQUIRE) ) {
+        return NULL;
+    }
+    b = q->slot[h & q->mask];
+    __atomic_store_n(&q->head, h+1, __ATOMIC_RELEASE);
+    return b;
+}
+
+// Blocking versions. A stage that is waiting spins briefly, then
+// sleeps until the other end has done something. A sleeper counts
+// itself in before it reads 'event' and tries again, and a waker bumps
+// 'event' before it looks for sleepers, so that either the sleeper
+// sees what the waker did or the waker sees the sleeper: futex(2)
+// returns at once if 'event' has moved since it was read.
+static void wake(spsc *q)
+{
+    __atomic_add_fetch(&q->event, 1, __ATOMIC_SEQ_CST);
+    if( __atomic_load_n(&q->sleepers, __ATOMIC_SEQ_CST)>0 ) {
+        syscall(SYS_futex, &q->event, FUTEX_WAKE_PRIVATE, INT_MAX, NULL, NULL, 0);
+    }
+}
+
+// One round of waiting on 'q'; returns once something may have changed
+// and the caller should try again. 'ready' is that try, made once more
+// after the sleeper is counted in:
+static void backoff(spsc *q, unsigned *spins, bool (*ready)(const spsc *q))
+{
+    uint32_t event;
+
+    if( ++*spins <= SPINS ) {
+        return;
+    }
+    __atomic_add_fetch(&q->sleepers, 1, __ATOMIC_SEQ_CST);
+    event = __atomic_load_n(&q->event, __ATOMIC_SEQ_CST);
+    if( !ready(q) ) {
+        syscall(SYS_futex, &q->event, FUTEX_WAIT_PRIVATE, event, NULL, NULL, 0);
+    }
+    __atomic_sub_fetch(&q->sleepers, 1, __ATOMIC_SEQ_CST);
+}
+
+static bool has_room(const spsc *q)
+{
+    return q->tail - __atomic_load_n(&q->head, __ATOMIC_ACQUIRE) <= q->mask;
+}
+
+static bool has_block(const spsc *q)
+{
+    return q->head != __atomic_load_n(&q->tail, __ATOMIC_ACQUIRE);
+}
+
+static void spsc_put(spsc *q, ip_block *b)
+{
+    unsigned spins = 0;
+
+    while( !spsc_push(q, b) ) {
+        backoff(q, &spins, has_room);
+    }
+    wake(q);
+}
+
+// The end of the input is put like any other block, so it wakes the
+// stage waiting for it too:
+static ip_block* spsc_get(spsc *q)
+{
+    unsigned  spins = 0;
+    ip_block *b;
+
+    while( NULL==(b=spsc_pop(q)) ) {
+        backoff(q, &spins, has_block);
+    }
+    wake(q);
+    return b;
+}
+
+
+void ip_block_init(ip_block *block)
+{
+    memset(block, 0, sizeof(ip_block));
+    block->cap = IP_PIPELINE_BLOCK;
+    block->in  = malloc(block->cap);
+    assert( block->in!=NULL );
+}
+
+void ip_block_free(ip_block *block)
+{
+    free(block->in);
+    free(block->out);
+    ip_hits_free(&block->hits);
+    ip6_hits_free(&block->hits6);
+}
+
+// Makes room for 'n' more bytes of output. Returns 0, or -1 with errno
+// set, the block being as it was:
+int ip_block_reserve(ip_block *block, size_t n)
+{
+    size_t cap = block->outcap ? 2*block->outcap : IP_PIPELINE_BLOCK;
+    char  *out;
+
+    if( block->outlen+n <= block->outcap ) {
+        return 0;
+    }
+    while( block->outlen+n > cap ) {
+        cap *= 2;
+    }
+    out = realloc(block->out, cap);
+    if( out==NULL ) {
+        return -1;
+    }
+    block->out    = out;
+    block->outcap = cap;
+    return 0;
+}
+
+// The pipeline has no way to go on without the output:
+static void reserve(ip_block *block, size_t n)
+{
+    if( 0!=ip_block_reserve(block, n) ) {
+        perror("ip_block_reserve");
+        exit(EXIT_FAILURE);
+    }
+}
+
+void ip_block_append(ip_block *block, const char *s, size_t n)
+{
+    reserve(block, n);
+    memcpy(block->out+block->outlen, s, n);
+    block->outlen += n;
+}
+
+void ip_block_printf(ip_block *block, const char *fmt, ...)
+{
+    va_list ap;
+    int     n;
+
+    va_start(ap, fmt);
+    n = vsnprintf(block->out+block->outlen, block->outcap-block->outlen, fmt, ap);
+    va_end(ap);
+    assert( n>=0 );
+
+    if( block->outlen+n >= block->outcap ) {
+        reserve(block, n+1);
+        va_start(ap, fmt);
+        vsnprintf(block->out+block->outlen, block->outcap-block->outlen, fmt, ap);
+        va_end(ap);
+    }
+    block->outlen += n;
+}
+
+
+// The input side: whatever follows the last newline of one block is
+// carried over to the start of the next.
+typedef struct {
+    FILE   *fp;
+    char   *carry;
+    size_t  ncarry;
+    size_t  cap;
+    size_t  seq;
+    bool    eof;
+} reader;
+
+// Fill 'block' with the next run of whole lines; false at the end of
+// the input:
+static bool read_block(reader *r, ip_block *block)
+{
+    char   *nl;
+    size_t  have;
+
+    if( r->eof && r->ncarry==0 ) {
+        return false;
+    }
+
+    if( block->cap < r->ncarry+IP_PIPELINE_BLOCK/2 ) {
+        block->cap = r->ncarry+IP_PIPELINE_BLOCK;
+        block->in  = realloc(block->in, block->cap);
+        assert( block->in!=NULL );
+    }
+    memcpy(block->in, r->carry, r->ncarry);
+    have = r->ncarry;
+
+    for(;;) {
+        if( !r->eof ) {
+            have += fread(block->in+have, 1, block->cap-have, r->fp);
+            r->eof = have < block->cap;
+        }
+        nl = memrchr(block->in, '\n', have);
+        if( nl!=NULL || r->eof ) {
+            break;
+        }
+        // A line longer than the block:
+        block->cap *= 2;
+        block->in   = realloc(block->in, block->cap);
+        assert( block->in!=NULL );
+    }
+
+    block->len = r->eof ? have : (size_t)(nl-block->in)+1;
+    r->ncarry  = have - block->len;
+    if( r->ncarry > r->cap ) {
+        r->cap   = r->ncarry;
+        r->carry = realloc(r->carry, r->cap);
+        assert( r->carry!=NULL );
+    }
+    memcpy(r->carry, block->in+block->len, r->ncarry);
+
+    block->seq    = r->seq++;
+    block->outlen = 0;
+    return true;
+}
+
+
+// Everything the threads share. Block 'seq' always goes to worker
+// seq%nworkers, and each worker handles its blocks in order, so the
+// writer restores the input order by taking from the workers in turn:
+typedef struct {
+    reader       r;
+    FILE        *out;
+    size_t       nworkers;
+    ip_block_fn  work;
+    void        *arg;
+    ip_block    *blocks;
+    spsc         free;      // Writer to reader
+    spsc        *todo;      // Reader to each worker
+    spsc        *done;      // Each worker to writer
+} pipeline;
+
+typedef struct {
+    pipeline *p;
+    size_t    id;
+} worker_arg;
+
+// Marks the end of the input in every queue:
+static ip_block last;
+
+static void* reader_main(void *arg)
+{
+    pipeline *p = arg;
+    ip_block *b;
+    size_t    i;
+
+    for(;;) {
+        b = spsc_get(&p->free);
+        if( !read_block(&p->r, b) ) {
+            break;
+        }
+        spsc_put(p->todo+b->seq%p->nworkers, b);
+    }
+    for(i=0; i<p->nworkers; i++) {
+        spsc_put(p->todo+i, &last);
+    }
+    return NULL;
+}
+
+static void* worker_main(void *arg)
+{
+    pipeline *p  = ((worker_arg*)arg)->p;
+    size_t    id = ((worker_arg*)arg)->id;
+    ip_block *b;
+
+    do {
+        b = spsc_get(p->todo+id);
+        if( b!=&last ) {
+            b->worker = id;
+            p->work(b, p->arg);
+        }
+        spsc_put(p->done+id, b);
+    } while( b!=&last );
+
+    return NULL;
+}
+
+static void writer_main(pipeline *p)
+{
+    ip_block *b;
+    size_t    seq;
+
+    for(seq=0; ; seq++) {
+        b = spsc_get(p->done+seq%p->nworkers);
+        if( b==&last ) {
+            break;
+        }
+        fwrite(b->out, 1, b->outlen, p->out);
+        spsc_put(&p->free, b);
+    }
+}
+
+
+// Run 'work' over 'in' a block at a time, writing the results to 'out'
+// in the order of the input. With more than one worker, a reader
+// thread, the workers and the writer (the calling thread) run
+// concurrently:
+void ip_pipeline_run(FILE *in, FILE *out, size_t nworkers, ip_block_fn work, void *arg)
+{
+    pipeline    p;
+    pthread_t   rtid;
+    pthread_t  *wtids = NULL;
+    worker_arg *wargs = NULL;
+    size_t      i, nblocks;
+
+    memset(&p, 0, sizeof(p));
+    p.r.fp = in;
+
+    if( nworkers<=1 ) {
+        ip_block b;
+
+        ip_block_init(&b);
+        while( read_block(&p.r, &b) ) {
+            work(&b, arg);
+            fwrite(b.out, 1, b.outlen, out);
+        }
+        ip_block_free(&b);
+        free(p.r.carry);
+        return;
+    }
+
+    p.out      = out;
+    p.nworkers = nworkers;
+    p.work     = work;
+    p.arg      = arg;
+
+    nblocks  = nworkers*IP_PIPELINE_DEPTH;
+    p.blocks = malloc(nblocks*sizeof(ip_block));
+    wtids    = malloc(nworkers*sizeof(pthread_t));
+    wargs    = malloc(nworkers*sizeof(worker_arg));
+    assert( p.blocks!=NULL && wtids!=NULL && wargs!=NULL );
+    if( 0!=posix_memalign((void**)&p.todo, 64, nworkers*sizeof(spsc))
+        || 0!=posix_memalign((void**)&p.done, 64, nworkers*sizeof(spsc)) ) {
+        perror("posix_memalign");
+        exit(EXIT_FAILURE);
+    }
+
+    // Every queue can hold every block, so a push never waits for
+    // space, only a pop for work:
+    spsc_init(&p.free, nblocks);
+    for(i=0; i<nblocks; i++) {
+        ip_block_init(p.blocks+i);
+        spsc_push(&p.free, p.blocks+i);
+    }
+    for(i=0; i<nworkers; i++) {
+        spsc_init(p.todo+i, nblocks+1);
+        spsc_init(p.done+i, nblocks+1);
+    }
+
+    for(i=0; i<nworkers; i++) {
+        wargs[i].p  = &p;
+        wargs[i].id = i;
+        if( 0!=pthread_create(wtids+i, NULL, worker_main, wargs+i) ) {
+            perror("pthread_create");
+            exit(EXIT_FAILURE);
+        }
+    }
+    if( 0!=pthread_create(&rtid, NULL, reader_main, &p) ) {
+        perror("pthread_create");
+        exit(EXIT_FAILURE);
+    }
+
+    writer_main(&p);
+
+    pthread_join(rtid, NULL);
+    for(i=0; i<nworkers; i++) {
+        pthread_join(wtids[i], NULL);
+    }
+
+    for(i=0; i<nworkers; i++) {
+        spsc_free(p.todo+i);
+        spsc_free(p.done+i);
+    }
+    spsc_free(&p.free);
+    for(i=0; i<nblocks; i++) {
+        ip_block_free(p.blocks+i);
+    }
+    free(p.r.carry);
+    free(wargs);
+    free(wtids);
+    free(p.done);
+    free(p.todo);
+    free(p.blocks);
+}
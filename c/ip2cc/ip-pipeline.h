@@ -0,0 +1,41 @@
+#pragma once
+
+#include <stdio.h>
+#include <stddef.h>
+#include <stdbool.h>
+#include <ip-scan.h>
+
+// Text is read in blocks of at least this many bytes, cut at a line
+// boundary:
+#define IP_PIPELINE_BLOCK (1<<20)
+
+// Blocks in flight per worker:
+#define IP_PIPELINE_DEPTH 4
+
+typedef struct ip_block ip_block;
+
+// A block of whole lines of input and the output produced from it:
+struct ip_block {
+    size_t    seq;          // Position of the block in the input
+    size_t    worker;       // Which worker is running 'work' on it
+    char     *in;
+    size_t    len;          // Bytes of input in the block
+    size_t    cap;
+    char     *out;
+    size_t    outlen;
+    size_t    outcap;
+    ip_hits   hits;         // Scratch space for the worker
+    ip6_hits  hits6;
+};
+
+// Turns a block's input into its output:
+typedef void (*ip_block_fn)(ip_block *block, void *arg);
+
+void ip_pipeline_run(FILE *in, FILE *out, size_t nworkers, ip_block_fn work, void *arg);
+
+void ip_block_init(ip_block *block);
+void ip_block_free(ip_block *block);
+int  ip_block_reserve(ip_block *block, size_t n);
+void ip_block_append(ip_block *block, const char *s, size_t n);
+void ip_block_printf(ip_block *block, const char *fmt, ...)
+    __attribute__((format(printf, 2, 3)));
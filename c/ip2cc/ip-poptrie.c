@@ -0,0 +1,459 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include <ip-poptrie.h>
+#include <ip-parse.h>
+#include <assert.h>
+
+#include <stdio.h>      // For fopen(), getline()
+#include <errno.h>
+#include <stdlib.h>     // For malloc(), qsort(), free()
+#include <string.h>     // For memcpy()
+#include <sys/param.h>  // For MIN()
+#include <sys/types.h>  // For ssize_t
+#include <arpa/inet.h>  // For inet_ntop()
+
+// Nested prefixes, from /0 to /32, are at most this deep:
+#define IP_POPTRIE_DEPTH 33
+
+
+// The lookup result as a function of the address: segment i covers
+// addresses from 'start' up to the next segment's start, and the first
+// segment starts at 0:
+typedef struct {
+    uint32_t  start;
+    uint32_t  leaf;
+} segment;
+
+typedef struct {
+    segment  *seg;
+    size_t    n;
+    size_t    cap;
+} segments;
+
+// Appends a segment, merging it with the last one if that starts at the
+// same address or has the same leaf:
+static int emit(segments *s, uint32_t start, uint32_t leaf)
+{
+    segment *seg;
+
+    if( s->n>0 && s->seg[s->n-1].start==start ) {
+        s->seg[s->n-1].leaf = leaf;
+        if( s->n>1 && s->seg[s->n-2].leaf==leaf ) {
+            s->n--;
+        }
+        return 0;
+    }
+    if( s->n>0 && s->seg[s->n-1].leaf==leaf ) {
+        return 0;
+    }
+    if( s->n==s->cap ) {
+        s->cap = s->cap ? 2*s->cap : 1024;
+        seg = realloc(s->seg, s->cap*sizeof(segment));
+        if( seg==NULL ) {
+            return -1;
+        }
+        s->seg = seg;
+    }
+    s->seg[s->n].start = start;
+    s->seg[s->n].leaf  = leaf;
+    s->n++;
+    return 0;
+}
+
+// Advances 'i' to the segment that 'addr' is in, and returns whether
+// that segment covers all of [addr, end]. The slots of a trie are
+// visited in order, so one cursor walks the segments for the whole
+// build:
+static int uniform(const segments *s, size_t *i, uint32_t addr, uint32_t end)
+{
+    while( *i+1 < s->n && s->seg[*i+1].start <= addr ) {
+        ++*i;
+    }
+    return *i+1==s->n || s->seg[*i+1].start > end;
+}
+
+
+static int grow(void **array, size_t *cap, size_t need, size_t size)
+{
+    size_t n = *cap ? *cap : 1024;
+    void  *p;
+
+    if( need <= *cap ) {
+        return 0;
+    }
+    while( n < need ) {
+        n *= 2;
+    }
+    p = realloc(*array, n*size);
+    if( p==NULL ) {
+        return -1;
+    }
+    *array = p;
+    *cap   = n;
+    return 0;
+}
+
+typedef struct {
+    ip_poptrie *pt;
+    size_t      tcap;
+    size_t      lcap;
+} builder;
+
+// Fills in trie 't', which covers the addresses from 'base' whose
+// first 'offset' bits are those of 'base', and then its children.
+// Segment 'first' is the one that 'base' is in:
+static int build_trie(builder *b, const segments *s, size_t t, uint32_t base, unsigned offset, size_t first)
+{
+    ip_poptrie *pt = b->pt;
+    unsigned    stride = MIN(IP_POPTRIE_STRIDE, 32-offset);
+    unsigned    shift  = 32-offset-stride;
+    uint64_t    vector = 0, leafvec = 0;
+    uint32_t    slot, leaf, last = 0;
+    size_t      j, v, c, i, nchild = 0, base0 = pt->nleaves;
+
+    // At the last level there are fewer than 64 slots; they are spread
+    // out to match the zero bits that lookups shift in below the end of
+    // the address:
+    for(i=first, j=0; j < (size_t)1<<stride; j++) {
+        v    = j << (IP_POPTRIE_STRIDE-stride);
+        slot = base + ((uint32_t)j<<shift);
+        if( !uniform(s, &i, slot, slot + (((uint32_t)1<<shift)-1)) ) {
+            vector |= (uint64_t)1<<v;
+            nchild++;
+            continue;
+        }
+        leaf = s->seg[i].leaf;
+        if( leafvec==0 || leaf!=last ) {
+            if( grow((void**)&pt->leaves, &b->lcap, pt->nleaves+1, sizeof(uint32_t)) ) {
+                return -1;
+            }
+            pt->leaves[pt->nleaves++] = leaf;
+            leafvec |= (uint64_t)1<<v;
+            last     = leaf;
+        }
+    }
+
+    if( grow((void**)&pt->tries, &b->tcap, pt->ntries+nchild, sizeof(ip_poptrie_trie)) ) {
+        return -1;
+    }
+    pt->tries[t].vector  = vector;
+    pt->tries[t].leafvec = leafvec;
+    pt->tries[t].base0   = base0;
+    pt->tries[t].base1   = pt->ntries;
+    c = pt->ntries;
+    pt->ntries += nchild;
+
+    for(i=first, j=0; j < (size_t)1<<stride; j++) {
+        v    = j << (IP_POPTRIE_STRIDE-stride);
+        slot = base + ((uint32_t)j<<shift);
+        if( vector>>v & 1 ) {
+            uniform(s, &i, slot, slot);
+            if( build_trie(b, s, c++, slot, offset+stride, i) ) {
+                return -1;
+            }
+        }
+    }
+    return 0;
+}
+
+// Builds the trie over 'nodes', which it takes ownership of:
+static ip_poptrie* build(ip_cbst_node *nodes, size_t nmemb, const segments *s)
+{
+    ip_poptrie *pt = NULL;
+    builder     b;
+    size_t      p, t, i = 0;
+    uint32_t    slot;
+
+    pt = calloc(1, sizeof(ip_poptrie));
+    if( pt==NULL ) {
+        free(nodes);
+        return NULL;
+    }
+    pt->nodes = nodes;
+    pt->nmemb = nmemb;
+    pt->top   = malloc(((size_t)1<<IP_POPTRIE_BITS)*sizeof(uint32_t));
+    if( pt->top==NULL ) {
+        ip_poptrie_free(pt);
+        return NULL;
+    }
+
+    memset(&b, 0, sizeof(b));
+    b.pt = pt;
+    for(p=0; p < (size_t)1<<IP_POPTRIE_BITS; p++) {
+        slot = (uint32_t)p << (32-IP_POPTRIE_BITS);
+        if( uniform(s, &i, slot, slot + (((uint32_t)1<<(32-IP_POPTRIE_BITS))-1)) ) {
+            pt->top[p] = IP_POPTRIE_LEAF | s->seg[i].leaf;
+            continue;
+        }
+        t = pt->ntries;
+        if( grow((void**)&pt->tries, &b.tcap, t+1, sizeof(ip_poptrie_trie)) ) {
+            ip_poptrie_free(pt);
+            return NULL;
+        }
+        pt->ntries++;
+        if( build_trie(&b, s, t, slot, IP_POPTRIE_BITS, i) ) {
+            ip_poptrie_free(pt);
+            return NULL;
+        }
+        pt->top[p] = t;
+    }
+
+    return pt;
+}
+
+
+// Over disjoint ranges in sorted order; the gaps between them map to
+// no match:
+ip_poptrie* ip_poptrie_new(const ip_cbst_node *sorted, size_t nmemb)
+{
+    ip_cbst_node *nodes = NULL;
+    ip_poptrie   *pt    = NULL;
+    segments      s;
+    size_t        i;
+
+    assert( sorted!=NULL || nmemb==0 );
+    assert( nmemb < IP_POPTRIE_MASK );
+
+    nodes = malloc((nmemb ? nmemb : 1)*sizeof(ip_cbst_node));
+    if( nodes==NULL ) {
+        return NULL;
+    }
+    memcpy(nodes, sorted, nmemb*sizeof(ip_cbst_node));
+
+    memset(&s, 0, sizeof(s));
+    if( emit(&s, 0, 0) ) {
+        free(nodes);
+        return NULL;
+    }
+    for(i=0; i<nmemb; i++) {
+        if( emit(&s, nodes[i].addr_lo, i+1)
+            || (nodes[i].addr_hi!=UINT32_MAX && emit(&s, nodes[i].addr_hi+1, 0)) ) {
+            free(s.seg);
+            free(nodes);
+            return NULL;
+        }
+    }
+
+    pt = build(nodes, nmemb, &s);
+    free(s.seg);
+    return pt;
+}
+
+
+ip_poptrie* ip_poptrie_from_cbst(const ip_cbst_node *cbst, size_t nmemb)
+{
+    ip_cbst_node *sorted = NULL;
+    ip_poptrie   *pt     = NULL;
+
+    sorted = cbst_to_sorted_array(cbst, nmemb, sizeof(ip_cbst_node));
+    if( sorted==NULL ) {
+        return NULL;
+    }
+    pt = ip_poptrie_new(sorted, nmemb);
+    free(sorted);
+
+    return pt;
+}
+
+
+// Shorter prefixes first where two start at the same address, so that
+// the longer one is on top of the stack below:
+static int prefix_compar(const void *a, const void *b)
+{
+    const ip_cbst_node *x = a, *y = b;
+
+    if( x->addr_lo != y->addr_lo ) {
+        return x->addr_lo < y->addr_lo ? -1 : 1;
+    }
+    if( x->addr_hi != y->addr_hi ) {
+        return x->addr_hi > y->addr_hi ? -1 : 1;
+    }
+    return 0;
+}
+
+// Drops repeats of a prefix, which sort next to each other, so that
+// no two prefixes nest as equals. Returns the number left, or -1 with
+// errno set to EINVAL if a prefix is given with two country codes,
+// which is named in a message:
+static ssize_t dedup(ip_cbst_node *nodes, size_t nmemb, const char *filename)
+{
+    char   dq[INET_ADDRSTRLEN];
+    struct in_addr ip;
+    size_t i, n = 0;
+
+    for(i=0; i<nmemb; i++) {
+        if( n>0 && 0==prefix_compar(nodes+n-1, nodes+i) ) {
+            if( 0!=strcmp(nodes[n-1].cc, nodes[i].cc) ) {
+                ip.s_addr = htonl(nodes[i].addr_lo);
+                fprintf(stderr, "%s: %s/%d given as both %s and %s\n", filename,
+                        inet_ntop(AF_INET, &ip, dq, sizeof(dq)),
+                        32-__builtin_popcount(nodes[i].addr_lo ^ nodes[i].addr_hi),
+                        nodes[n-1].cc, nodes[i].cc);
+                errno = EINVAL;
+                return -1;
+            }
+            continue;
+        }
+        nodes[n++] = nodes[i];
+    }
+    return n;
+}
+
+// The segments of a set of distinct, possibly nested prefixes, sorted
+// by prefix_compar(). The prefixes that contain the current address
+// are kept on a stack, and the innermost one is the longest match;
+// each is longer than the one below it, so there are at most 33:
+static int flatten(const ip_cbst_node *nodes, size_t nmemb, segments *s)
+{
+    size_t stack[IP_POPTRIE_DEPTH];
+    size_t depth = 0, i, t;
+
+    if( emit(s, 0, 0) ) {
+        return -1;
+    }
+    for(i=0; i<=nmemb; i++) {
+        // Close the prefixes that end before this one starts:
+        while( depth>0 && (i==nmemb || nodes[stack[depth-1]].addr_hi < nodes[i].addr_lo) ) {
+            t = stack[--depth];
+            if( nodes[t].addr_hi!=UINT32_MAX
+                && emit(s, nodes[t].addr_hi+1, depth>0 ? stack[depth-1]+1 : 0) ) {
+                return -1;
+            }
+        }
+        if( i==nmemb ) {
+            break;
+        }
+        assert( depth<IP_POPTRIE_DEPTH );
+        if( emit(s, nodes[i].addr_lo, i+1) ) {
+            return -1;
+        }
+        stack[depth++] = i;
+    }
+    return 0;
+}
+
+
+// Loads prefixes, one "a.b.c.d/len cc" per line, in any order and
+// possibly nested; each address matches its longest prefix, and a
+// prefix may be repeated with the same country code. The nodes that
+// lookups return are the prefixes, as ranges. Returns NULL, with errno
+// set and a message printed, if the file cannot be read or a line is
+// malformed:
+ip_poptrie* ip_poptrie_load_cidr(const char *filename)
+{
+    FILE         *fp    = NULL;
+    char         *line  = NULL, *p;
+    size_t        len   = 0, nmemb = 0, cap = 0;
+    ssize_t       n_read;
+    ip_cbst_node *nodes = NULL;
+    ip_poptrie   *pt    = NULL;
+    segments      s;
+    in_addr_t     addr, mask;
+    unsigned long plen;
+    size_t        dq;
+
+    memset(&s, 0, sizeof(s));
+    fp = fopen(filename, "r");
+    if( fp==NULL ) {
+        perror(filename);
+        return NULL;
+    }
+
+    while( -1 != (n_read=getline(&line, &len, fp)) ) {
+        dq = ip_parse_dq(line, n_read, &addr);
+        p  = line+dq;
+        if( dq==0 || *p!='/' || (unsigned)(p[1]-'0') > 9
+            || (plen=strtoul(p+1, &p, 10)) > 32 || *p!=' ' || p[1]=='\0' || p[2]=='\0' ) {
+            fprintf(stderr, "%s: malformed line: %s", filename, line);
+            errno = EINVAL;
+            goto fail;
+        }
+        if( grow((void**)&nodes, &cap, nmemb+1, sizeof(ip_cbst_node)) ) {
+            perror(filename);
+            goto fail;
+        }
+        // Any host bits are ignored:
+        mask = plen ? UINT32_MAX << (32-plen) : 0;
+        nodes[nmemb].addr_lo = addr & mask;
+        nodes[nmemb].addr_hi = addr | ~mask;
+        nodes[nmemb].cc[0]   = p[1];
+        nodes[nmemb].cc[1]   = p[2];
+        nodes[nmemb].cc[2]   = '\0';
+        nodes[nmemb].flag    = 0;
+        nmemb++;
+    }
+    if( ferror(fp) ) {
+        perror(filename);
+        goto fail;
+    }
+    free(line);
+    line = NULL;
+    fclose(fp);
+    fp = NULL;
+
+    qsort(nodes, nmemb, sizeof(ip_cbst_node), prefix_compar);
+    n_read = dedup(nodes, nmemb, filename);
+    if( n_read<0 ) {
+        goto fail;
+    }
+    nmemb = n_read;
+    if( flatten(nodes, nmemb, &s) ) {
+        goto fail;
+    }
+    pt = build(nodes, nmemb, &s);
+    free(s.seg);
+    return pt;
+
+fail:
+    free(s.seg);
+    free(nodes);
+    free(line);
+    if( fp!=NULL ) {
+        fclose(fp);
+    }
+    return NULL;
+}
+
+
+void ip_poptrie_free(ip_poptrie *pt)
+{
+    if( pt!=NULL ) {
+        free(pt->top);
+        free(pt->tries);
+        free(pt->leaves);
+        free(pt->nodes);
+        free(pt);
+    }
+}
+
+
+// The top-level entry, then one trie node per IP_POPTRIE_STRIDE bits
+// until a slot without a child, whose leaf is the answer:
+const ip_cbst_node* ip_poptrie_lookup_ip(const ip_poptrie *pt, in_addr_t ip)
+{
+    const ip_poptrie_trie *t;
+    uint32_t e;
+    unsigned offset, v;
+    uint64_t below;
+
+    if( pt==NULL ) {
+        return NULL;
+    }
+
+    e = pt->top[ip >> (32-IP_POPTRIE_BITS)];
+    if( !(e & IP_POPTRIE_LEAF) ) {
+        t = pt->tries+e;
+        for(offset=IP_POPTRIE_BITS; ; offset+=IP_POPTRIE_STRIDE) {
+            v     = (uint32_t)(ip << offset) >> (32-IP_POPTRIE_STRIDE);
+            below = ~(uint64_t)0 >> (63-v);     // Bits 0 to v
+            if( !(t->vector>>v & 1) ) {
+                e = pt->leaves[t->base0 + __builtin_popcountll(t->leafvec & below) - 1];
+                break;
+            }
+            t = pt->tries + t->base1 + __builtin_popcountll(t->vector & below) - 1;
+        }
+    }
+    e &= IP_POPTRIE_MASK;
+
+    return e ? pt->nodes+e-1 : NULL;
+}
@@ -0,0 +1,49 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <ip-cbst.h>
+
+// Address bits resolved by the direct-indexed top level, and by each
+// trie node below it:
+#define IP_POPTRIE_BITS   16
+#define IP_POPTRIE_STRIDE 6
+
+// Set in a top-level entry that is a leaf rather than a node index:
+#define IP_POPTRIE_LEAF   0x80000000u
+#define IP_POPTRIE_MASK   0x7fffffffu
+
+typedef struct ip_poptrie      ip_poptrie;
+typedef struct ip_poptrie_trie ip_poptrie_trie;
+
+// One multibit trie node covering IP_POPTRIE_STRIDE bits: bit v of
+// 'vector' is set if slot v has a child node, and bit v of 'leafvec' is
+// set where a run of slots with the same leaf begins. The children and
+// the leaves are each stored contiguously, so a slot's child or leaf is
+// found from the popcount of the bits below it:
+struct ip_poptrie_trie {
+    uint64_t  vector;
+    uint64_t  leafvec;
+    uint32_t  base0;    // First leaf, in 'leaves'
+    uint32_t  base1;    // First child, in 'tries'
+};
+
+// A longest-prefix-match trie (after Asai and Ohara's Poptrie) with a
+// direct-indexed top level. A leaf is the index of a node plus one, or
+// 0 for no match. Lookups take the top-level entry and at most three
+// trie nodes:
+struct ip_poptrie {
+    uint32_t        *top;       // 2^IP_POPTRIE_BITS entries
+    ip_poptrie_trie *tries;
+    size_t           ntries;
+    uint32_t        *leaves;
+    size_t           nleaves;
+    ip_cbst_node    *nodes;     // The ranges, or one per CIDR prefix
+    size_t           nmemb;
+};
+
+ip_poptrie*         ip_poptrie_new(const ip_cbst_node *sorted, size_t nmemb);
+ip_poptrie*         ip_poptrie_from_cbst(const ip_cbst_node *cbst, size_t nmemb);
+ip_poptrie*         ip_poptrie_load_cidr(const char *filename);
+void                ip_poptrie_free(ip_poptrie *pt);
+const ip_cbst_node* ip_poptrie_lookup_ip(const ip_poptrie *pt, in_addr_t ip);
@@ -0,0 +1,407 @@
+#define _GNU_SOURCE 1
+
+#include <defaults.h>
+#include <ip-reload.h>
+#include <assert.h>
+
+#include <stdio.h>      // For fprintf(), perror()
+#include <stdlib.h>     // For calloc(), free(), getenv()
+#include <string.h>     // For strrchr(), strcmp()
+#include <errno.h>
+#include <limits.h>     // For NAME_MAX
+#include <poll.h>
+#include <pthread.h>
+#include <time.h>       // For nanosleep()
+#include <unistd.h>     // For read(), write(), close()
+#include <sys/eventfd.h>
+#include <sys/inotify.h>
+
+
+// Takes ownership of 'engine', which must have been built over 'cbst',
+// and of 'cbst' too if 'own' is set:
+ip_db* ip_db_new(const ip_cbst_node *cbst, size_t nmemb, ip_engine *engine, bool own)
+{
+    static uint64_t generations;
+    ip_db *db;
+
+    assert( cbst!=NULL && engine!=NULL );
+
+    db = calloc(1, sizeof(ip_db));
+    if( db==NULL ) {
+        return NULL;
+    }
+    db->cbst       = cbst;
+    db->nmemb      = nmemb;
+    db->cbst6      = ip_cbst_ip6(cbst, &db->nmemb6);
+    db->engine     = engine;
+    db->own        = own;
+    db->generation = __atomic_add_fetch(&generations, 1, __ATOMIC_RELAXED);
+    return db;
+}
+
+
+void ip_db_free(ip_db *db)
+{
+    if( db!=NULL ) {
+        ip_engine_free(db->engine);
+        if( db->own ) {
+            ip_cbst_free(db->cbst);
+        }
+        free(db);
+    }
+}
+
+
+// A text database to watch: the directory it is in, since a new feed
+// is as likely to be renamed into place as written over the old one,
+// and its name there:
+typedef struct {
+    int   wd;
+    char  dir[PATH_MAX];
+    char  name[NAME_MAX+1];
+} watched;
+
+// Epoch-based reclamation. Each reader has a slot of its own, on its
+// own cache line, holding the epoch it entered in, or 0 while it holds
+// no generation. The writer swaps in the new generation, starts a new
+// epoch, and frees the old generation once no slot holds an earlier
+// epoch. Readers never wait; only the writer does:
+typedef struct {
+    uint64_t  epoch __attribute__((aligned(64)));
+} slot;
+
+struct ip_reload {
+    ip_db       *db;            // The current generation
+    const char  *engine_name;
+    size_t       nreaders;
+    slot        *slots;
+    uint64_t     epoch __attribute__((aligned(64)));
+    watched      files[2];      // IPv4 and IPv6
+    int          inotify_fd;
+    int          stop_fd;
+    pthread_t    tid;
+    bool         watching;
+    ip_cbst_shared *shared;     // Followed instead of the files, or NULL
+};
+
+
+// Starts serving 'db' to 'nreaders' readers, numbered from 0, which
+// must not share a number. Takes ownership of 'db':
+ip_reload* ip_reload_new(ip_db *db, const char *engine_name, size_t nreaders)
+{
+    ip_reload *reload;
+
+    assert( db!=NULL );
+    assert( nreaders>0 );
+
+    reload = calloc(1, sizeof(ip_reload));
+    if( reload==NULL
+        || 0!=posix_memalign((void**)&reload->slots, 64, nreaders*sizeof(slot)) ) {
+        free(reload);
+        return NULL;
+    }
+    memset(reload->slots, 0, nreaders*sizeof(slot));
+    reload->db          = db;
+    reload->engine_name = engine_name;
+    reload->nreaders    = nreaders;
+    reload->epoch       = 1;
+    reload->inotify_fd  = -1;
+    reload->stop_fd     = -1;
+    return reload;
+}
+
+
+// Starts a read-side critical section for reader 'reader', and returns
+// the generation to use in it. It stays valid until the matching
+// ip_reload_leave(), however many rebuilds there are meanwhile. The
+// store to the slot must be visible before the load of the generation,
+// hence the full barriers:
+const ip_db* ip_reload_enter(ip_reload *reload, size_t reader)
+{
+    assert( reader<reload->nreaders );
+
+    __atomic_store_n(&reload->slots[reader].epoch,
+                     __atomic_load_n(&reload->epoch, __ATOMIC_RELAXED), __ATOMIC_SEQ_CST);
+    return __atomic_load_n(&reload->db, __ATOMIC_SEQ_CST);
+}
+
+
+void ip_reload_leave(ip_reload *reload, size_t reader)
+{
+    assert( reader<reload->nreaders );
+
+    __atomic_store_n(&reload->slots[reader].epoch, 0, __ATOMIC_RELEASE);
+}
+
+
+// Waits until every reader that may have seen a generation replaced
+// before the call has left its critical section:
+static void synchronize(ip_reload *reload)
+{
+    const struct timespec pause = { 0, 100000 };
+    uint64_t epoch, seen;
+    size_t   i;
+
+    epoch = __atomic_add_fetch(&reload->epoch, 1, __ATOMIC_SEQ_CST);
+    for(i=0; i<reload->nreaders; i++) {
+        for(;;) {
+            seen = __atomic_load_n(&reload->slots[i].epoch, __ATOMIC_SEQ_CST);
+            if( seen==0 || seen>=epoch ) {
+                break;
+            }
+            nanosleep(&pause, NULL);
+        }
+    }
+}
+
+
+// Makes 'db' the current generation, and frees the one it replaces
+// once no reader can still be using it:
+static void swap(ip_reload *reload, ip_db *db)
+{
+    ip_db *old;
+
+    old = __atomic_exchange_n(&reload->db, db, __ATOMIC_SEQ_CST);
+    synchronize(reload);
+    ip_db_free(old);
+}
+
+
+// Rebuilds from the text, writes the binary database for the next
+// process to start, and swaps the new generation in. A text database
+// that cannot be read, or has a malformed line, leaves the current
+// generation in place; the next change to it is tried again:
+static void rebuild(ip_reload *reload)
+{
+    const ip_cbst_node *cbst;
+    ip_engine *engine;
+    ip_db     *db;
+    size_t     nmemb;
+
+    cbst = ip_cbst_load_text(NULL, &nmemb);
+    if( cbst==NULL ) {
+        fprintf(stderr, "%s: cannot load, keeping the old database\n",
+                getenv(IP2CC_TXTDB_ENVAR)!=NULL ? getenv(IP2CC_TXTDB_ENVAR) : IP2CC_TXTDB_NAME);
+        return;
+    }
+    if( 0!=ip_cbst_save_bin(cbst, nmemb, NULL) ) {
+        perror("cannot save the binary database");
+    }
+
+    engine = ip_engine_new_owned(reload->engine_name, cbst, nmemb);
+    db     = engine!=NULL ? ip_db_new(cbst, nmemb, engine, true) : NULL;
+    if( db==NULL ) {
+        fprintf(stderr, "%s: cannot rebuild, keeping the old database\n",
+                reload->engine_name!=NULL ? reload->engine_name : "cbst");
+        ip_engine_free(engine);
+        ip_cbst_free(cbst);
+        return;
+    }
+
+    swap(reload, db);
+}
+
+
+// True if the events in 'buf' include one for a watched file:
+static bool relevant(const ip_reload *reload, const char *buf, ssize_t len)
+{
+    const struct inotify_event *ev;
+    const char *p;
+    size_t i;
+
+    for(p=buf; p<buf+len; p+=sizeof(struct inotify_event)+ev->len) {
+        ev = (const struct inotify_event*)p;
+        if( ev->mask & IN_Q_OVERFLOW ) {
+            return true;
+        }
+        for(i=0; i<2; i++) {
+            if( reload->files[i].wd>=0 && ev->wd==reload->files[i].wd
+                && ev->len>0 && 0==strcmp(ev->name, reload->files[i].name) ) {
+                return true;
+            }
+        }
+    }
+    return false;
+}
+
+
+static void* watch_main(void *arg)
+{
+    ip_reload    *reload = arg;
+    struct pollfd fds[2];
+    char          buf[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+    bool          pending = false;
+    ssize_t       len;
+    int           n;
+
+    fds[0].fd     = reload->inotify_fd;
+    fds[0].events = POLLIN;
+    fds[1].fd     = reload->stop_fd;
+    fds[1].events = POLLIN;
+
+    for(;;) {
+        n = poll(fds, 2, pending ? IP_RELOAD_QUIET_MS : -1);
+        if( n<0 ) {
+            if( errno==EINTR ) {
+                continue;
+            }
+            perror("poll");
+            break;
+        }
+        if( fds[1].revents ) {
+            break;
+        }
+        if( n==0 ) {
+            pending = false;
+            rebuild(reload);
+            continue;
+        }
+        len = read(reload->inotify_fd, buf, sizeof(buf));
+        if( len>0 && relevant(reload, buf, len) ) {
+            pending = true;
+        }
+    }
+    return NULL;
+}
+
+
+// Moves to the newest generation published in shared memory, if it is
+// not the one in use. Its image is mapped alongside the old one, which
+// goes with the generation it belongs to:
+static void follow(ip_reload *reload)
+{
+    ip_cbst_shared *sh = reload->shared;
+    ip_engine *engine;
+    ip_db     *db;
+
+    if( !ip_cbst_shared_refresh(sh) ) {
+        return;
+    }
+    engine = ip_engine_new(reload->engine_name, sh->cbst, sh->nmemb);
+    db     = engine!=NULL ? ip_db_new(sh->cbst, sh->nmemb, engine, true) : NULL;
+    if( db==NULL ) {
+        fprintf(stderr, "%s: cannot use generation %llu, keeping the old database\n",
+                sh->name, (unsigned long long)sh->generation);
+        ip_engine_free(engine);
+        ip_cbst_free(sh->cbst);
+        return;
+    }
+    swap(reload, db);
+}
+
+static void* follow_main(void *arg)
+{
+    ip_reload    *reload = arg;
+    struct pollfd fd;
+    int           n;
+
+    fd.fd     = reload->stop_fd;
+    fd.events = POLLIN;
+
+    for(;;) {
+        n = poll(&fd, 1, IP_RELOAD_SHM_MS);
+        if( n<0 && errno!=EINTR ) {
+            perror("poll");
+            break;
+        }
+        if( n>0 ) {
+            break;
+        }
+        follow(reload);
+    }
+    return NULL;
+}
+
+
+static void watch_path(ip_reload *reload, watched *w, const char *path)
+{
+    const char *slash;
+
+    w->wd = -1;
+    if( path==NULL || strlen(path) >= sizeof(w->dir) ) {
+        return;
+    }
+    slash = strrchr(path, '/');
+    if( slash==NULL ) {
+        strcpy(w->dir, ".");
+        snprintf(w->name, sizeof(w->name), "%s", path);
+    } else {
+        snprintf(w->dir, sizeof(w->dir), "%.*s", (int)(slash==path ? 1 : slash-path), path);
+        snprintf(w->name, sizeof(w->name), "%s", slash+1);
+    }
+    w->wd = inotify_add_watch(reload->inotify_fd, w->dir, IN_CLOSE_WRITE|IN_MOVED_TO);
+}
+
+
+// Watches the text databases named by $IP2CC_TXTDB and $IP2CC_TXTDB6,
+// and rebuilds in a background thread whenever either changes.
+// Returns 0, or -1 with errno set if the IPv4 one cannot be watched:
+int ip_reload_watch(ip_reload *reload)
+{
+    assert( !reload->watching );
+
+    reload->inotify_fd = inotify_init1(IN_CLOEXEC);
+    reload->stop_fd    = eventfd(0, EFD_CLOEXEC);
+    if( reload->inotify_fd<0 || reload->stop_fd<0 ) {
+        return -1;
+    }
+    watch_path(reload, reload->files+0, getenv(IP2CC_TXTDB_ENVAR));
+    watch_path(reload, reload->files+1, getenv(IP2CC_TXTDB6_ENVAR));
+    if( reload->files[0].wd<0 ) {
+        return -1;
+    }
+    if( 0!=(errno=pthread_create(&reload->tid, NULL, watch_main, reload)) ) {
+        return -1;
+    }
+    reload->watching = true;
+    return 0;
+}
+
+
+// Follows the database published in 'shared', which the current
+// generation must have been built over, instead of the text: a
+// background thread moves to each new generation as it appears, and
+// unmaps each old one once no reader is using it. 'shared' must stay
+// open until ip_reload_free(). Returns 0, or -1 with errno set:
+int ip_reload_follow(ip_reload *reload, ip_cbst_shared *shared)
+{
+    assert( !reload->watching );
+
+    reload->shared  = shared;
+    reload->stop_fd = eventfd(0, EFD_CLOEXEC);
+    if( reload->stop_fd<0 ) {
+        return -1;
+    }
+    if( 0!=(errno=pthread_create(&reload->tid, NULL, follow_main, reload)) ) {
+        return -1;
+    }
+    reload->watching = true;
+    return 0;
+}
+
+
+// Stops watching and frees the current generation. No reader may be
+// in a critical section:
+void ip_reload_free(ip_reload *reload)
+{
+    uint64_t one = 1;
+
+    if( reload==NULL ) {
+        return;
+    }
+    if( reload->watching ) {
+        if( write(reload->stop_fd, &one, sizeof(one)) != sizeof(one) ) {
+            perror("write");
+        }
+        pthread_join(reload->tid, NULL);
+    }
+    if( reload->inotify_fd>=0 ) {
+        close(reload->inotify_fd);
+    }
+    if( reload->stop_fd>=0 ) {
+        close(reload->stop_fd);
+    }
+    ip_db_free(reload->db);
+    free(reload->slots);
+    free(reload);
+}
@@ -0,0 +1,41 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <ip-cbst.h>
+#include <ip6-cbst.h>
+#include <ip-engine.h>
+
+// Changes to the text databases are acted on once the files have been
+// left alone for this long, so that a feed written in several steps
+// causes one rebuild:
+#define IP_RELOAD_QUIET_MS 200
+
+// How often a database published in shared memory is checked for a
+// new generation:
+#define IP_RELOAD_SHM_MS   100
+
+typedef struct ip_db     ip_db;
+typedef struct ip_reload ip_reload;
+
+// One generation of the database, and the engine built over it:
+struct ip_db {
+    const ip_cbst_node  *cbst;
+    size_t               nmemb;
+    const ip6_cbst_node *cbst6;
+    size_t               nmemb6;
+    ip_engine           *engine;
+    bool                 own;       // The CBST is freed with the rest
+    uint64_t             generation; // Numbered from 1, so a cache can tell them apart
+};
+
+ip_db*       ip_db_new(const ip_cbst_node *cbst, size_t nmemb, ip_engine *engine, bool own);
+void         ip_db_free(ip_db *db);
+
+ip_reload*   ip_reload_new(ip_db *db, const char *engine_name, size_t nreaders);
+int          ip_reload_watch(ip_reload *reload);
+int          ip_reload_follow(ip_reload *reload, ip_cbst_shared *shared);
+const ip_db* ip_reload_enter(ip_reload *reload, size_t reader);
+void         ip_reload_leave(ip_reload *reload, size_t reader);
+void         ip_reload_free(ip_reload *reload);
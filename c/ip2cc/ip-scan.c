@@ -0,0 +1,372 @@
+#include <ip-scan.h>
+#include <ip-parse.h>
+#include <assert.h>
+
+#include <stdlib.h>     // For realloc(), free()
+#include <string.h>     // For memset()
+
+#if defined(__AVX2__) || defined(__SSE2__)
+#include <immintrin.h>
+#endif
+
+
+static inline int is_digit(char c) {
+    return (unsigned char)(c-'0') < 10;
+}
+
+static inline int is_hex(char c) {
+    return is_digit(c) || (unsigned char)((c|0x20)-'a') < 6;
+}
+
+static inline int is_alnum(char c) {
+    return is_digit(c) || (unsigned char)((c|0x20)-'a') < 26;
+}
+
+
+#if defined(__AVX2__)
+#define SCAN_WIDTH 32
+// Bit i is set where p[i] is a '.' between two digits:
+static inline unsigned candidates(const char *p) {
+    const __m256i lo  = _mm256_set1_epi8('0'-1);
+    const __m256i hi  = _mm256_set1_epi8('9'+1);
+    const __m256i dot = _mm256_set1_epi8('.');
+    __m256i prev = _mm256_loadu_si256((const __m256i*)(p-1));
+    __m256i cur  = _mm256_loadu_si256((const __m256i*)p);
+    __m256i next = _mm256_loadu_si256((const __m256i*)(p+1));
+    __m256i dp   = _mm256_and_si256(_mm256_cmpgt_epi8(prev, lo), _mm256_cmpgt_epi8(hi, prev));
+    __m256i dn   = _mm256_and_si256(_mm256_cmpgt_epi8(next, lo), _mm256_cmpgt_epi8(hi, next));
+    __m256i m    = _mm256_and_si256(_mm256_cmpeq_epi8(cur, dot), _mm256_and_si256(dp, dn));
+    return (unsigned)_mm256_movemask_epi8(m);
+}
+
+// Bit i is set where p[i] is a ':' followed by a hex digit or a ':':
+static inline unsigned candidates6(const char *p) {
+    const __m256i colon = _mm256_set1_epi8(':');
+    __m256i cur  = _mm256_loadu_si256((const __m256i*)p);
+    __m256i next = _mm256_loadu_si256((const __m256i*)(p+1));
+    __m256i fold = _mm256_or_si256(next, _mm256_set1_epi8(0x20));
+    __m256i dn   = _mm256_and_si256(_mm256_cmpgt_epi8(next, _mm256_set1_epi8('0'-1)),
+                                    _mm256_cmpgt_epi8(_mm256_set1_epi8('9'+1), next));
+    __m256i xn   = _mm256_and_si256(_mm256_cmpgt_epi8(fold, _mm256_set1_epi8('a'-1)),
+                                    _mm256_cmpgt_epi8(_mm256_set1_epi8('f'+1), fold));
+    __m256i cn   = _mm256_cmpeq_epi8(next, colon);
+    __m256i m    = _mm256_and_si256(_mm256_cmpeq_epi8(cur, colon),
+                                    _mm256_or_si256(cn, _mm256_or_si256(dn, xn)));
+    return (unsigned)_mm256_movemask_epi8(m);
+}
+#elif defined(__SSE2__)
+#define SCAN_WIDTH 16
+static inline unsigned candidates(const char *p) {
+    const __m128i lo  = _mm_set1_epi8('0'-1);
+    const __m128i hi  = _mm_set1_epi8('9'+1);
+    const __m128i dot = _mm_set1_epi8('.');
+    __m128i prev = _mm_loadu_si128((const __m128i*)(p-1));
+    __m128i cur  = _mm_loadu_si128((const __m128i*)p);
+    __m128i next = _mm_loadu_si128((const __m128i*)(p+1));
+    __m128i dp   = _mm_and_si128(_mm_cmpgt_epi8(prev, lo), _mm_cmplt_epi8(prev, hi));
+    __m128i dn   = _mm_and_si128(_mm_cmpgt_epi8(next, lo), _mm_cmplt_epi8(next, hi));
+    __m128i m    = _mm_and_si128(_mm_cmpeq_epi8(cur, dot), _mm_and_si128(dp, dn));
+    return (unsigned)_mm_movemask_epi8(m);
+}
+
+static inline unsigned candidates6(const char *p) {
+    const __m128i colon = _mm_set1_epi8(':');
+    __m128i cur  = _mm_loadu_si128((const __m128i*)p);
+    __m128i next = _mm_loadu_si128((const __m128i*)(p+1));
+    __m128i fold = _mm_or_si128(next, _mm_set1_epi8(0x20));
+    __m128i dn   = _mm_and_si128(_mm_cmpgt_epi8(next, _mm_set1_epi8('0'-1)),
+                                 _mm_cmplt_epi8(next, _mm_set1_epi8('9'+1)));
+    __m128i xn   = _mm_and_si128(_mm_cmpgt_epi8(fold, _mm_set1_epi8('a'-1)),
+                                 _mm_cmplt_epi8(fold, _mm_set1_epi8('f'+1)));
+    __m128i cn   = _mm_cmpeq_epi8(next, colon);
+    __m128i m    = _mm_and_si128(_mm_cmpeq_epi8(cur, colon),
+                                 _mm_or_si128(cn, _mm_or_si128(dn, xn)));
+    return (unsigned)_mm_movemask_epi8(m);
+}
+#endif
+
+
+// Next '.' with a digit on either side at or after 'p', or NULL:
+static const char* next_candidate(const ip_scanner *sc, const char *p)
+{
+    if( p==sc->begin ) {
+        p++;
+    }
+#ifdef SCAN_WIDTH
+    while( p+SCAN_WIDTH+1 <= sc->end ) {
+        unsigned m = candidates(p);
+        if( m ) {
+            return p + __builtin_ctz(m);
+        }
+        p += SCAN_WIDTH;
+    }
+#endif
+    for(; p+1 < sc->end; p++) {
+        if( *p=='.' && is_digit(p[-1]) && is_digit(p[1]) ) {
+            return p;
+        }
+    }
+    return NULL;
+}
+
+
+// Next ':' that could be part of an IPv6 address at or after 'p', or
+// NULL:
+static const char* next_candidate6(const ip_scanner *sc, const char *p)
+{
+#ifdef SCAN_WIDTH
+    while( p+SCAN_WIDTH+1 <= sc->end ) {
+        unsigned m = candidates6(p);
+        if( m ) {
+            return p + __builtin_ctz(m);
+        }
+        p += SCAN_WIDTH;
+    }
+#endif
+    for(; p+1 < sc->end; p++) {
+        if( *p==':' && (p[1]==':' || is_hex(p[1])) ) {
+            return p;
+        }
+    }
+    return NULL;
+}
+
+
+void ip_scan_init(ip_scanner *scanner, const char *buf, size_t len)
+{
+    scanner->begin = buf;
+    scanner->pos   = buf;
+    scanner->end   = buf+len;
+}
+
+
+// Returns the start of the next address, with its length and value,
+// or NULL when there are no more. A run of dotted numbers that is not
+// exactly four long, such as a version number, is not an address:
+const char* ip_scan_next(ip_scanner *sc, size_t *len, in_addr_t *ip)
+{
+    const char *dot, *s, *e;
+    size_t      n;
+
+    while( NULL != (dot=next_candidate(sc, sc->pos)) ) {
+        sc->pos = dot+1;
+
+        // Back up over the first field:
+        for(s=dot; s>sc->begin && is_digit(s[-1]) && dot-s<4; s--)
+            ;
+        if( dot-s > 3 ) {
+            continue;
+        }
+        if( s>sc->begin && (is_digit(s[-1]) || (s[-1]=='.' && s-1>sc->begin && is_digit(s[-2]))) ) {
+            continue;
+        }
+
+        n = ip_parse_dq(s, sc->end-s, ip);
+        if( n==0 ) {
+            continue;
+        }
+        e = s+n;
+        if( e<sc->end && (is_digit(*e) || (*e=='.' && e+1<sc->end && is_digit(e[1]))) ) {
+            continue;
+        }
+
+        sc->pos = e;
+        *len    = n;
+        return s;
+    }
+
+    sc->pos = sc->end;
+    return NULL;
+}
+
+
+// The length of an IPv6 address that starts at 's' and is neither
+// preceded nor followed by more of a word or an address, or 0:
+static size_t parse6_at(const ip_scanner *sc, const char *s, ip6_addr *ip)
+{
+    const char *e;
+    size_t      n;
+
+    if( s>sc->begin && (is_alnum(s[-1]) || s[-1]=='.') ) {
+        return 0;
+    }
+    n = ip_parse_ip6(s, sc->end-s, ip);
+    if( n==0 ) {
+        return 0;
+    }
+    e = s+n;
+    if( e<sc->end && (is_alnum(*e) || *e==':' || (*e=='.' && e+1<sc->end && is_digit(e[1]))) ) {
+        return 0;
+    }
+    return n;
+}
+
+// Where to try next in a run that did not parse from 't': just after
+// the next lone ':', which may separate a word from an address, as in
+// "host:2001:db8::1". A "::" is part of an address, never a separator:
+static const char* next_start6(const ip_scanner *sc, const char *t, const char *end)
+{
+    const char *p;
+
+    for(p=t+1; p<end; p++) {
+        if( p[-1]==':' && *p!=':' && (p-1==sc->begin || p[-2]!=':') ) {
+            return p;
+        }
+    }
+    return NULL;
+}
+
+// As ip_scan_next(), for IPv6 addresses. Each run of hex digits and
+// colons is parsed from its start, then, if that fails, from after
+// each lone ':' in it, so times such as "10:15:32" and MAC addresses
+// cost a failed parse per field. Addresses in ::/64 (loopback,
+// IPv4-mapped and the like, or a "::" that just separates words) are
+// in no registry and are not reported; ip_scan_next() finds the dotted
+// quad at the end of any that have one:
+const char* ip_scan_next6(ip_scanner *sc, size_t *len, ip6_addr *ip)
+{
+    const char *colon, *s, *e;
+    size_t      n;
+
+    while( NULL != (colon=next_candidate6(sc, sc->pos)) ) {
+        // Back up to the start of the run, or as far as an address
+        // ending at the colon could go:
+        for(s=colon; s>sc->begin && (is_hex(s[-1]) || s[-1]==':') && colon-s<=IP_PARSE_IP6_MAX; s--)
+            ;
+        // Whatever is found, the rest of the run is done with:
+        for(e=colon; e<sc->end && (is_hex(*e) || *e==':' || *e=='.'); e++)
+            ;
+        sc->pos = e;
+
+        for(; s!=NULL; s=next_start6(sc, s, e)) {
+            n = parse6_at(sc, s, ip);
+            if( n>0 && ip->hi!=0 ) {
+                *len = n;
+                return s;
+            }
+        }
+    }
+
+    sc->pos = sc->end;
+    return NULL;
+}
+
+
+static int hits_grow(ip_hits *hits)
+{
+    size_t cap = hits->cap ? 2*hits->cap : 1024;
+    size_t              *offset = realloc(hits->offset, cap*sizeof(size_t));
+    unsigned char       *len    = realloc(hits->len,    cap*sizeof(unsigned char));
+    in_addr_t           *ip     = realloc(hits->ip,     cap*sizeof(in_addr_t));
+    const ip_cbst_node **node   = realloc(hits->node,   cap*sizeof(ip_cbst_node*));
+
+    // Whichever succeeded now belong to 'hits':
+    hits->offset = offset!=NULL ? offset : hits->offset;
+    hits->len    = len   !=NULL ? len    : hits->len;
+    hits->ip     = ip    !=NULL ? ip     : hits->ip;
+    hits->node   = node  !=NULL ? node   : hits->node;
+    if( offset==NULL || len==NULL || ip==NULL || node==NULL ) {
+        return -1;
+    }
+
+    hits->cap = cap;
+    return 0;
+}
+
+
+// Appends every address in the block to 'hits'; returns how many were
+// found, or -1 with errno set if 'hits' could not grow to hold them
+// all, in which case it holds those that fitted:
+ssize_t ip_scan_block(const char *buf, size_t len, ip_hits *hits)
+{
+    ip_scanner  sc;
+    const char *tok;
+    size_t      toklen, n0 = hits->n;
+    in_addr_t   ip;
+
+    ip_scan_init(&sc, buf, len);
+    while( NULL != (tok=ip_scan_next(&sc, &toklen, &ip)) ) {
+        if( hits->n==hits->cap && hits_grow(hits) ) {
+            return -1;
+        }
+        hits->offset[hits->n] = tok-buf;
+        hits->len[hits->n]    = toklen;
+        hits->ip[hits->n]     = ip;
+        hits->n++;
+    }
+    return hits->n - n0;
+}
+
+
+void ip_hits_clear(ip_hits *hits)
+{
+    hits->n = 0;
+}
+
+
+void ip_hits_free(ip_hits *hits)
+{
+    free(hits->offset);
+    free(hits->len);
+    free(hits->ip);
+    free(hits->node);
+    memset(hits, 0, sizeof(ip_hits));
+}
+
+
+static int hits6_grow(ip6_hits *hits)
+{
+    size_t cap = hits->cap ? 2*hits->cap : 1024;
+    size_t               *offset = realloc(hits->offset, cap*sizeof(size_t));
+    unsigned char        *len    = realloc(hits->len,    cap*sizeof(unsigned char));
+    ip6_addr             *ip     = realloc(hits->ip,     cap*sizeof(ip6_addr));
+    const ip6_cbst_node **node   = realloc(hits->node,   cap*sizeof(ip6_cbst_node*));
+
+    hits->offset = offset!=NULL ? offset : hits->offset;
+    hits->len    = len   !=NULL ? len    : hits->len;
+    hits->ip     = ip    !=NULL ? ip     : hits->ip;
+    hits->node   = node  !=NULL ? node   : hits->node;
+    if( offset==NULL || len==NULL || ip==NULL || node==NULL ) {
+        return -1;
+    }
+
+    hits->cap = cap;
+    return 0;
+}
+
+
+ssize_t ip_scan_block6(const char *buf, size_t len, ip6_hits *hits)
+{
+    ip_scanner  sc;
+    const char *tok;
+    size_t      toklen, n0 = hits->n;
+    ip6_addr    ip;
+
+    ip_scan_init(&sc, buf, len);
+    while( NULL != (tok=ip_scan_next6(&sc, &toklen, &ip)) ) {
+        if( hits->n==hits->cap && hits6_grow(hits) ) {
+            return -1;
+        }
+        hits->offset[hits->n] = tok-buf;
+        hits->len[hits->n]    = toklen;
+        hits->ip[hits->n]     = ip;
+        hits->n++;
+    }
+    return hits->n - n0;
+}
+
+
+void ip6_hits_clear(ip6_hits *hits)
+{
+    hits->n = 0;
+}
+
+
+void ip6_hits_free(ip6_hits *hits)
+{
+    free(hits->offset);
+    free(hits->len);
+    free(hits->ip);
+    free(hits->node);
+    memset(hits, 0, sizeof(ip6_hits));
+}
@@ -0,0 +1,54 @@
+#pragma once
+
+#include <stddef.h>
+#include <sys/types.h>  // For ssize_t
+#include <arpa/inet.h>
+#include <ip-cbst.h>
+#include <ip6-cbst.h>
+
+typedef struct ip_scanner ip_scanner;
+typedef struct ip_hits    ip_hits;
+typedef struct ip6_hits   ip6_hits;
+
+// Finds IPv4 dotted quads in arbitrary text, such as log files. Only
+// a '.' with a digit on either side can be part of one, so blocks of
+// the buffer are classified with SIMD compares and only those
+// positions are examined further:
+struct ip_scanner {
+    const char *begin;
+    const char *pos;
+    const char *end;
+};
+
+// The addresses found in a block of text, in order, with room for the
+// results of looking them up:
+struct ip_hits {
+    size_t               n;
+    size_t               cap;
+    size_t              *offset;    // Start of each address in the block
+    unsigned char       *len;       // Length of each address
+    in_addr_t           *ip;
+    const ip_cbst_node **node;      // For the caller's lookups
+};
+
+// The same for IPv6 addresses:
+struct ip6_hits {
+    size_t                n;
+    size_t                cap;
+    size_t               *offset;
+    unsigned char        *len;
+    ip6_addr             *ip;
+    const ip6_cbst_node **node;
+};
+
+void        ip_scan_init(ip_scanner *scanner, const char *buf, size_t len);
+const char* ip_scan_next(ip_scanner *scanner, size_t *len, in_addr_t *ip);
+
+ssize_t     ip_scan_block(const char *buf, size_t len, ip_hits *hits);
+void        ip_hits_clear(ip_hits *hits);
+void        ip_hits_free(ip_hits *hits);
+
+const char* ip_scan_next6(ip_scanner *scanner, size_t *len, ip6_addr *ip);
+ssize_t     ip_scan_block6(const char *buf, size_t len, ip6_hits *hits);
+void        ip6_hits_clear(ip6_hits *hits);
+void        ip6_hits_free(ip6_hits *hits);
@@ -0,0 +1,614 @@
+#define _GNU_SOURCE 1           // For accept4(), be64toh()
+
+#include <ip-serve.h>
+#include <assert.h>
+
+#include <stdio.h>      // For perror()
+#include <stdlib.h>     // For malloc(), realloc(), free()
+#include <string.h>     // For memcpy(), memchr(), memmove()
+#include <stdbool.h>
+#include <errno.h>
+#include <endian.h>     // For be64toh(), htobe64()
+#include <signal.h>
+#include <pthread.h>
+#include <unistd.h>     // For close(), unlink()
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+
+// Events taken from epoll at a time, and the least free space in a
+// connection's input buffer before each read:
+#define IP_SERVE_EVENTS 64
+#define IP_SERVE_READ   4096
+
+
+// A client. Requests are read into the block's input, and answers
+// appended to its output; whatever is left of either stays for the
+// next turn of the loop:
+typedef struct conn conn;
+
+struct conn {
+    int       fd;
+    ip_block  b;
+    size_t    sent;         // Bytes of the output already written
+    bool      writing;      // Waiting for the client to read, not write
+    bool      eof;          // The client will send no more
+    conn     *prev;
+    conn     *next;
+};
+
+// Each worker runs its own epoll loop over the listening socket, which
+// hands each new client to one of them, and the clients it accepted:
+typedef struct {
+    const ip_serve_conf  *conf;
+    size_t                id;
+    int                   listen_fd;
+    int                   stop_fd;
+    int                   epoll_fd;
+    conn                 *conns;
+    ip_block              scratch;  // For the 'lines' callback
+    in_addr_t            *ips;      // For batches
+    const ip_cbst_node  **nodes;
+    ip6_addr             *ips6;
+    const ip6_cbst_node **nodes6;
+    ip_stats             *stats;    // This worker's, or NULL
+    ip_cache             *cache;    // This worker's, or NULL
+    pthread_t             tid;
+} worker;
+
+// Tags for the two descriptors that are not clients:
+static char listening, stopping;
+
+
+static void conn_close(worker *w, conn *c)
+{
+    epoll_ctl(w->epoll_fd, EPOLL_CTL_DEL, c->fd, NULL);
+    close(c->fd);
+    if( c->prev!=NULL ) {
+        c->prev->next = c->next;
+    } else {
+        w->conns = c->next;
+    }
+    if( c->next!=NULL ) {
+        c->next->prev = c->prev;
+    }
+    ip_block_free(&c->b);
+    free(c);
+}
+
+
+static void accept_all(worker *w)
+{
+    struct epoll_event ev;
+    conn *c;
+    int   fd;
+
+    while( 0 <= (fd=accept4(w->listen_fd, NULL, NULL, SOCK_NONBLOCK|SOCK_CLOEXEC)) ) {
+        c = calloc(1, sizeof(conn));
+        if( c==NULL ) {
+            close(fd);
+            continue;
+        }
+        c->fd = fd;
+        ev.events   = EPOLLIN;
+        ev.data.ptr = c;
+        if( 0!=epoll_ctl(w->epoll_fd, EPOLL_CTL_ADD, fd, &ev) ) {
+            close(fd);
+            free(c);
+            continue;
+        }
+        c->next = w->conns;
+        if( c->next!=NULL ) {
+            c->next->prev = c;
+        }
+        w->conns = c;
+    }
+}
+
+
+static void put32(uint8_t *p, uint32_t v)
+{
+    v = htonl(v);
+    memcpy(p, &v, 4);
+}
+
+static void put64(uint8_t *p, uint64_t v)
+{
+    v = htobe64(v);
+    memcpy(p, &v, 8);
+}
+
+static uint64_t get64(const uint8_t *p)
+{
+    uint64_t v;
+    memcpy(&v, p, 8);
+    return be64toh(v);
+}
+
+
+// The IPv4 addresses of a batch, through the worker's cache if it has
+// one:
+static void lookup_batch4(worker *w, const ip_db *db, size_t n)
+{
+    if( w->cache!=NULL ) {
+        ip_cache_lookup_batch(w->cache, db->engine, db->generation, w->ips, w->nodes, n);
+    } else {
+        ip_engine_lookup_batch(db->engine, w->ips, w->nodes, n);
+    }
+}
+
+
+static void answer_batch4(worker *w, const ip_db *db, conn *c, const uint8_t *in, size_t n)
+{
+    ip_serve_rec rec;
+    uint32_t     a;
+    size_t       i;
+
+    for(i=0; i<n; i++) {
+        memcpy(&a, in+4*i, 4);
+        w->ips[i] = ntohl(a);
+    }
+    if( w->stats!=NULL ) {
+        ip_stats_begin(w->stats);
+    }
+    lookup_batch4(w, db, n);
+    if( w->stats!=NULL ) {
+        ip_stats_end(w->stats, n);
+    }
+
+    for(i=0; i<n; i++) {
+        memset(&rec, 0, sizeof(rec));
+        memcpy(rec.cc, "--", 2);
+        if( w->nodes[i]!=NULL ) {
+            put32(rec.addr_lo, w->nodes[i]->addr_lo);
+            put32(rec.addr_hi, w->nodes[i]->addr_hi);
+            memcpy(rec.cc, w->nodes[i]->cc, 2);
+            rec.flag = IP_SERVE_FOUND;
+        }
+        ip_block_append(&c->b, (const char*)&rec, sizeof(rec));
+    }
+}
+
+
+// The v4-mapped addresses of a batch are looked up as IPv4 ones, and
+// only they go through the cache; the rest go straight to the IPv6
+// tree. Each kind is gathered at the front of its own array, in order,
+// and the answers are taken from the two in turn as the input says:
+static void answer_batch6(worker *w, const ip_db *db, conn *c, const uint8_t *in, size_t n)
+{
+    ip_serve_rec6 rec;
+    ip6_addr      ip6;
+    size_t        i, n4 = 0, n6 = 0;
+
+    for(i=0; i<n; i++) {
+        ip6.hi = get64(in+16*i);
+        ip6.lo = get64(in+16*i+8);
+        if( ip6_addr_is_v4mapped(ip6) ) {
+            w->ips[n4++] = (in_addr_t)ip6.lo;
+        } else {
+            w->ips6[n6++] = ip6;
+        }
+    }
+    if( w->stats!=NULL ) {
+        ip_stats_begin(w->stats);
+    }
+    lookup_batch4(w, db, n4);
+    ip6_cbst_lookup_batch(db->cbst6, db->nmemb6, w->ips6, w->nodes6, n6);
+    if( w->stats!=NULL ) {
+        ip_stats_end(w->stats, n);
+    }
+
+    for(i=0, n4=0, n6=0; i<n; i++) {
+        const ip_cbst_node  *node  = NULL;
+        const ip6_cbst_node *node6 = NULL;
+
+        ip6.hi = get64(in+16*i);
+        ip6.lo = get64(in+16*i+8);
+        if( ip6_addr_is_v4mapped(ip6) ) {
+            node = w->nodes[n4++];
+        } else {
+            node6 = w->nodes6[n6++];
+        }
+
+        memset(&rec, 0, sizeof(rec));
+        memcpy(rec.cc, "--", 2);
+        if( node!=NULL ) {
+            put64(rec.addr_lo+8, 0xffff00000000ULL | node->addr_lo);
+            put64(rec.addr_hi+8, 0xffff00000000ULL | node->addr_hi);
+            memcpy(rec.cc, node->cc, 2);
+            rec.flag = IP_SERVE_FOUND;
+        } else if( node6!=NULL ) {
+            put64(rec.addr_lo,   node6->addr_lo.hi);
+            put64(rec.addr_lo+8, node6->addr_lo.lo);
+            put64(rec.addr_hi,   node6->addr_hi.hi);
+            put64(rec.addr_hi+8, node6->addr_hi.lo);
+            memcpy(rec.cc, node6->cc, 2);
+            rec.flag = IP_SERVE_FOUND;
+        }
+        ip_block_append(&c->b, (const char*)&rec, sizeof(rec));
+    }
+}
+
+
+// Answer the run of whole lines at the start of 's'; returns its
+// length, 0 if there is no whole line yet, or -1 if the line is too
+// long to be one or there is no memory for the answers:
+static ssize_t answer_lines(worker *w, const ip_db *db, conn *c, const char *s, size_t len)
+{
+    ip_block   *b = &w->scratch;
+    const char *nl;
+    char       *in;
+    size_t      n = 0, nlines = 0;
+
+    while( n<len && s[n]!=IP_SERVE_BATCH && NULL!=(nl=memchr(s+n, '\n', len-n)) ) {
+        n = nl-s+1;
+        nlines++;
+    }
+    if( n==0 ) {
+        return len>IP_SERVE_LINE_MAX ? -1 : 0;
+    }
+
+    if( b->cap < n ) {
+        in = realloc(b->in, n);
+        if( in==NULL ) {
+            return -1;
+        }
+        b->in  = in;
+        b->cap = n;
+    }
+    memcpy(b->in, s, n);
+    b->len    = n;
+    b->outlen = 0;
+    if( w->stats!=NULL ) {
+        ip_stats_begin(w->stats);
+    }
+    w->conf->lines(b, db);
+    if( w->stats!=NULL ) {
+        ip_stats_end(w->stats, nlines);
+    }
+    if( 0!=ip_block_reserve(&c->b, b->outlen) ) {
+        return -1;
+    }
+    ip_block_append(&c->b, b->out, b->outlen);
+
+    return n;
+}
+
+
+// Answer every whole request in the client's input, and keep the rest;
+// -1 if the client broke the protocol, or there is no memory for the
+// answers:
+static int answer(worker *w, const ip_db *db, conn *c)
+{
+    const uint8_t *in = (const uint8_t*)c->b.in;
+    ip_serve_hdr   hdr;
+    size_t         p = 0, need, size, rec;
+    ssize_t        m;
+
+    while( p < c->b.len ) {
+        if( in[p]!=IP_SERVE_BATCH ) {
+            m = answer_lines(w, db, c, c->b.in+p, c->b.len-p);
+            if( m<0 ) {
+                return -1;
+            }
+            if( m==0 ) {
+                break;
+            }
+            p += m;
+            continue;
+        }
+
+        if( c->b.len-p < IP_SERVE_HDR_SIZE ) {
+            break;
+        }
+        memcpy(&hdr, in+p, IP_SERVE_HDR_SIZE);
+        hdr.count = ntohl(hdr.count);
+        if( (hdr.family!=4 && hdr.family!=6) || hdr.count>IP_SERVE_BATCH_MAX ) {
+            return -1;
+        }
+        size = hdr.family==4 ? 4 : 16;
+        need = IP_SERVE_HDR_SIZE + hdr.count*size;
+        if( c->b.len-p < need ) {
+            break;
+        }
+        rec = hdr.family==4 ? sizeof(ip_serve_rec) : sizeof(ip_serve_rec6);
+        if( 0!=ip_block_reserve(&c->b, IP_SERVE_HDR_SIZE + hdr.count*rec) ) {
+            return -1;
+        }
+
+        ip_block_append(&c->b, (const char*)in+p, IP_SERVE_HDR_SIZE);
+        if( hdr.family==4 ) {
+            answer_batch4(w, db, c, in+p+IP_SERVE_HDR_SIZE, hdr.count);
+        } else {
+            answer_batch6(w, db, c, in+p+IP_SERVE_HDR_SIZE, hdr.count);
+        }
+        p += need;
+    }
+
+    c->b.len -= p;
+    memmove(c->b.in, c->b.in+p, c->b.len);
+    return 0;
+}
+
+
+// Write what can be written without blocking. Until all of it is, the
+// client is only watched for room to write, so that one that does not
+// read its answers stops being read from; false once it is closed:
+static bool flush(worker *w, conn *c)
+{
+    struct epoll_event ev;
+    ssize_t n;
+
+    while( c->sent < c->b.outlen ) {
+        n = send(c->fd, c->b.out+c->sent, c->b.outlen-c->sent, MSG_NOSIGNAL);
+        if( n<0 ) {
+            if( errno==EAGAIN || errno==EWOULDBLOCK ) {
+                break;
+            }
+            conn_close(w, c);
+            return false;
+        }
+        c->sent += n;
+    }
+
+    if( c->sent == c->b.outlen ) {
+        c->sent     = 0;
+        c->b.outlen = 0;
+        if( c->eof ) {
+            conn_close(w, c);
+            return false;
+        }
+    }
+    if( c->writing != (c->b.outlen>0) ) {
+        c->writing  = c->b.outlen>0;
+        ev.events   = c->writing ? EPOLLOUT : EPOLLIN;
+        ev.data.ptr = c;
+        epoll_ctl(w->epoll_fd, EPOLL_CTL_MOD, c->fd, &ev);
+    }
+    return true;
+}
+
+
+// A client is dropped if there is no room for what it sends:
+static void conn_read(worker *w, conn *c)
+{
+    ssize_t n;
+    size_t  cap;
+    char   *in;
+    int     ret;
+
+    if( c->b.cap - c->b.len < IP_SERVE_READ ) {
+        cap = c->b.cap ? 2*c->b.cap : 4*IP_SERVE_READ;
+        in  = realloc(c->b.in, cap);
+        if( in==NULL ) {
+            conn_close(w, c);
+            return;
+        }
+        c->b.in  = in;
+        c->b.cap = cap;
+    }
+    n = read(c->fd, c->b.in+c->b.len, c->b.cap-c->b.len);
+    if( n<0 ) {
+        if( errno!=EAGAIN && errno!=EWOULDBLOCK && errno!=EINTR ) {
+            conn_close(w, c);
+        }
+        return;
+    }
+    c->b.len += n;
+    if( n==0 ) {
+        // A last line need not end in a newline:
+        c->eof = true;
+        if( c->b.len>0 && c->b.in[0]!=IP_SERVE_BATCH && c->b.in[c->b.len-1]!='\n' ) {
+            c->b.in[c->b.len++] = '\n';
+        }
+    }
+
+    ret = answer(w, ip_reload_enter(w->conf->reload, w->id), c);
+    ip_reload_leave(w->conf->reload, w->id);
+    if( 0!=ret ) {
+        conn_close(w, c);
+        return;
+    }
+    flush(w, c);
+}
+
+
+static void* worker_main(void *arg)
+{
+    worker *w = arg;
+    struct epoll_event ev[IP_SERVE_EVENTS];
+    int    i, n;
+
+    for(;;) {
+        n = epoll_wait(w->epoll_fd, ev, IP_SERVE_EVENTS, -1);
+        if( n<0 ) {
+            if( errno==EINTR ) {
+                continue;
+            }
+            perror("epoll_wait");
+            break;
+        }
+        for(i=0; i<n; i++) {
+            if( ev[i].data.ptr == &stopping ) {
+                return NULL;
+            }
+            if( ev[i].data.ptr == &listening ) {
+                accept_all(w);
+            } else if( ev[i].events & EPOLLOUT ) {
+                flush(w, ev[i].data.ptr);
+            } else if( ev[i].events & (EPOLLIN|EPOLLHUP|EPOLLERR) ) {
+                conn_read(w, ev[i].data.ptr);
+            }
+        }
+    }
+    return NULL;
+}
+
+
+static int worker_init(worker *w, const ip_serve_conf *conf, size_t id, int listen_fd, int stop_fd)
+{
+    struct epoll_event ev;
+
+    memset(w, 0, sizeof(worker));
+    w->conf      = conf;
+    w->id        = id;
+    w->listen_fd = listen_fd;
+    w->stop_fd   = stop_fd;
+    w->ips       = malloc(IP_SERVE_BATCH_MAX*sizeof(in_addr_t));
+    w->nodes     = malloc(IP_SERVE_BATCH_MAX*sizeof(ip_cbst_node*));
+    w->ips6      = malloc(IP_SERVE_BATCH_MAX*sizeof(ip6_addr));
+    w->nodes6    = malloc(IP_SERVE_BATCH_MAX*sizeof(ip6_cbst_node*));
+    w->stats     = conf->stats!=NULL ? conf->stats+id : NULL;
+    w->cache     = conf->caches!=NULL ? conf->caches+id : NULL;
+    if( w->ips==NULL || w->nodes==NULL || w->ips6==NULL || w->nodes6==NULL ) {
+        return -1;
+    }
+
+    w->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    if( w->epoll_fd<0 ) {
+        return -1;
+    }
+    // Only one worker is woken for each new client, but all of them to
+    // stop:
+    ev.events   = EPOLLIN | EPOLLEXCLUSIVE;
+    ev.data.ptr = &listening;
+    if( 0!=epoll_ctl(w->epoll_fd, EPOLL_CTL_ADD, listen_fd, &ev) ) {
+        return -1;
+    }
+    ev.events   = EPOLLIN;
+    ev.data.ptr = &stopping;
+    return epoll_ctl(w->epoll_fd, EPOLL_CTL_ADD, stop_fd, &ev);
+}
+
+
+static void worker_free(worker *w)
+{
+    while( w->conns!=NULL ) {
+        conn_close(w, w->conns);
+    }
+    if( w->epoll_fd>0 ) {
+        close(w->epoll_fd);
+    }
+    ip_block_free(&w->scratch);
+    free(w->nodes6);
+    free(w->ips6);
+    free(w->nodes);
+    free(w->ips);
+}
+
+
+// Binds to 'path', replacing a socket left behind by a server that is
+// gone, but not one that a live server answers on: that fails with
+// EADDRINUSE:
+static int listen_on(const char *path)
+{
+    struct sockaddr_un addr;
+    struct stat st;
+    bool live, stale;
+    int  fd;
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if( strlen(path) >= sizeof(addr.sun_path) ) {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+    strcpy(addr.sun_path, path);
+
+    // A server that is gone leaves its socket behind, and nothing
+    // accepts on it; a live one's connection queue may be full:
+    if( 0==lstat(path, &st) && S_ISSOCK(st.st_mode) ) {
+        fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+        if( fd<0 ) {
+            return -1;
+        }
+        live  = 0==connect(fd, (struct sockaddr*)&addr, sizeof(addr)) || errno==EAGAIN;
+        stale = !live && errno==ECONNREFUSED;
+        close(fd);
+        if( live ) {
+            errno = EADDRINUSE;
+            return -1;
+        }
+        if( stale ) {
+            unlink(path);
+        }
+    }
+
+    fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if( fd<0 ) {
+        return -1;
+    }
+    if( 0!=bind(fd, (struct sockaddr*)&addr, sizeof(addr)) || 0!=listen(fd, SOMAXCONN) ) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+
+// Answer lookups on the socket at conf->path until SIGINT or SIGTERM,
+// with conf->nworkers threads. Returns 0 then, or -1 if the server
+// could not be started:
+int ip_serve_run(const ip_serve_conf *conf)
+{
+    worker  *workers = NULL;
+    sigset_t sigs, old;
+    size_t   i, started = 0;
+    int      listen_fd, stop_fd = -1, sig, ret = -1;
+    uint64_t one = 1;
+
+    assert( conf->nworkers>0 );
+
+    listen_fd = listen_on(conf->path);
+    if( listen_fd<0 ) {
+        perror(conf->path);
+        return -1;
+    }
+    stop_fd = eventfd(0, EFD_CLOEXEC);
+    workers = calloc(conf->nworkers, sizeof(worker));
+    if( stop_fd<0 || workers==NULL ) {
+        perror("ip_serve_run");
+        goto out;
+    }
+
+    // The workers inherit the mask, so only this thread takes the
+    // signals, and tells them to stop:
+    sigemptyset(&sigs);
+    sigaddset(&sigs, SIGINT);
+    sigaddset(&sigs, SIGTERM);
+    pthread_sigmask(SIG_BLOCK, &sigs, &old);
+
+    for(i=0; i<conf->nworkers; i++) {
+        if( 0!=worker_init(workers+i, conf, i, listen_fd, stop_fd)
+            || 0!=pthread_create(&workers[i].tid, NULL, worker_main, workers+i) ) {
+            perror("ip_serve_run");
+            worker_free(workers+i);
+            break;
+        }
+        started++;
+    }
+    if( started==conf->nworkers ) {
+        sigwait(&sigs, &sig);
+        ret = 0;
+    }
+
+    if( write(stop_fd, &one, sizeof(one)) != sizeof(one) ) {
+        perror("write");
+    }
+    for(i=0; i<started; i++) {
+        pthread_join(workers[i].tid, NULL);
+        worker_free(workers+i);
+    }
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+
+out:
+    free(workers);
+    if( stop_fd>=0 ) {
+        close(stop_fd);
+    }
+    close(listen_fd);
+    unlink(conf->path);
+    return ret;
+}
@@ -0,0 +1,83 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <ip-cbst.h>
+#include <ip6-cbst.h>
+#include <ip-engine.h>
+#include <ip-pipeline.h>
+#include <ip-reload.h>
+#include <ip-stats.h>
+#include <ip-cache.h>
+
+// A connection may mix two kinds of request. A line of text is one
+// address, answered with one line of text. A batch starts with a zero
+// byte, which no line does: an IP_SERVE_HDR_SIZE header (the zero, the
+// address family, 4 or 6, two zero bytes, and the number of addresses
+// as a big-endian 32-bit count), then that many addresses, 4 or 16
+// bytes each in network order. The answer is the same header followed
+// by one fixed-size record per address, in order:
+#define IP_SERVE_HDR_SIZE 8
+#define IP_SERVE_BATCH    0
+
+// Largest batch accepted, and longest line; a client that sends more
+// is disconnected:
+#define IP_SERVE_BATCH_MAX (1<<16)
+#define IP_SERVE_LINE_MAX  1024
+
+// Set in a record's 'flag' when the address is in a range:
+#define IP_SERVE_FOUND 1
+
+typedef struct ip_serve_hdr  ip_serve_hdr;
+typedef struct ip_serve_rec  ip_serve_rec;
+typedef struct ip_serve_rec6 ip_serve_rec6;
+typedef struct ip_serve_conf ip_serve_conf;
+
+struct ip_serve_hdr {
+    uint8_t   kind;         // IP_SERVE_BATCH
+    uint8_t   family;       // 4 or 6
+    uint8_t   reserved[2];
+    uint32_t  count;        // Big-endian
+};
+
+// The range an address is in, with addresses in network order; the
+// range is zero and the code "--" if there is none. IPv4-mapped
+// addresses in an IPv6 batch are answered from the IPv4 ranges, as
+// IPv4-mapped ranges:
+struct ip_serve_rec {
+    uint8_t   addr_lo[4];
+    uint8_t   addr_hi[4];
+    char      cc[2];
+    uint8_t   flag;
+    uint8_t   reserved;
+};
+
+struct ip_serve_rec6 {
+    uint8_t   addr_lo[16];
+    uint8_t   addr_hi[16];
+    char      cc[2];
+    uint8_t   flag;
+    uint8_t   reserved;
+};
+
+// Turns a block of whole request lines into their answers, from 'db':
+typedef void (*ip_serve_fn)(ip_block *block, const ip_db *db);
+
+// What the server answers with. Each worker is a reader of 'reload',
+// numbered as it is, and holds one generation of the database while it
+// answers what one read brought in; 'reload' must have a reader for
+// each worker. Batches are answered from the generation directly. If
+// there are 'stats', one per worker, each batch's lookups are counted,
+// and each run of lines is counted whole, parsing and formatting too.
+// If there are 'caches', one per worker, batches of IPv4 addresses are
+// looked up through them; each is emptied when the generation changes:
+struct ip_serve_conf {
+    const char          *path;      // The socket
+    size_t               nworkers;
+    ip_reload           *reload;
+    ip_serve_fn          lines;
+    ip_stats            *stats;
+    ip_cache            *caches;
+};
+
+int ip_serve_run(const ip_serve_conf *conf);
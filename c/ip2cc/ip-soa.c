@@ -0,0 +1,121 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include <ip-soa.h>
+#include <assert.h>
+
+#include <stdlib.h>     // For posix_memalign(), free()
+#include <sys/param.h>  // For MIN()
+
+
+ip_soa* ip_soa_new(const ip_cbst_node *cbst, size_t nmemb)
+{
+    ip_soa *soa = NULL;
+    size_t  i;
+
+    assert( cbst!=NULL || nmemb==0 );
+
+    soa = malloc(sizeof(ip_soa));
+    if( soa==NULL ) {
+        return NULL;
+    }
+    if( 0!=posix_memalign((void**)&soa->keys, 64, (nmemb+1)*sizeof(uint32_t)) ) {
+        free(soa);
+        return NULL;
+    }
+    soa->cbst  = cbst;
+    soa->nmemb = nmemb;
+
+    soa->keys[0] = 0;
+    for(i=0; i<nmemb; i++) {
+        soa->keys[i+1] = cbst[i].addr_lo;
+    }
+
+    return soa;
+}
+
+
+void ip_soa_free(ip_soa *soa)
+{
+    if( soa!=NULL ) {
+        free(soa->keys);
+        free(soa);
+    }
+}
+
+
+// Resolve the final (one-based) index of a descent:
+static inline const ip_cbst_node* match(const ip_soa *soa, size_t k, in_addr_t ip)
+{
+    const ip_cbst_node *node;
+
+    k >>= __builtin_ctzl(k)+1;
+    if( k==0 ) {
+        return NULL;
+    }
+    node = soa->cbst+k-1;
+    return ip <= node->addr_hi ? node : NULL;
+}
+
+
+// As ip_cbst_lookup_ip(), but on the key array, prefetching the cache
+// line that holds the node's descendants four levels down:
+const ip_cbst_node* ip_soa_lookup_ip(const ip_soa *soa, in_addr_t ip)
+{
+    const uint32_t *keys;
+    size_t k = 1;
+
+    if( soa==NULL ) {
+        return NULL;
+    }
+
+    keys = soa->keys;
+    while( k <= soa->nmemb ) {
+        __builtin_prefetch(keys+(k<<4));
+        k = (k<<1) + (keys[k] <= ip);
+    }
+
+    return match(soa, k, ip);
+}
+
+
+// As ip_cbst_lookup_batch():
+void ip_soa_lookup_batch(const ip_soa *soa, const in_addr_t *ips,
+                         const ip_cbst_node **out, size_t n)
+{
+    const uint32_t *keys;
+    size_t k[IP_CBST_BATCH];
+    size_t i, j, m, d, h;
+
+    assert( n==0 || ips!=NULL );
+    assert( n==0 || out!=NULL );
+
+    if( soa==NULL || soa->nmemb==0 ) {
+        for(i=0; i<n; i++) {
+            out[i] = NULL;
+        }
+        return;
+    }
+
+    keys = soa->keys;
+    h = 8*sizeof(size_t)-__builtin_clzl(soa->nmemb);
+
+    for(i=0; i<n; i+=m) {
+        m = MIN(n-i, IP_CBST_BATCH);
+
+        for(j=0; j<m; j++) {
+            k[j] = 1;
+        }
+        for(d=1; d<h; d++) {
+            for(j=0; j<m; j++) {
+                __builtin_prefetch(keys+(k[j]<<2));
+                k[j] = (k[j]<<1) + (keys[k[j]] <= ips[i+j]);
+            }
+        }
+        for(j=0; j<m; j++) {
+            if( k[j] <= soa->nmemb ) {
+                k[j] = (k[j]<<1) + (keys[k[j]] <= ips[i+j]);
+            }
+            out[i+j] = match(soa, k[j], ips[i+j]);
+        }
+    }
+}
@@ -0,0 +1,25 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <ip-cbst.h>
+
+typedef struct ip_soa ip_soa;
+
+// Hot/cold split of a CBST. The search keys ('addr_lo') are copied, in
+// CBST order, into a dense, cache-line-aligned array, and only that is
+// touched during the descent; the CBST records themselves are the
+// parallel cold array, read once after the match. Keys are stored from
+// index one, so the 16 descendants four levels below any node share a
+// single cache line:
+struct ip_soa {
+    uint32_t           *keys;   // keys[k] is 'addr_lo' of cbst[k-1]
+    const ip_cbst_node *cbst;   // Not owned
+    size_t              nmemb;
+};
+
+ip_soa*             ip_soa_new(const ip_cbst_node *cbst, size_t nmemb);
+void                ip_soa_free(ip_soa *soa);
+const ip_cbst_node* ip_soa_lookup_ip(const ip_soa *soa, in_addr_t ip);
+void                ip_soa_lookup_batch(const ip_soa *soa, const in_addr_t *ips,
+                                        const ip_cbst_node **out, size_t n);
@@ -0,0 +1,208 @@
+#define _GNU_SOURCE 1
+
+#include <ip-stats.h>
+
+#include <stdlib.h>     // For posix_memalign(), free()
+#include <string.h>     // For memset(), strerror()
+#include <errno.h>
+#include <unistd.h>     // For syscall(), read(), close()
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+
+// Cache events are a cache, an operation and a result, packed:
+#define CACHE_READ_MISS(cache) \
+    ((cache) | (PERF_COUNT_HW_CACHE_OP_READ<<8) | (PERF_COUNT_HW_CACHE_RESULT_MISS<<16))
+
+static const struct {
+    const char *name;
+    uint32_t    type;
+    uint64_t    config;
+} events[IP_STATS_NEVENTS] = {
+    { "cycles",        PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES          },
+    { "instructions",  PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS        },
+    { "L1D misses",    PERF_TYPE_HW_CACHE, CACHE_READ_MISS(PERF_COUNT_HW_CACHE_L1D)  },
+    { "LLC misses",    PERF_TYPE_HW_CACHE, CACHE_READ_MISS(PERF_COUNT_HW_CACHE_LL)   },
+    { "dTLB misses",   PERF_TYPE_HW_CACHE, CACHE_READ_MISS(PERF_COUNT_HW_CACHE_DTLB) },
+    { "branch misses", PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES       },
+};
+
+// What one read() of the group returns:
+typedef struct {
+    uint64_t  nr;
+    uint64_t  time_enabled;
+    uint64_t  time_running;
+    uint64_t  value[IP_STATS_NEVENTS];
+} group_read;
+
+
+// 'n' zeroed per-thread counters, none of them open yet:
+ip_stats* ip_stats_new(size_t n)
+{
+    ip_stats *st;
+
+    if( 0!=posix_memalign((void**)&st, 64, n*sizeof(ip_stats)) ) {
+        return NULL;
+    }
+    memset(st, 0, n*sizeof(ip_stats));
+    return st;
+}
+
+
+static int open_event(int i, int group)
+{
+    struct perf_event_attr attr;
+
+    memset(&attr, 0, sizeof(attr));
+    attr.size           = sizeof(attr);
+    attr.type           = events[i].type;
+    attr.config         = events[i].config;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv     = 1;
+    attr.read_format    = PERF_FORMAT_GROUP
+                          | PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+    return syscall(SYS_perf_event_open, &attr, 0, -1, group, PERF_FLAG_FD_CLOEXEC);
+}
+
+
+// One group for the calling thread, so that a batch costs one read()
+// at each end. Events this CPU does not have are left out; the group
+// needs only the cycles:
+static void open_group(ip_stats *st)
+{
+    int i, fd;
+
+    st->tried = true;
+    for(i=0; i<IP_STATS_NEVENTS; i++) {
+        fd = open_event(i, i==0 ? -1 : st->fd[0]);
+        if( fd<0 && i==0 ) {
+            st->error = errno;
+            return;
+        }
+        if( fd>=0 ) {
+            st->fd[st->nopen]    = fd;
+            st->event[st->nopen] = i;
+            st->nopen++;
+        }
+    }
+}
+
+
+static bool read_group(const ip_stats *st, group_read *r)
+{
+    ssize_t want = (3+st->nopen)*sizeof(uint64_t);
+
+    return want==read(st->fd[0], r, sizeof(*r)) && r->nr==(uint64_t)st->nopen;
+}
+
+
+void ip_stats_begin(ip_stats *st)
+{
+    group_read r;
+    int        i;
+
+    if( !st->tried ) {
+        open_group(st);
+    }
+    if( st->nopen==0 || !read_group(st, &r) ) {
+        return;
+    }
+    for(i=0; i<st->nopen; i++) {
+        st->start[i] = r.value[i];
+    }
+    st->start_enabled = r.time_enabled;
+    st->start_running = r.time_running;
+}
+
+
+// Adds what the counters moved by since ip_stats_begin(), scaled up
+// for any time the group was not on the PMU. A batch that it was off
+// for throughout counts towards the lookups but none of the events:
+void ip_stats_end(ip_stats *st, size_t lookups)
+{
+    group_read r;
+    uint64_t   enabled, running;
+    int        i;
+
+    st->lookups += lookups;
+    st->batches++;
+    if( st->nopen==0 || !read_group(st, &r) ) {
+        return;
+    }
+    enabled = r.time_enabled - st->start_enabled;
+    running = r.time_running - st->start_running;
+    if( running==0 ) {
+        return;
+    }
+    for(i=0; i<st->nopen; i++) {
+        st->count[i] += (double)(r.value[i] - st->start[i]) * enabled / running;
+    }
+    st->counted += lookups;
+}
+
+
+// Sums the threads' counters and prints them per lookup:
+void ip_stats_report(const ip_stats *st, size_t n, FILE *fp)
+{
+    double   count[IP_STATS_NEVENTS] = { 0 };
+    bool     have[IP_STATS_NEVENTS]  = { false };
+    uint64_t lookups = 0, batches = 0, counted = 0;
+    int      error = 0, i;
+    size_t   t;
+
+    for(t=0; t<n; t++) {
+        lookups += st[t].lookups;
+        batches += st[t].batches;
+        counted += st[t].counted;
+        if( st[t].error!=0 ) {
+            error = st[t].error;
+        }
+        for(i=0; i<st[t].nopen; i++) {
+            count[st[t].event[i]] += st[t].count[i];
+            have[st[t].event[i]]   = true;
+        }
+    }
+
+    fprintf(fp, "%llu lookups in %llu batches", (unsigned long long)lookups,
+            (unsigned long long)batches);
+    if( counted<lookups ) {
+        fprintf(fp, ", %llu of them counted", (unsigned long long)counted);
+    }
+    fprintf(fp, "\n");
+    if( error==EACCES || error==EPERM ) {
+        fprintf(fp, "perf_event_open: %s (see /proc/sys/kernel/perf_event_paranoid)\n",
+                strerror(error));
+    } else if( error!=0 ) {
+        fprintf(fp, "perf_event_open: %s (no hardware counters?)\n", strerror(error));
+    }
+    if( counted==0 ) {
+        return;
+    }
+
+    for(i=0; i<IP_STATS_NEVENTS; i++) {
+        if( have[i] ) {
+            fprintf(fp, "  %-14s %10.2f per lookup\n", events[i].name, count[i]/counted);
+        } else {
+            fprintf(fp, "  %-14s %10s\n", events[i].name, "n/a");
+        }
+    }
+    if( have[0] && have[1] && count[0]>0 ) {
+        fprintf(fp, "  %-14s %10.2f\n", "IPC", count[1]/count[0]);
+    }
+}
+
+
+void ip_stats_free(ip_stats *st, size_t n)
+{
+    size_t t;
+    int    i;
+
+    if( st==NULL ) {
+        return;
+    }
+    for(t=0; t<n; t++) {
+        for(i=0; i<st[t].nopen; i++) {
+            close(st[t].fd[i]);
+        }
+    }
+    free(st);
+}
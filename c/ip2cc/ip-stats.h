@@ -0,0 +1,36 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdio.h>
+
+// Hardware counters read around each batch of lookups, for --stats:
+// cycles, instructions, L1D and LLC load misses, dTLB load misses and
+// mispredicted branches, counted in user space for the calling thread
+// only. Each thread that looks addresses up has an ip_stats of its own,
+// which opens its counters the first time it is used.
+#define IP_STATS_NEVENTS 6
+
+typedef struct ip_stats ip_stats;
+
+struct ip_stats {
+    int       fd[IP_STATS_NEVENTS];         // The group, leader first
+    int       event[IP_STATS_NEVENTS];      // Which event each of them counts
+    int       nopen;
+    uint64_t  start[IP_STATS_NEVENTS];      // As read by ip_stats_begin()
+    uint64_t  start_enabled;
+    uint64_t  start_running;
+    double    count[IP_STATS_NEVENTS];      // Totals, scaled where the group was multiplexed
+    uint64_t  lookups;                      // All of them
+    uint64_t  batches;
+    uint64_t  counted;                      // Lookups the counters were running for
+    int       error;                        // From perf_event_open(), if it failed
+    bool      tried;
+} __attribute__((aligned(64)));
+
+ip_stats* ip_stats_new(size_t n);
+void      ip_stats_begin(ip_stats *st);
+void      ip_stats_end(ip_stats *st, size_t lookups);
+void      ip_stats_report(const ip_stats *st, size_t n, FILE *fp);
+void      ip_stats_free(ip_stats *st, size_t n);
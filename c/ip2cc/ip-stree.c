@@ -0,0 +1,172 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include <ip-stree.h>
+#include <assert.h>
+
+#include <stdlib.h>     // For posix_memalign(), free()
+#include <string.h>     // For memcpy()
+#include <limits.h>     // For INT32_MAX
+
+#if defined(__AVX2__) || defined(__SSE2__)
+#include <immintrin.h>
+#endif
+
+#define B IP_STREE_B
+
+// Keys are stored with the sign bit flipped, so that the signed SIMD
+// comparisons order them as unsigned:
+static inline int32_t flip(in_addr_t a) {
+    return (int32_t)(a ^ 0x80000000u);
+}
+
+// Number of B-key nodes needed for n keys:
+static inline size_t blocks(size_t n) {
+    return (n+B-1)/B;
+}
+
+// Number of keys in the layer above a layer of n keys:
+static inline size_t prev_keys(size_t n) {
+    return (blocks(n)+B)/(B+1)*B;
+}
+
+
+// Number of keys in the node at 'node' that are not greater than 'x':
+static inline unsigned rank(const int32_t *node, int32_t x)
+{
+#if defined(__AVX2__)
+    __m256i xv = _mm256_set1_epi32(x);
+    __m256i a  = _mm256_cmpgt_epi32(_mm256_load_si256((const __m256i*)node), xv);
+    __m256i b  = _mm256_cmpgt_epi32(_mm256_load_si256((const __m256i*)(node+8)), xv);
+    unsigned gt = _mm256_movemask_ps(_mm256_castsi256_ps(a))
+        | _mm256_movemask_ps(_mm256_castsi256_ps(b)) << 8;
+#elif defined(__SSE2__)
+    __m128i xv = _mm_set1_epi32(x);
+    __m128i a  = _mm_packs_epi32(_mm_cmpgt_epi32(_mm_load_si128((const __m128i*)node), xv),
+                                 _mm_cmpgt_epi32(_mm_load_si128((const __m128i*)(node+4)), xv));
+    __m128i b  = _mm_packs_epi32(_mm_cmpgt_epi32(_mm_load_si128((const __m128i*)(node+8)), xv),
+                                 _mm_cmpgt_epi32(_mm_load_si128((const __m128i*)(node+12)), xv));
+    unsigned gt = _mm_movemask_epi8(_mm_packs_epi16(a, b));
+#else
+    unsigned gt = 0;
+    for(unsigned i=0; i<B; i++) {
+        gt |= (unsigned)(node[i] > x) << i;
+    }
+#endif
+    return B - __builtin_popcount(gt);
+}
+
+
+ip_stree* ip_stree_new(const ip_cbst_node *sorted, size_t nmemb)
+{
+    ip_stree *stree = NULL;
+    size_t    n, size, h, i, j, k, l;
+
+    assert( sorted!=NULL || nmemb==0 );
+
+    stree = calloc(1, sizeof(ip_stree));
+    if( stree==NULL ) {
+        return NULL;
+    }
+    stree->nmemb = nmemb;
+
+    // Lay out the layers, leaves first:
+    n    = nmemb;
+    size = 0;
+    h    = 0;
+    do {
+        assert( h < IP_STREE_MAX_HEIGHT );
+        stree->offset[h++] = size;
+        size += blocks(n)*B;
+        n = prev_keys(n);
+    } while( stree->offset[h-1]+B < size );
+    stree->height = h;
+
+    stree->nodes = malloc(nmemb*sizeof(ip_cbst_node));
+    if( stree->nodes==NULL
+        || 0!=posix_memalign((void**)&stree->keys, 64, (size+B)*sizeof(int32_t)) ) {
+        ip_stree_free(stree);
+        return NULL;
+    }
+    memcpy(stree->nodes, sorted, nmemb*sizeof(ip_cbst_node));
+
+    for(i=0; i<nmemb; i++) {
+        stree->keys[i] = flip(sorted[i].addr_lo);
+    }
+    for(i=nmemb; i<size+B; i++) {
+        stree->keys[i] = INT32_MAX;
+    }
+
+    // Each internal key is the first leaf of the subtree to its right:
+    for(h=1; h<stree->height; h++) {
+        n = (h+1 < stree->height ? stree->offset[h+1] : size) - stree->offset[h];
+        for(i=0; i<n; i++) {
+            k = i/B;
+            j = i-k*B;
+            k = k*(B+1)+j+1;
+            for(l=1; l<h; l++) {
+                k *= B+1;
+            }
+            stree->keys[stree->offset[h]+i] = k*B < nmemb ? stree->keys[k*B] : INT32_MAX;
+        }
+    }
+
+    return stree;
+}
+
+
+ip_stree* ip_stree_from_cbst(const ip_cbst_node *cbst, size_t nmemb)
+{
+    ip_cbst_node *sorted = NULL;
+    ip_stree     *stree  = NULL;
+
+    sorted = cbst_to_sorted_array(cbst, nmemb, sizeof(ip_cbst_node));
+    if( sorted==NULL ) {
+        return NULL;
+    }
+    stree = ip_stree_new(sorted, nmemb);
+    free(sorted);
+
+    return stree;
+}
+
+
+void ip_stree_free(ip_stree *stree)
+{
+    if( stree!=NULL ) {
+        free(stree->keys);
+        free(stree->nodes);
+        free(stree);
+    }
+}
+
+
+const ip_cbst_node* ip_stree_lookup_ip(const ip_stree *stree, in_addr_t ip)
+{
+    const ip_cbst_node *node;
+    size_t  h, k;
+    int32_t x;
+
+    if( stree==NULL || stree->nmemb==0 ) {
+        return NULL;
+    }
+
+    // At or above the last key, the padding would compare equal; this
+    // also keeps every descent inside the populated subtrees:
+    if( ip >= stree->nodes[stree->nmemb-1].addr_lo ) {
+        k = stree->nmemb;
+    } else {
+        x = flip(ip);
+        k = 0;
+        for(h=stree->height-1; h>0; h--) {
+            k = k*(B+1) + rank(stree->keys+stree->offset[h]+k, x)*B;
+        }
+        // Position of the first key greater than 'ip':
+        k += rank(stree->keys+k, x);
+    }
+
+    if( k==0 ) {
+        return NULL;
+    }
+    node = stree->nodes+k-1;
+    return ip <= node->addr_hi ? node : NULL;
+}
@@ -0,0 +1,31 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <ip-cbst.h>
+
+// Keys per S-tree node; 16 32-bit keys fill one 64-byte cache line,
+// so each node has 17 children:
+#define IP_STREE_B 16
+
+// Enough layers for any size_t count of ranges:
+#define IP_STREE_MAX_HEIGHT 16
+
+typedef struct ip_stree ip_stree;
+
+// A static B+ tree over 'addr_lo'. The leaves are the sorted keys
+// themselves, and each internal key is the smallest key in the subtree
+// to its right. Layers are stored leaves first, each as a contiguous
+// run of cache-line-aligned nodes:
+struct ip_stree {
+    int32_t      *keys;     // Sign-flipped 'addr_lo', all layers
+    size_t        height;   // Number of layers
+    size_t        offset[IP_STREE_MAX_HEIGHT]; // Start of each layer in 'keys'
+    ip_cbst_node *nodes;    // The ranges, in sorted order
+    size_t        nmemb;
+};
+
+ip_stree*           ip_stree_new(const ip_cbst_node *sorted, size_t nmemb);
+ip_stree*           ip_stree_from_cbst(const ip_cbst_node *cbst, size_t nmemb);
+void                ip_stree_free(ip_stree *stree);
+const ip_cbst_node* ip_stree_lookup_ip(const ip_stree *stree, in_addr_t ip);
@@ -0,0 +1,512 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include <defaults.h>
+#include <ip-cbst.h>
+#include <ip-engine.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>     // For strcmp(), strerror()
+#include <errno.h>
+#include <math.h>       // For exp(), log()
+#include <unistd.h>     // For getopt()
+#include <time.h>       // For clock_gettime()
+#include <assert.h>
+
+// Synthetic tables, for -s: queries per stream unless -n says, and the
+// layouts timed besides the sorted array and the generic CBST:
+#define SUITE_QUERIES 1000000
+#define SUITE_ENGINES "cbst", "soa", "stree"
+
+// Countries in a synthetic table: about as many as real feeds have,
+// and within the 255 codes the compact engine can encode:
+#define SUITE_COUNTRIES 250
+
+
+static void usage(const char *argv0)
+{
+    fprintf(stderr, "usage: %s [-n queries] [engine...]\n", argv0);
+    fprintf(stderr, "       %s -s sizes [-n queries] [-o file.csv] [engine...]\n", argv0);
+    fprintf(stderr, "  Times each engine (default: cbst poptrie) over the same database,\n");
+    fprintf(stderr, "  and checks that its answers match the CBST's.\n");
+    fprintf(stderr, "  -s  instead times bsearch(), a sorted-array lower bound, cbst_find()\n");
+    fprintf(stderr, "      and the engines (default: cbst soa stree) over synthetic tables\n");
+    fprintf(stderr, "      of each of the comma-separated sizes, e.g. 1e3,1e6, under uniform,\n");
+    fprintf(stderr, "      Zipf, sorted and all-miss queries, and writes CSV\n");
+    fprintf(stderr, "  engines: %s\n", ip_engine_names());
+    exit(EXIT_FAILURE);
+}
+
+
+static double now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec*1e-9;
+}
+
+
+// xorshift64*, so that every run sees the same queries:
+static uint64_t next_random(uint64_t *state)
+{
+    *state ^= *state >> 12;
+    *state ^= *state << 25;
+    *state ^= *state >> 27;
+    return *state * 0x2545f4914f6cdd1dULL;
+}
+
+
+// Answers are the same if both miss or both find the same country in
+// ranges that agree; an engine that coalesces ranges may find one that
+// covers the expected range:
+static int same(const ip_cbst_node *a, const ip_cbst_node *b)
+{
+    if( a==NULL || b==NULL ) {
+        return a==b;
+    }
+    return a->addr_lo<=b->addr_lo && a->addr_hi>=b->addr_hi && 0==strcmp(a->cc, b->cc);
+}
+
+
+// Why ip_engine_new() returned NULL for 'name':
+static void engine_failed(const char *name)
+{
+    if( errno==ENOENT ) {
+        fprintf(stderr, "%s: no such engine\n", name);
+    } else {
+        fprintf(stderr, "%s: cannot build: %s\n", name, strerror(errno));
+    }
+}
+
+
+// Keeps the timed lookups from being optimized away:
+static volatile uintptr_t sink;
+
+static void bench(const char *name, const ip_cbst_node *cbst, size_t nmemb,
+                  const in_addr_t *ips, const ip_cbst_node **expect, size_t n)
+{
+    ip_engine *engine;
+    double     t0, t1, t2;
+    size_t     i, wrong = 0;
+    uintptr_t  sum = 0;
+
+    t0 = now();
+    engine = ip_engine_new(name, cbst, nmemb);
+    t1 = now();
+    if( engine==NULL ) {
+        engine_failed(name);
+        return;
+    }
+
+    for(i=0; i<n; i++) {
+        sum += (uintptr_t)ip_engine_lookup(engine, ips[i]);
+    }
+    t2 = now();
+    sink = sum;
+
+    for(i=0; i<n; i++) {
+        wrong += !same(ip_engine_lookup(engine, ips[i]), expect[i]);
+    }
+
+    printf("%-12s %10.1f %10.1f %10.2f %10zu\n", name, (t1-t0)*1e3, (t2-t1)*1e9/n,
+           n/(t2-t1)*1e-6, wrong);
+    ip_engine_free(engine);
+}
+
+
+// The synthetic tables of -s. 'random' ranges have random lengths and
+// random gaps between them; 'real' ones are shaped like allocations:
+// aligned power-of-two blocks, mostly adjacent, in runs of the same
+// country, with a few countries much more common than the rest:
+typedef enum { SHAPE_RANDOM, SHAPE_REAL, NSHAPES } shape;
+
+static const char *shape_names[NSHAPES] = { "random", "real" };
+
+// And the query streams: addresses drawn uniformly, addresses in ranges
+// picked with Zipf-skewed popularity, the uniform ones sorted, as a
+// scan of a sorted log would see them, and addresses in no range:
+typedef enum { STREAM_UNIFORM, STREAM_ZIPF, STREAM_SORTED, STREAM_MISS, NSTREAMS } stream;
+
+static const char *stream_names[NSTREAMS] = { "uniform", "zipf", "sorted", "miss" };
+
+
+// A rank in [0, n), 0 the most common: Zipf with exponent 1, by
+// inverting the continuous distribution:
+static size_t zipf(uint64_t *state, size_t n)
+{
+    double u = (next_random(state) >> 11) * 0x1p-53;
+    size_t r = (size_t)exp(u*log(n+1.0)) - 1;
+
+    return r<n ? r : n-1;
+}
+
+
+// Fills 'a' with up to 'n' sorted, disjoint ranges, leaving room
+// before the first so that there is always somewhere to miss; the room
+// is counted as a range's share, so that even one range fits. Returns
+// how many fit in the address space:
+static size_t make_table(ip_cbst_node *a, size_t n, shape sh, uint64_t *state)
+{
+    uint64_t avg = ((uint64_t)1<<32)/(n+1); // Address space per range
+    uint64_t pos = avg, lo, len, size;
+    unsigned base = 0, b;
+    size_t   i, cc = 0;
+
+    // Blocks average 1.5 times 2^base addresses; with alignment and
+    // gaps, about half the space per range all told:
+    while( ((uint64_t)6<<base) <= avg ) {
+        base++;
+    }
+    for(i=0; i<n; i++) {
+        if( sh==SHAPE_RANDOM ) {
+            lo  = pos + 1 + next_random(state)%(avg/2);
+            len = next_random(state)%(avg/2);
+            cc  = zipf(state, SUITE_COUNTRIES);
+        } else {
+            for(b=base; b<24 && next_random(state)%4==0; b++) {
+            }
+            size = (uint64_t)1<<b;
+            lo   = (pos+size-1) & ~(size-1);
+            if( next_random(state)%8==0 ) {
+                lo += size;
+            }
+            len = size-1;
+            if( i==0 || next_random(state)%2 ) {
+                cc = zipf(state, SUITE_COUNTRIES);
+            }
+        }
+        if( lo+len > UINT32_MAX ) {
+            break;
+        }
+        a[i].addr_lo = lo;
+        a[i].addr_hi = lo+len;
+        a[i].cc[0]   = 'a' + cc/26;
+        a[i].cc[1]   = 'a' + cc%26;
+        a[i].cc[2]   = '\0';
+        a[i].flag    = 0;
+        pos = lo+len+(sh==SHAPE_REAL);
+    }
+    return i;
+}
+
+
+static int cmp_ip(const void *a, const void *b)
+{
+    in_addr_t x = *(const in_addr_t*)a, y = *(const in_addr_t*)b;
+
+    return (x>y) - (x<y);
+}
+
+
+static void make_queries(in_addr_t *ips, size_t n, stream st,
+                         const ip_cbst_node *a, size_t nmemb, uint64_t *state)
+{
+    uint64_t lo, hi;
+    size_t   i, j;
+
+    for(i=0; i<n; i++) {
+        switch( st ) {
+        case STREAM_ZIPF:
+            // Popular ranges are scattered over the table:
+            j  = (uint64_t)zipf(state, nmemb)*2654435761u % nmemb;
+            lo = a[j].addr_lo;
+            hi = a[j].addr_hi;
+            break;
+        case STREAM_MISS:
+            // A gap picked at random; there is one before the first range:
+            do {
+                j  = next_random(state) % (nmemb+1);
+                lo = j>0 ? (uint64_t)a[j-1].addr_hi+1 : 0;
+                hi = j<nmemb ? (uint64_t)a[j].addr_lo-1 : UINT32_MAX;
+            } while( lo>hi );
+            break;
+        default:
+            lo = 0;
+            hi = UINT32_MAX;
+        }
+        ips[i] = lo + next_random(state)%(hi-lo+1);
+    }
+    if( st==STREAM_SORTED ) {
+        qsort(ips, n, sizeof(in_addr_t), cmp_ip);
+    }
+}
+
+
+// The layouts that are not engines, wrapped as engines over the sorted
+// array (or, for cbst_find(), the CBST) so that every lookup is timed
+// through the same indirect call.
+
+// The last range that starts at or before 'ip', by halving without
+// branches, then checked:
+static const ip_cbst_node* lower_bound_lookup(const ip_engine *engine, in_addr_t ip)
+{
+    const ip_cbst_node *base = engine->cbst;
+    size_t len = engine->nmemb, half;
+
+    while( len>1 ) {
+        half = len/2;
+        base = base[half].addr_lo <= ip ? base+half : base;
+        len -= half;
+    }
+    return base->addr_lo <= ip && ip <= base->addr_hi ? base : NULL;
+}
+
+static int cmp_bsearch(const void *key, const void *elem)
+{
+    in_addr_t ip = *(const in_addr_t*)key;
+    const ip_cbst_node *node = elem;
+
+    return ip < node->addr_lo ? -1 : ip > node->addr_hi;
+}
+
+static const ip_cbst_node* bsearch_lookup(const ip_engine *engine, in_addr_t ip)
+{
+    return bsearch(&ip, engine->cbst, engine->nmemb, sizeof(ip_cbst_node), cmp_bsearch);
+}
+
+// The cbst_find() convention, which is the other way round:
+static int cmp_find(const void *elem, const void *value)
+{
+    in_addr_t ip = *(const in_addr_t*)value;
+    const ip_cbst_node *node = elem;
+
+    return node->addr_hi < ip ? 1 : -(node->addr_lo > ip);
+}
+
+static const ip_cbst_node* find_lookup(const ip_engine *engine, in_addr_t ip)
+{
+    return cbst_find(engine->cbst, engine->nmemb, sizeof(ip_cbst_node), cmp_find, &ip, 0);
+}
+
+
+// Times one layout over every stream, a CSV row for each:
+static void time_streams(FILE *csv, shape sh, size_t nmemb, const char *method,
+                         const ip_engine *engine, double build, in_addr_t *ips[],
+                         const ip_cbst_node **expect[], size_t n)
+{
+    double    t0, t1;
+    size_t    i, wrong;
+    uintptr_t sum = 0;
+    int       st;
+
+    for(st=0; st<NSTREAMS; st++) {
+        t0 = now();
+        for(i=0; i<n; i++) {
+            sum += (uintptr_t)ip_engine_lookup(engine, ips[st][i]);
+        }
+        t1 = now();
+        sink = sum;
+
+        for(i=0, wrong=0; i<n; i++) {
+            wrong += !same(ip_engine_lookup(engine, ips[st][i]), expect[st][i]);
+        }
+        fprintf(csv, "%s,%zu,%s,%s,%zu,%.3f,%.2f,%.0f,%zu\n", shape_names[sh], nmemb,
+                method, stream_names[st], n, build*1e3, (t1-t0)*1e9/n, n/(t1-t0), wrong);
+    }
+    fflush(csv);
+}
+
+
+// One table: the sorted array, searched as it is; then the CBST built
+// from it, a chunk per CPU as the loaders build it, searched by
+// cbst_find() and by each engine. Engines are built from the CBST, so
+// their build time includes the CBST's. Answers are checked against
+// the sorted array's:
+static void suite(FILE *csv, shape sh, size_t size, char **names, int nnames,
+                  size_t n, uint64_t *state)
+{
+    ip_cbst_node        *sorted, *cbst;
+    in_addr_t           *ips[NSTREAMS];
+    const ip_cbst_node **expect[NSTREAMS];
+    ip_engine            flat = { .name = "sorted" }, *engine;
+    double               t0, t1, build;
+    size_t               nmemb, i;
+    int                  st;
+
+    sorted = malloc(size*sizeof(ip_cbst_node));
+    assert( sorted!=NULL );
+    nmemb = make_table(sorted, size, sh, state);
+    if( nmemb==0 ) {
+        // Nothing to pick queries from
+        fprintf(stderr, "%zu %s ranges do not fit, skipped\n", size, shape_names[sh]);
+        free(sorted);
+        return;
+    }
+
+    flat.cbst  = sorted;
+    flat.nmemb = nmemb;
+    for(st=0; st<NSTREAMS; st++) {
+        ips[st]    = malloc(n*sizeof(in_addr_t));
+        expect[st] = malloc(n*sizeof(ip_cbst_node*));
+        assert( ips[st]!=NULL && expect[st]!=NULL );
+        make_queries(ips[st], n, st, sorted, nmemb, state);
+        for(i=0; i<n; i++) {
+            expect[st][i] = lower_bound_lookup(&flat, ips[st][i]);
+        }
+    }
+
+    flat.lookup = lower_bound_lookup;
+    time_streams(csv, sh, nmemb, "lower_bound", &flat, 0, ips, expect, n);
+    flat.lookup = bsearch_lookup;
+    time_streams(csv, sh, nmemb, "bsearch", &flat, 0, ips, expect, n);
+
+    t0   = now();
+    cbst = ip_cbst_new(nmemb);
+    assert( cbst!=NULL );
+    cbst_place_sorted_array_mt(cbst, sorted, nmemb, sizeof(ip_cbst_node), 0);
+    build = now()-t0;
+
+    // The engines need room more than the sorted array; the answers
+    // are checked against the same ranges in the CBST:
+    for(st=0; st<NSTREAMS; st++) {
+        for(i=0; i<n; i++) {
+            if( expect[st][i]!=NULL ) {
+                expect[st][i] = cbst + cbst_index(nmemb, expect[st][i]-sorted);
+            }
+        }
+    }
+    free(sorted);
+
+    flat.cbst   = cbst;
+    flat.lookup = find_lookup;
+    time_streams(csv, sh, nmemb, "cbst_find", &flat, build, ips, expect, n);
+
+    for(i=0; i<(size_t)nnames; i++) {
+        t0     = now();
+        engine = ip_engine_new(names[i], cbst, nmemb);
+        t1     = now();
+        if( engine==NULL ) {
+            engine_failed(names[i]);
+            continue;
+        }
+        time_streams(csv, sh, nmemb, names[i], engine, build+t1-t0, ips, expect, n);
+        ip_engine_free(engine);
+    }
+
+    ip_cbst_free(cbst);
+    for(st=0; st<NSTREAMS; st++) {
+        free(expect[st]);
+        free(ips[st]);
+    }
+}
+
+
+// Sizes as a comma-separated list, each possibly as 1e6; 0 if one of
+// them is not a size:
+static size_t parse_sizes(const char *arg, size_t *sizes, size_t max)
+{
+    const char *p = arg;
+    char       *end;
+    double      d;
+    size_t      n = 0;
+
+    while( n<max ) {
+        d = strtod(p, &end);
+        if( end==p || d<1 || d>(double)UINT32_MAX/2 || (*end!=',' && *end!='\0') ) {
+            return 0;
+        }
+        sizes[n++] = (size_t)d;
+        if( *end=='\0' ) {
+            return n;
+        }
+        p = end+1;
+    }
+    return 0;
+}
+
+
+int main(int argc, char *argv[])
+{
+    static char *defaults[] = { "cbst", "poptrie" };
+    static char *suite_defaults[] = { SUITE_ENGINES };
+    const ip_cbst_node  *cbst = NULL;
+    const ip_cbst_node **expect = NULL;
+    in_addr_t *ips = NULL;
+    char     **names = defaults;
+    size_t     nmemb = 0, n = 10000000, i, sizes[64], nsizes = 0;
+    uint64_t   state = 0x9e3779b97f4a7c15ULL;
+    int        opt, nnames = 2, sh;
+    bool       n_set = false;
+    const char *out = NULL;
+    FILE      *csv = stdout;
+
+    while( -1 != (opt=getopt(argc, argv, "n:s:o:")) ) {
+        switch( opt ) {
+        case 'n':
+            n = strtoul(optarg, NULL, 10);
+            n_set = true;
+            break;
+        case 's':
+            nsizes = parse_sizes(optarg, sizes, sizeof(sizes)/sizeof(sizes[0]));
+            if( nsizes==0 ) {
+                usage(argv[0]);
+            }
+            break;
+        case 'o':
+            out = optarg;
+            break;
+        default:
+            usage(argv[0]);
+        }
+    }
+    if( optind<argc ) {
+        names  = argv+optind;
+        nnames = argc-optind;
+    }
+    if( n==0 ) {
+        usage(argv[0]);
+    }
+
+    if( nsizes>0 ) {
+        if( names==defaults ) {
+            names  = suite_defaults;
+            nnames = sizeof(suite_defaults)/sizeof(suite_defaults[0]);
+        }
+        if( !n_set ) {
+            n = SUITE_QUERIES;
+        }
+        if( out!=NULL && NULL==(csv=fopen(out, "w")) ) {
+            perror(out);
+            return EXIT_FAILURE;
+        }
+        fprintf(csv, "shape,size,method,stream,queries,build_ms,ns_per_lookup,lookups_per_s,mismatches\n");
+        for(i=0; i<nsizes; i++) {
+            for(sh=0; sh<NSHAPES; sh++) {
+                suite(csv, sh, sizes[i], names, nnames, n, &state);
+            }
+        }
+        if( out!=NULL && 0!=fclose(csv) ) {
+            perror(out);
+            return EXIT_FAILURE;
+        }
+        return 0;
+    }
+
+    setenv(IP2CC_TXTDB_ENVAR, IP2CC_TXTDB_PATH, 0);
+    setenv(IP2CC_BINDB_ENVAR, IP2CC_BINDB_PATH, 0);
+    cbst = ip_cbst_load(NULL, &nmemb, false);
+    if( cbst==NULL ) {
+        return EXIT_FAILURE;
+    }
+
+    ips    = malloc(n*sizeof(in_addr_t));
+    expect = malloc(n*sizeof(ip_cbst_node*));
+    assert( ips!=NULL && expect!=NULL );
+    for(i=0; i<n; i++) {
+        ips[i]    = next_random(&state) >> 32;
+        expect[i] = ip_cbst_lookup_ip(cbst, nmemb, ips[i]);
+    }
+
+    printf("%zu ranges, %zu uniformly random queries\n", nmemb, n);
+    printf("%-12s %10s %10s %10s %10s\n", "engine", "build ms", "ns/lookup", "Mlookup/s", "mismatches");
+    for(i=0; i<(size_t)nnames; i++) {
+        bench(names[i], cbst, nmemb, ips, expect, n);
+    }
+
+    free(expect);
+    free(ips);
+    ip_cbst_free(cbst);
+    return 0;
+}
@@ -0,0 +1,253 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include <defaults.h>
+#include <ip-cbst.h>
+#include <ip6-cbst.h>
+#include <ip-builtin.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <inttypes.h>   // For PRIx64
+#include <ctype.h>      // For isalnum()
+#include <unistd.h>     // For getopt()
+#include <assert.h>
+
+#define INDENT "    "
+
+// Levels of the tree unrolled without -l; the Makefile passes its
+// BUILTIN_LEVELS:
+#ifndef IP_BUILTIN_LEVELS
+#error "IP_BUILTIN_LEVELS must be defined, as the Makefile does"
+#endif
+
+
+static void usage(const char *argv0)
+{
+    fprintf(stderr, "usage: %s [-l levels] [-o file.c]\n", argv0);
+    fprintf(stderr, "  Writes the text databases out as C source for ip-builtin.h,\n");
+    fprintf(stderr, "  with the top levels of the tree (default %d) unrolled.\n", IP_BUILTIN_LEVELS);
+    exit(EXIT_FAILURE);
+}
+
+
+// A country code as a C string literal:
+static void put_cc(FILE *f, const char *cc)
+{
+    int i;
+
+    fputc('"', f);
+    for(i=0; i<2 && cc[i]!='\0'; i++) {
+        if( isalnum((unsigned char)cc[i]) ) {
+            fputc(cc[i], f);
+        } else {
+            fprintf(f, "\\%03o", (unsigned char)cc[i]);
+        }
+    }
+    fputc('"', f);
+}
+
+
+static void put_header(FILE *f, size_t nmemb, size_t nmemb6, size_t offset6)
+{
+    const char *magic = IP_CBST_MAGIC;
+    int i;
+
+    // The magic has no NUL, so it is spelled out:
+    fputs(INDENT "{\n" INDENT INDENT ".magic      = { ", f);
+    for(i=0; i<8; i++) {
+        fprintf(f, "'%c'%s", magic[i], i<7 ? ", " : " },\n");
+    }
+    fputs(INDENT INDENT ".version    = IP_CBST_VERSION,\n", f);
+    fputs(INDENT INDENT ".endian     = IP_CBST_ENDIAN,\n", f);
+    fputs(INDENT INDENT ".node_size  = sizeof(ip_cbst_node),\n", f);
+    fputs(INDENT INDENT ".layout     = IP_CBST_LAYOUT_CBST,\n", f);
+    fprintf(f, INDENT INDENT ".nmemb      = %zu,\n", nmemb);
+    fputs(INDENT INDENT ".node6_size = sizeof(ip6_cbst_node),\n", f);
+    fprintf(f, INDENT INDENT ".nmemb6     = %zu,\n", nmemb6);
+    fprintf(f, INDENT INDENT ".offset6    = %zu,\n", offset6);
+    fputs(INDENT "},\n", f);
+}
+
+
+static void put_nodes(FILE *f, const ip_cbst_node *cbst, size_t nmemb)
+{
+    size_t i;
+
+    fputs(INDENT "{   // addr_hi, addr_lo, cc, flag\n", f);
+    for(i=0; i<nmemb; i++) {
+        fprintf(f, INDENT INDENT "{ 0x%08" PRIx32 "u, 0x%08" PRIx32 "u, ",
+                (uint32_t)cbst[i].addr_hi, (uint32_t)cbst[i].addr_lo);
+        put_cc(f, cbst[i].cc);
+        fprintf(f, ", %d },\n", cbst[i].flag);
+    }
+    fputs(INDENT "},\n", f);
+}
+
+
+static void put_nodes6(FILE *f, const ip6_cbst_node *cbst6, size_t nmemb6)
+{
+    size_t i;
+
+    fputs(INDENT "{   // addr_lo, addr_hi, cc, flag\n", f);
+    for(i=0; i<nmemb6; i++) {
+        fprintf(f, INDENT INDENT "{ { 0x%016" PRIx64 "u, 0x%016" PRIx64 "u }, "
+                   "{ 0x%016" PRIx64 "u, 0x%016" PRIx64 "u }, ",
+                cbst6[i].addr_lo.hi, cbst6[i].addr_lo.lo,
+                cbst6[i].addr_hi.hi, cbst6[i].addr_hi.lo);
+        put_cc(f, cbst6[i].cc);
+        fprintf(f, ", %d },\n", cbst6[i].flag);
+    }
+    fputs(INDENT "},\n", f);
+}
+
+
+// The subtree of node 'k' down to 'levels' levels below the root, as
+// nested compares; each leaf is where the loop carries on from:
+static void put_levels(FILE *f, const ip_cbst_node *cbst, size_t k, unsigned depth, unsigned levels)
+{
+    unsigned i;
+
+    for(i=0; i<=depth; i++) {
+        fputs(INDENT, f);
+    }
+    if( depth==levels ) {
+        fprintf(f, "k = %zu;\n", k);
+        return;
+    }
+    fprintf(f, "if( ip < 0x%08" PRIx32 "u ) {\n", (uint32_t)cbst[k-1].addr_lo);
+    put_levels(f, cbst, 2*k, depth+1, levels);
+    for(i=0; i<=depth; i++) {
+        fputs(INDENT, f);
+    }
+    fputs("} else {\n", f);
+    put_levels(f, cbst, 2*k+1, depth+1, levels);
+    for(i=0; i<=depth; i++) {
+        fputs(INDENT, f);
+    }
+    fputs("}\n", f);
+}
+
+
+static void put_lookup(FILE *f, const ip_cbst_node *cbst, unsigned levels)
+{
+    fputs("const ip_cbst_node* ip_builtin_lookup_ip(in_addr_t ip)\n{\n", f);
+    fputs(INDENT "const ip_cbst_node *node;\n", f);
+    fputs(INDENT "size_t k = 1;\n\n", f);
+    if( levels>0 ) {
+        fprintf(f, INDENT "// The top %u levels:\n", levels);
+        put_levels(f, cbst, 1, 0, levels);
+        fputc('\n', f);
+    }
+    fputs(INDENT "// The rest, as ip_cbst_lookup_ip() does:\n", f);
+    fputs(INDENT "while( k <= NMEMB ) {\n", f);
+    fputs(INDENT INDENT "k = (k<<1) + (image.cbst[k-1].addr_lo <= ip);\n", f);
+    fputs(INDENT "}\n", f);
+    fputs(INDENT "k >>= __builtin_ctzl(k)+1;\n\n", f);
+    fputs(INDENT "if( k==0 ) {\n" INDENT INDENT "return NULL;\n" INDENT "}\n", f);
+    fputs(INDENT "node = image.cbst+k-1;\n", f);
+    fputs(INDENT "return ip <= node->addr_hi ? node : NULL;\n}\n", f);
+}
+
+
+// Writes the whole of the generated file. The structure reproduces the
+// image that ip_cbst_load() returns, so that the header is where
+// ip_cbst_ip6() looks for it and the IPv6 nodes are at its offset6:
+static void make_c(FILE *f, const ip_cbst_node *cbst, size_t nmemb, unsigned levels)
+{
+    const ip6_cbst_node *cbst6;
+    size_t nmemb6, offset6, pad6;
+
+    cbst6   = ip_cbst_ip6(cbst, &nmemb6);
+    offset6 = (const char*)cbst6 - (const char*)cbst;
+    pad6    = offset6 - nmemb*sizeof(ip_cbst_node);
+
+    fputs("// Generated by ip2cc-gen from the text databases; do not edit.\n\n", f);
+    fputs("#include <ip-builtin.h>\n#include <ip6-cbst.h>\n#include <assert.h>\n\n", f);
+    fprintf(f, "#define NMEMB  %zu\n#define NMEMB6 %zu\n\n", nmemb, nmemb6);
+
+    fputs("static const struct {\n", f);
+    fputs(INDENT "ip_cbst_header  hdr;\n", f);
+    fputs(INDENT "char            pad[IP_CBST_HDR_SIZE-sizeof(ip_cbst_header)];\n", f);
+    fputs(INDENT "ip_cbst_node    cbst[NMEMB];\n", f);
+    if( pad6>0 ) {
+        fprintf(f, INDENT "char            pad6[%zu];\n", pad6);
+    }
+    if( nmemb6>0 ) {
+        fputs(INDENT "ip6_cbst_node   cbst6[NMEMB6];\n", f);
+    }
+    fputs("} image __attribute__((aligned(IP_CBST_HDR_SIZE))) = {\n", f);
+    put_header(f, nmemb, nmemb6, offset6);
+    fputs(INDENT "{ 0 },\n", f);
+    put_nodes(f, cbst, nmemb);
+    if( pad6>0 ) {
+        fputs(INDENT "{ 0 },\n", f);
+    }
+    if( nmemb6>0 ) {
+        put_nodes6(f, cbst6, nmemb6);
+    }
+    fputs("};\n\n\n", f);
+
+    fputs("const ip_cbst_node* ip_builtin_cbst(size_t *nmemb)\n{\n", f);
+    if( nmemb6>0 ) {
+        fputs(INDENT "assert( (uint64_t)((const char*)image.cbst6 - (const char*)image.cbst) == image.hdr.offset6 );\n", f);
+    }
+    fputs(INDENT "*nmemb = NMEMB;\n" INDENT "return image.cbst;\n}\n\n\n", f);
+
+    put_lookup(f, cbst, levels);
+}
+
+
+int main(int argc, char *argv[])
+{
+    const ip_cbst_node *cbst;
+    const char *out    = NULL;
+    unsigned    levels = IP_BUILTIN_LEVELS, full = 0;
+    size_t      nmemb;
+    FILE       *f = stdout;
+    int         opt;
+
+    while( -1 != (opt=getopt(argc, argv, "l:o:")) ) {
+        switch( opt ) {
+        case 'l':
+            levels = strtoul(optarg, NULL, 10);
+            break;
+        case 'o':
+            out = optarg;
+            break;
+        default:
+            usage(argv[0]);
+        }
+    }
+    if( optind<argc ) {
+        usage(argv[0]);
+    }
+
+    setenv(IP2CC_TXTDB_ENVAR, IP2CC_TXTDB_PATH, 0);
+    setenv(IP2CC_TXTDB6_ENVAR, IP2CC_TXTDB6_PATH, 0);
+    cbst = ip_cbst_load_text(NULL, &nmemb);
+    if( cbst==NULL || nmemb==0 ) {
+        fprintf(stderr, "%s: no ranges to write\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    // Only levels that are complete can be unrolled:
+    while( ((size_t)2<<full)-1 <= nmemb ) {
+        full++;
+    }
+    if( levels>full ) {
+        levels = full;
+    }
+
+    if( out!=NULL && NULL==(f=fopen(out, "w")) ) {
+        perror(out);
+        return EXIT_FAILURE;
+    }
+    make_c(f, cbst, nmemb, levels);
+    if( 0!=fflush(f) || ferror(f) || (out!=NULL && 0!=fclose(f)) ) {
+        perror(out!=NULL ? out : "stdout");
+        return EXIT_FAILURE;
+    }
+
+    ip_cbst_free(cbst);
+    return EXIT_SUCCESS;
+}
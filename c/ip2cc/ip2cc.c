@@ -2,40 +2,649 @@
 
 #include <defaults.h>
 #include <ip-cbst.h>
+#include <ip6-cbst.h>
+#include <ip-engine.h>
+#include <ip-scan.h>
+#include <ip-parse.h>
+#include <ip-pipeline.h>
+#include <ip-agg.h>
+#include <ip-serve.h>
+#include <ip-reload.h>
+#include <ip-stats.h>
+#include <ip-cache.h>
+#ifdef IP2CC_BUILTIN
+#include <ip-builtin.h>
+#endif
 #include <stdio.h>      // For printf()
 #include <stdlib.h>
 #include <stddef.h>     // For size_t
+#include <stdbool.h>
+#include <string.h>     // For strlen(), strerror()
+#include <errno.h>
+#include <ctype.h>      // For isspace()
+#include <unistd.h>
+#include <getopt.h>     // For getopt_long()
 #include <assert.h>
 
 void set_default_env(void)
 {
     setenv(IP2CC_TXTDB_ENVAR, IP2CC_TXTDB_PATH, 0);
     setenv(IP2CC_BINDB_ENVAR, IP2CC_BINDB_PATH, 0);
+    setenv(IP2CC_TXTDB6_ENVAR, IP2CC_TXTDB6_PATH, 0);
+    setenv(IP2CC_SOCKET_ENVAR, IP2CC_SOCKET_PATH, 0);
+    setenv(IP2CC_SHM_ENVAR, IP2CC_SHM_NAME, 0);
 }
 
+void usage(const char *argv0)
+{
+    fprintf(stderr, "usage: %s [-e engine] address...\n", argv0);
+    fprintf(stderr, "       %s [-e engine] [-t threads] -s|-a [file...]\n", argv0);
+    fprintf(stderr, "       %s [-e engine] [-t threads] -c [-k top] [-C] [file...]\n", argv0);
+    fprintf(stderr, "       %s [-e engine] [-t threads] --serve[=socket]\n", argv0);
+    fprintf(stderr, "       %s --publish[=name]\n", argv0);
+    fprintf(stderr, "       %s --update\n", argv0);
+    fprintf(stderr, "  -e engine  lookup engine, one of: %s\n", ip_engine_names());
+    fprintf(stderr, "             (\"jump:bits\" sets the jump table's prefix length, and\n");
+    fprintf(stderr, "             \"poptrie:file\" loads CIDR prefixes from the file;\n");
+    fprintf(stderr, "             IPv6 addresses are always looked up in the CBST)\n");
+    fprintf(stderr, "  -s         scan text (or stdin) for addresses, one result per address\n");
+    fprintf(stderr, "  -a         scan text (or stdin), copying it with each address annotated\n");
+    fprintf(stderr, "  -c         scan text (or stdin), counting hits per country and per range\n");
+    fprintf(stderr, "  -k top     countries and ranges to report with -c (default %d)\n", IP_AGG_TOPK);
+    fprintf(stderr, "  -C         report -c counts as CSV\n");
+    fprintf(stderr, "  -t threads worker threads for -s/-a/-c/--serve (0: one per CPU; default 1)\n");
+    fprintf(stderr, "  --serve    answer lookups on a Unix domain socket (default $%s)\n", IP2CC_SOCKET_ENVAR);
+    fprintf(stderr, "  --publish  publish the database in shared memory (default $%s)\n", IP2CC_SHM_ENVAR);
+    fprintf(stderr, "  --shm[=name] use the database published in shared memory\n");
+    fprintf(stderr, "  --update   bring the binary database up to date, rewriting only what changed\n");
+    fprintf(stderr, "  --verify   check the binary database's checksums, which reads all of it,\n");
+    fprintf(stderr, "             and rebuild it from the text if they are wrong\n");
+    fprintf(stderr, "  --stats    count cycles, cache and TLB misses and so on per lookup, and\n");
+    fprintf(stderr, "             report them on exit\n");
+    fprintf(stderr, "  --cache[=bits] cache the range each /bits prefix (default /%d) is in,\n", IP_CACHE_PREFIX);
+    fprintf(stderr, "             per thread, and report the hit rate on exit\n");
+    exit(EXIT_FAILURE);
+}
+
+
+// Per-address output: the country code, the address, and the range
+// it is in:
+void format_result(ip_block *out, const char *addr, size_t len, const ip_cbst_node *node)
+{
+    char buf[512];
+
+    if( node != NULL ) {
+        ip_cbst_address_range(node, buf);
+        ip_block_printf(out, "%s %.*s %s\n", node->cc, (int)len, addr, buf);
+    } else {
+        ip_block_printf(out, "%.*s (no match)\n", (int)len, addr);
+    }
+}
+
+
+void format_result6(ip_block *out, const char *addr, size_t len, const ip6_cbst_node *node)
+{
+    char buf[IP6_CBST_RANGE_MAX];
+
+    if( node != NULL ) {
+        ip6_cbst_address_range(node, buf);
+        ip_block_printf(out, "%s %.*s %s\n", node->cc, (int)len, addr, buf);
+    } else {
+        ip_block_printf(out, "%.*s (no match)\n", (int)len, addr);
+    }
+}
+
+
+// Look up the addresses given as arguments. IPv4 addresses, including
+// IPv4-mapped IPv6 ones, go to the engine; other IPv6 addresses to the
+// IPv6 CBST:
+void lookup_args(const ip_engine *engine, const ip6_cbst_node *cbst6, size_t nmemb6, char **argv, size_t n,
+                 ip_stats *stats, ip_cache *cache)
+{
+    const ip_cbst_node** nodes = NULL;
+    const ip6_cbst_node** nodes6 = NULL;
+    in_addr_t* ips = NULL;
+    ip6_addr* ips6 = NULL;
+    bool* is6 = NULL;
+    ip_block out;
+
+    ips    = calloc(n, sizeof(in_addr_t));
+    nodes  = calloc(n, sizeof(ip_cbst_node*));
+    ips6   = calloc(n, sizeof(ip6_addr));
+    nodes6 = calloc(n, sizeof(ip6_cbst_node*));
+    is6    = calloc(n, sizeof(bool));
+    assert(ips!=NULL && nodes!=NULL && ips6!=NULL && nodes6!=NULL && is6!=NULL);
+    for(size_t i=0; i<n; i++) {
+        if( strchr(argv[i], ':')==NULL ) {
+            if( strlen(argv[i]) != ip_parse_dq_str(argv[i], &ips[i]) ) {
+                fprintf(stderr, "%s: not a dotted quad\n", argv[i]);
+                exit(EXIT_FAILURE);
+            }
+        } else if( strlen(argv[i]) != ip_parse_ip6_str(argv[i], &ips6[i]) ) {
+            fprintf(stderr, "%s: not an IPv6 address\n", argv[i]);
+            exit(EXIT_FAILURE);
+        } else if( ip6_addr_is_v4mapped(ips6[i]) ) {
+            ips[i] = (in_addr_t)ips6[i].lo;
+        } else {
+            is6[i] = true;
+        }
+    }
+    if( stats!=NULL ) {
+        ip_stats_begin(stats);
+    }
+    if( cache!=NULL ) {
+        ip_cache_lookup_batch(cache, engine, 0, ips, nodes, n);
+    } else {
+        ip_engine_lookup_batch(engine, ips, nodes, n);
+    }
+    ip6_cbst_lookup_batch(cbst6, nmemb6, ips6, nodes6, n);
+    if( stats!=NULL ) {
+        ip_stats_end(stats, n);
+    }
+
+    memset(&out, 0, sizeof(out));
+    for(size_t i=0; i<n; i++) {
+        if( is6[i] ) {
+            format_result6(&out, argv[i], strlen(argv[i]), nodes6[i]);
+        } else {
+            format_result(&out, argv[i], strlen(argv[i]), nodes[i]);
+        }
+    }
+    fwrite(out.out, 1, out.outlen, stdout);
+
+    ip_block_free(&out);
+    free(is6);
+    free(nodes6);
+    free(ips6);
+    free(nodes);
+    free(ips);
+}
+
+
+typedef struct {
+    const ip_engine     *engine;
+    const ip6_cbst_node *cbst6;
+    size_t               nmemb6;
+    bool                 annotate;
+    ip_agg             **shards;    // For -c, one per worker
+    ip_stats            *stats;     // For --stats, one per worker; NULL without
+    ip_cache            *caches;    // For --cache, likewise
+    ip_reload           *reload;    // For -s/-a over --shm, the generation
+                                    // to use instead of the above; or NULL
+    bool                 failed;    // Set by any worker that could not
+                                    // hold all the addresses in a block
+} scan_arg;
+
+// Find and look up the IPv4 and IPv6 addresses in a block, in 'db' if
+// it is not NULL. If there are more than can be held, those that can
+// are looked up, and the scan is marked as failed:
+static void scan_lookup(ip_block *block, scan_arg *sa, const ip_db *db)
+{
+    const ip_engine     *engine = db!=NULL ? db->engine : sa->engine;
+    const ip6_cbst_node *cbst6  = db!=NULL ? db->cbst6  : sa->cbst6;
+    size_t               nmemb6 = db!=NULL ? db->nmemb6 : sa->nmemb6;
+    ip_hits  *hits  = &block->hits;
+    ip6_hits *hits6 = &block->hits6;
+    bool      full;
+
+    ip_hits_clear(hits);
+    ip6_hits_clear(hits6);
+    full  = ip_scan_block(block->in, block->len, hits) < 0;
+    full |= ip_scan_block6(block->in, block->len, hits6) < 0;
+    if( full && !__atomic_exchange_n(&sa->failed, true, __ATOMIC_RELAXED) ) {
+        perror("cannot hold the addresses in a block");
+    }
+    if( sa->stats!=NULL ) {
+        ip_stats_begin(sa->stats+block->worker);
+    }
+    if( sa->caches!=NULL ) {
+        ip_cache_lookup_batch(sa->caches+block->worker, engine, db!=NULL ? db->generation : 0,
+                              hits->ip, hits->node, hits->n);
+    } else {
+        ip_engine_lookup_batch(engine, hits->ip, hits->node, hits->n);
+    }
+    ip6_cbst_lookup_batch(cbst6, nmemb6, hits6->ip, hits6->node, hits6->n);
+    if( sa->stats!=NULL ) {
+        ip_stats_end(sa->stats+block->worker, hits->n+hits6->n);
+    }
+}
+
+// Copy the block with "[cc]" after each address found in it ("[--]" if
+// it is in no range), or just list the addresses. The IPv4 and IPv6
+// hits are merged back into the order of the text; a dotted quad at
+// the end of an IPv6 address is part of it, not an address of its own.
+// Over --shm, the generation looked up in is held until the block has
+// been written out:
+void scan_block(ip_block *block, void *arg)
+{
+    scan_arg       *sa    = arg;
+    const ip_hits  *hits  = &block->hits;
+    const ip6_hits *hits6 = &block->hits6;
+    const ip_db    *db    = NULL;
+    size_t i = 0, j = 0, done = 0, off, len;
+    const char *cc;
+
+    if( sa->reload!=NULL ) {
+        db = ip_reload_enter(sa->reload, block->worker);
+    }
+    scan_lookup(block, sa, db);
+
+    while( i<hits->n || j<hits6->n ) {
+        if( j<hits6->n && (i==hits->n || hits6->offset[j] < hits->offset[i]) ) {
+            off = hits6->offset[j];
+            len = hits6->len[j];
+            cc  = hits6->node[j]!=NULL ? hits6->node[j]->cc : "--";
+            if( !sa->annotate ) {
+                format_result6(block, block->in+off, len, hits6->node[j]);
+            }
+            for(j++; i<hits->n && hits->offset[i] < off+len; i++)
+                ;
+        } else {
+            off = hits->offset[i];
+            len = hits->len[i];
+            cc  = hits->node[i]!=NULL ? hits->node[i]->cc : "--";
+            if( !sa->annotate ) {
+                format_result(block, block->in+off, len, hits->node[i]);
+            }
+            i++;
+        }
+        if( sa->annotate ) {
+            ip_block_append(block, block->in+done, off+len-done);
+            ip_block_append(block, "[", 1);
+            ip_block_append(block, cc, 2);
+            ip_block_append(block, "]", 1);
+            done = off+len;
+        }
+    }
+    if( sa->annotate ) {
+        ip_block_append(block, block->in+done, block->len-done);
+    }
+    if( sa->reload!=NULL ) {
+        ip_reload_leave(sa->reload, block->worker);
+    }
+}
+
+
+// Look up one address per line, for the server's line protocol. Every
+// line gets one line of answer, even if it is not an address:
+void lookup_lines(ip_block *block, const ip_db *db)
+{
+    const char     *p   = block->in;
+    const char     *end = block->in+block->len;
+    const char     *nl;
+    size_t    len;
+    in_addr_t ip;
+    ip6_addr  ip6;
+
+    for(; p<end && NULL!=(nl=memchr(p, '\n', end-p)); p=nl+1) {
+        for(len=nl-p; len>0 && isspace((unsigned char)p[len-1]); len--)
+            ;
+        if( len==0 ) {
+            ip_block_printf(block, " (not an address)\n");
+        } else if( memchr(p, ':', len)==NULL && len==ip_parse_dq(p, len, &ip) ) {
+            format_result(block, p, len, ip_engine_lookup(db->engine, ip));
+        } else if( memchr(p, ':', len)==NULL || len!=ip_parse_ip6(p, len, &ip6) ) {
+            ip_block_printf(block, "%.*s (not an address)\n", (int)len, p);
+        } else if( ip6_addr_is_v4mapped(ip6) ) {
+            format_result(block, p, len, ip_engine_lookup(db->engine, (in_addr_t)ip6.lo));
+        } else {
+            format_result6(block, p, len, ip6_cbst_lookup_ip(db->cbst6, db->nmemb6, ip6));
+        }
+    }
+}
+
+
+// Count the addresses in the block into this worker's shard; there is
+// no output. The counts are kept per range, so they are always of the
+// generation there was at the start, even over --shm:
+void count_block(ip_block *block, void *arg)
+{
+    scan_arg       *sa    = arg;
+    ip_agg         *agg   = sa->shards[block->worker];
+    const ip_cbst_node *nodes = sa->engine->nodes;
+    const ip_hits  *hits  = &block->hits;
+    const ip6_hits *hits6 = &block->hits6;
+    size_t i, j;
+
+    scan_lookup(block, sa, NULL);
+
+    for(i=0, j=0; j<hits6->n; j++) {
+        ip_agg_add6(agg, sa->cbst6, hits6->node[j]);
+        // Skip any dotted quad inside it, as scan_block() does:
+        for(; i<hits->n && hits->offset[i] < hits6->offset[j]; i++) {
+            ip_agg_add(agg, nodes, hits->node[i]);
+        }
+        for(; i<hits->n && hits->offset[i] < hits6->offset[j]+hits6->len[j]; i++)
+            ;
+    }
+    for(; i<hits->n; i++) {
+        ip_agg_add(agg, nodes, hits->node[i]);
+    }
+}
+
+
+// Scan the named files, or stdin if there are none ("-" is also stdin):
+void scan_files(char **files, int n, size_t nthreads, ip_block_fn work, scan_arg *sa)
+{
+    FILE *fp;
+
+    if( n==0 ) {
+        ip_pipeline_run(stdin, stdout, nthreads, work, sa);
+        return;
+    }
+    for(int i=0; i<n; i++) {
+        if( 0==strcmp(files[i], "-") ) {
+            ip_pipeline_run(stdin, stdout, nthreads, work, sa);
+            continue;
+        }
+        fp = fopen(files[i], "r");
+        if( fp==NULL ) {
+            perror(files[i]);
+            continue;
+        }
+        ip_pipeline_run(fp, stdout, nthreads, work, sa);
+        fclose(fp);
+    }
+}
+
+
+// Scan with one set of counters per worker, then merge and report:
+void count_files(scan_arg *sa, char **files, int n, size_t nthreads, size_t k, bool csv)
+{
+    size_t i;
+
+    sa->shards = calloc(nthreads, sizeof(ip_agg*));
+    assert( sa->shards!=NULL );
+    for(i=0; i<nthreads; i++) {
+        sa->shards[i] = ip_agg_new(sa->engine->nnodes, sa->nmemb6);
+        assert( sa->shards[i]!=NULL );
+    }
+
+    scan_files(files, n, nthreads, count_block, sa);
+
+    for(i=1; i<nthreads; i++) {
+        ip_agg_merge(sa->shards[0], sa->shards[i]);
+        ip_agg_free(sa->shards[i]);
+    }
+    ip_agg_report(sa->shards[0], sa->engine->nodes, sa->cbst6, k, csv, stdout);
+    ip_agg_free(sa->shards[0]);
+    free(sa->shards);
+}
+
+
+// Report what ip_cbst_update() did:
+int update_bin(void)
+{
+    ip_cbst_update_stats st;
+
+    if( 0!=ip_cbst_update(NULL, &st) ) {
+        perror(getenv(IP2CC_BINDB_ENVAR));
+        return EXIT_FAILURE;
+    }
+    if( st.rebuilt ) {
+        printf("rebuilt: %zu+%zu ranges, was %zu+%zu; %zu bytes written\n",
+               st.nmemb, st.nmemb6, st.old_nmemb, st.old_nmemb6, st.bytes);
+    } else {
+        printf("updated: %zu of %zu+%zu ranges changed, in %zu slices; %zu of %zu bytes written\n",
+               st.changed, st.nmemb, st.nmemb6, st.slices, st.bytes, st.size);
+    }
+    return EXIT_SUCCESS;
+}
+
+
 int main(int argc, char *argv[])
 {
     const ip_cbst_node* cbst = NULL;
-    size_t nmemb = 0;
-    const ip_cbst_node* node = NULL;
-    char buf[512];
+    const ip6_cbst_node* cbst6 = NULL;
+    size_t nmemb = 0, nmemb6 = 0;
+    ip_engine* engine = NULL;
+    scan_arg sa;
+    const char* engine_name = NULL;
+    const char* argv0 = argv[0];
+    const char* socket_path = NULL;
+    const char* shm_name = NULL;
+    ip_cbst_shared shared;
+    ip_reload *reload = NULL;
+    bool scan = false, annotate = false, count = false, csv = false, serve = false;
+    bool publish = false, shm = false, update = false, own = false, show_stats = false;
+    bool verify = false;
+    ip_stats *stats = NULL;
+    ip_cache *caches = NULL;
+    long cache_prefix = 0;
+    long nthreads = 1, topk = IP_AGG_TOPK;
+    int opt, n, ret = 0;
+    static const struct option longopts[] = {
+        { "serve",   optional_argument, NULL, 'S' },
+        { "publish", optional_argument, NULL, 'P' },
+        { "shm",     optional_argument, NULL, 'M' },
+        { "update",  no_argument,       NULL, 'U' },
+        { "verify",  no_argument,       NULL, 'V' },
+        { "stats",   no_argument,       NULL, 'T' },
+        { "cache",   optional_argument, NULL, 'K' },
+        { NULL,      0,                 NULL, 0   }
+    };
+
+    while( -1 != (opt=getopt_long(argc, argv, "e:sat:ck:C", longopts, NULL)) ) {
+        switch( opt ) {
+        case 'S':
+            serve       = true;
+            socket_path = optarg;
+            break;
+        case 'P':
+            publish  = true;
+            shm_name = optarg;
+            break;
+        case 'M':
+            shm      = true;
+            shm_name = optarg;
+            break;
+        case 'U':
+            update = true;
+            break;
+        case 'V':
+            verify = true;
+            break;
+        case 'T':
+            show_stats = true;
+            break;
+        case 'K':
+            cache_prefix = optarg!=NULL ? strtol(optarg, NULL, 10) : IP_CACHE_PREFIX;
+            if( cache_prefix<8 || cache_prefix>32 ) {
+                usage(argv0);
+            }
+            break;
+        case 'k':
+            topk = strtol(optarg, NULL, 10);
+            if( topk<0 ) {
+                usage(argv0);
+            }
+            break;
+        case 'C':
+            csv = true;
+            break;
+        case 'c':
+            count = true;
+            scan  = true;
+            break;
+        case 't':
+            nthreads = strtol(optarg, NULL, 10);
+            if( nthreads==0 ) {
+                nthreads = sysconf(_SC_NPROCESSORS_ONLN);
+            }
+            if( nthreads<1 ) {
+                usage(argv0);
+            }
+            break;
+        case 'e':
+            engine_name = optarg;
+            break;
+        case 'a':
+            annotate = true;
+            // Fall through
+        case 's':
+            scan = true;
+            break;
+        default:
+            usage(argv0);
+        }
+    }
+    argv += optind;
+    n = argc - optind;
 
-    assert(argc>=2);
+    if( (n<1 && !scan && !serve && !publish && !update) || (publish && shm) ) {
+        usage(argv0);
+    }
 
     set_default_env();
-    cbst = ip_cbst_load(NULL, &nmemb);
+    if( update ) {
+        return update_bin();
+    }
+    if( shm_name==NULL ) {
+        shm_name = getenv(IP2CC_SHM_ENVAR);
+    }
+    if( shm ) {
+        if( 0!=ip_cbst_shared_open(&shared, shm_name) ) {
+            perror(shm_name);
+            exit(EXIT_FAILURE);
+        }
+        cbst  = shared.cbst;
+        nmemb = shared.nmemb;
+        own   = true;
+    } else {
+#ifdef IP2CC_BUILTIN
+        // Compiled in, there is no file to verify:
+        (void)verify;
+        cbst = ip_builtin_cbst(&nmemb);
+        if( engine_name==NULL ) {
+            engine_name = "builtin";
+        }
+#else
+        cbst = ip_cbst_load(NULL, &nmemb, verify);
+        own  = true;
+        if( cbst==NULL ) {
+            exit(EXIT_FAILURE);
+        }
+#endif
+    }
+    cbst6 = ip_cbst_ip6(cbst, &nmemb6);
 
-    for(int i=1; i<argc; i++) {
-        node = ip_cbst_lookup_dq(cbst, nmemb, argv[i]);
-        if( node != NULL ) {
-            ip_cbst_address_range(node, buf);
-            printf("%s %s %s\n", node->cc, argv[i], buf);
-        } else {
-            printf("%s (no match)\n", argv[i]);
+    if( publish ) {
+        if( 0!=ip_cbst_publish(cbst, nmemb, shm_name) ) {
+            perror(shm_name);
+            exit(EXIT_FAILURE);
         }
+        if( own ) {
+            ip_cbst_free(cbst);
+        }
+        return 0;
+    }
+
+    engine = own && !shm ? ip_engine_new_owned(engine_name, cbst, nmemb)
+                         : ip_engine_new(engine_name, cbst, nmemb);
+    if( engine == NULL && errno==ENOENT ) {
+        fprintf(stderr, "%s: no such engine\n", engine_name);
+        usage(argv0);
+    }
+    if( engine == NULL ) {
+        fprintf(stderr, "%s: cannot build: %s\n", engine_name!=NULL ? engine_name : "cbst", strerror(errno));
+        exit(EXIT_FAILURE);
     }
 
-    free((void *)cbst);
+    sa.engine   = engine;
+    sa.cbst6    = cbst6;
+    sa.nmemb6   = nmemb6;
+    sa.annotate = annotate;
+    sa.shards   = NULL;
+    sa.stats    = NULL;
+    sa.caches   = NULL;
+    sa.reload   = NULL;
+    sa.failed   = false;
+
+    // Counters, and caches, for each thread that looks addresses up:
+    if( show_stats ) {
+        stats = ip_stats_new(nthreads);
+        if( stats==NULL ) {
+            perror("ip_stats_new");
+            exit(EXIT_FAILURE);
+        }
+        sa.stats = stats;
+    }
+    if( cache_prefix>0 ) {
+        caches = ip_cache_new(nthreads, cache_prefix);
+        if( caches==NULL ) {
+            perror("ip_cache_new");
+            exit(EXIT_FAILURE);
+        }
+        sa.caches = caches;
+    }
+
+    // The server, and a scan over a published database, move to each
+    // new generation of the database as it appears: the server's is
+    // rebuilt when the text changes, unless it is a published or a
+    // compiled-in one, and a published one is followed:
+    if( serve || (scan && !count && shm) ) {
+        ip_db *db = ip_db_new(cbst, nmemb, engine, own);
+
+        reload = db!=NULL ? ip_reload_new(db, engine_name, nthreads) : NULL;
+        if( reload==NULL ) {
+            perror("ip_reload_new");
+            exit(EXIT_FAILURE);
+        }
+        engine = NULL;
+        if( shm ) {
+            cbst = NULL;
+            if( 0!=ip_reload_follow(reload, &shared) ) {
+                perror(shm_name);
+            }
+        } else if( own ) {
+            cbst = NULL;
+            if( 0!=ip_reload_watch(reload) ) {
+                perror(getenv(IP2CC_TXTDB_ENVAR));
+            }
+        }
+        sa.reload = reload;
+    }
+
+    if( serve ) {
+        ip_serve_conf conf;
+
+        conf.path     = socket_path!=NULL ? socket_path : getenv(IP2CC_SOCKET_ENVAR);
+        conf.nworkers = nthreads;
+        conf.reload   = reload;
+        conf.lines    = lookup_lines;
+        conf.stats    = stats;
+        conf.caches   = caches;
+        ret = ip_serve_run(&conf)==0 ? EXIT_SUCCESS : EXIT_FAILURE;
+    } else if( count ) {
+        count_files(&sa, argv, n, nthreads, topk, csv);
+    } else if( scan ) {
+        scan_files(argv, n, nthreads, scan_block, &sa);
+    } else {
+        lookup_args(engine, cbst6, nmemb6, argv, n, stats, caches);
+    }
+    if( sa.failed ) {
+        ret = EXIT_FAILURE;
+    }
+
+    if( stats!=NULL ) {
+        fprintf(stderr, "%s: ", argv0);
+        ip_stats_report(stats, nthreads, stderr);
+        ip_stats_free(stats, nthreads);
+    }
+    if( caches!=NULL ) {
+        fprintf(stderr, "%s: ", argv0);
+        ip_cache_report(caches, nthreads, stderr);
+        ip_cache_free(caches);
+    }
+
+    ip_reload_free(reload);
+    ip_engine_free(engine);
+    if( shm ) {
+        ip_cbst_shared_close(&shared);
+    }
+    if( own ) {
+        ip_cbst_free(cbst);
+    }
 
-    return 0;
+    return ret;
 }
@@ -0,0 +1,182 @@
+#include <ip6-cbst.h>
+#include <assert.h>
+
+#include <stdio.h>      // For snprintf()
+#include <string.h>     // For strlen()
+#include <sys/param.h>  // For MIN()
+
+// Only for printing ranges as CIDR blocks:
+__extension__ typedef unsigned __int128 u128;
+
+
+static inline int ip6_cbst_cmp(const ip6_cbst_node *node, const ip6_addr *ipp) {
+    assert(node!=NULL);
+    assert(ipp!=NULL);
+
+    if( !ip6_addr_le(node->addr_lo, *ipp) ) { return -1; }
+    if( !ip6_addr_le(*ipp, node->addr_hi) ) { return  1; }
+    return 0;
+}
+
+int ip6_cbst_compar(const void *node, const void *ipp) {
+    return ip6_cbst_cmp(node, ipp);
+}
+
+
+// As ip_cbst_lookup_ip(), with the 128-bit compare done as two 64-bit
+// ones:
+const ip6_cbst_node* ip6_cbst_lookup_ip(const ip6_cbst_node *root, size_t nmemb, ip6_addr ip) {
+    const ip6_cbst_node *node;
+    size_t k = 1;
+
+    if( root==NULL ) {
+        return NULL;
+    }
+
+    while( k <= nmemb ) {
+        k = (k<<1) + ip6_addr_le(root[k-1].addr_lo, ip);
+    }
+    k >>= __builtin_ctzl(k)+1;
+
+    if( k==0 ) {
+        // Below the lowest range
+        return NULL;
+    }
+    node = root+k-1;
+    return ip6_addr_le(ip, node->addr_hi) ? node : NULL;
+}
+
+
+// As ip_cbst_lookup_batch(). The nodes are 40 bytes, so a query's four
+// grandchildren span three cache lines; the first and last are
+// prefetched, and the middle one is shared with a neighbour:
+void ip6_cbst_lookup_batch(const ip6_cbst_node *root, size_t nmemb,
+                           const ip6_addr *ips, const ip6_cbst_node **out, size_t n)
+{
+    size_t k[IP_CBST_BATCH];
+    size_t i, j, m, d, h;
+
+    assert( n==0 || ips!=NULL );
+    assert( n==0 || out!=NULL );
+
+    if( root==NULL || nmemb==0 ) {
+        for(i=0; i<n; i++) {
+            out[i] = NULL;
+        }
+        return;
+    }
+
+    h = 8*sizeof(size_t)-__builtin_clzl(nmemb);
+
+    for(i=0; i<n; i+=m) {
+        m = MIN(n-i, IP_CBST_BATCH);
+
+        for(j=0; j<m; j++) {
+            k[j] = 1;
+        }
+        for(d=1; d<h; d++) {
+            for(j=0; j<m; j++) {
+                k[j] = (k[j]<<1) + ip6_addr_le(root[k[j]-1].addr_lo, ips[i+j]);
+                __builtin_prefetch(root+(k[j]<<2)-1);
+                __builtin_prefetch(root+(k[j]<<2)+2);
+            }
+        }
+        for(j=0; j<m; j++) {
+            if( k[j] <= nmemb ) {
+                k[j] = (k[j]<<1) + ip6_addr_le(root[k[j]-1].addr_lo, ips[i+j]);
+            }
+            k[j] >>= __builtin_ctzl(k[j])+1;
+            if( k[j]==0 || !ip6_addr_le(ips[i+j], root[k[j]-1].addr_hi) ) {
+                out[i+j] = NULL;
+            } else {
+                out[i+j] = root+k[j]-1;
+            }
+        }
+    }
+}
+
+
+const ip6_cbst_node* ip6_cbst_lookup_ip_generic(const ip6_cbst_node *root, size_t nmemb, ip6_addr ip) {
+    return cbst_search(root, nmemb, sizeof(ip6_cbst_node), ip6_cbst_compar, &ip);
+}
+
+
+const ip6_cbst_node* ip6_cbst_lookup_str(const ip6_cbst_node *root, size_t nmemb, const char *s) {
+    ip6_addr ip;
+
+    if( 0==ip_parse_ip6_str(s, &ip) ) {
+        return NULL;
+    }
+    return ip6_cbst_lookup_ip(root, nmemb, ip);
+}
+
+
+// Thread-safe; 'buf' must hold INET6_ADDRSTRLEN bytes:
+char* ip6_cbst_ntop(ip6_addr ip, char *buf) {
+    struct in6_addr a;
+    int i;
+
+    for(i=0; i<8; i++) {
+        a.s6_addr[i]   = ip.hi >> (56-8*i);
+        a.s6_addr[8+i] = ip.lo >> (56-8*i);
+    }
+    inet_ntop(AF_INET6, &a, buf, INET6_ADDRSTRLEN);
+    return buf;
+}
+
+
+static inline u128 to_u128(ip6_addr ip) {
+    return (u128)ip.hi<<64 | ip.lo;
+}
+
+static inline ip6_addr from_u128(u128 x) {
+    ip6_addr ip;
+
+    ip.hi = x>>64;
+    ip.lo = x;
+    return ip;
+}
+
+
+// The range and the CIDR blocks that make it up. A range can take up
+// to 254 blocks, so the list is cut short with "..." if it would not
+// fit in IP6_CBST_RANGE_MAX bytes:
+char* ip6_cbst_address_range(const ip6_cbst_node *node, char *buf)
+{
+    char   a[INET6_ADDRSTRLEN], b[INET6_ADDRSTRLEN];
+    u128   lo, hi, mask;
+    size_t len, n;
+    int    k;
+
+    assert(node!=NULL);
+    assert(buf!=NULL);
+
+    len = snprintf(buf, IP6_CBST_RANGE_MAX, "%s-%s",
+                   ip6_cbst_ntop(node->addr_lo, a), ip6_cbst_ntop(node->addr_hi, b));
+
+    lo = to_u128(node->addr_lo);
+    hi = to_u128(node->addr_hi);
+    for(;;) {
+        // The largest aligned block at 'lo' that does not pass 'hi':
+        k = (uint64_t)lo ? __builtin_ctzll((uint64_t)lo)
+          : (uint64_t)(lo>>64) ? 64+__builtin_ctzll((uint64_t)(lo>>64)) : 128;
+        mask = k==128 ? ~(u128)0 : ((u128)1<<k)-1;
+        while( mask > hi-lo ) {
+            k--;
+            mask >>= 1;
+        }
+
+        n = snprintf(buf+len, IP6_CBST_RANGE_MAX-len, " %s/%d", ip6_cbst_ntop(from_u128(lo), a), 128-k);
+        if( len+n+5 >= IP6_CBST_RANGE_MAX ) {
+            strcpy(buf+len, " ...");
+            break;
+        }
+        len += n;
+        if( mask == hi-lo ) {
+            break;
+        }
+        lo += mask+1;
+    }
+
+    return buf;
+}
@@ -0,0 +1,37 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <arpa/inet.h>
+#include <ip-cbst.h>
+#include <ip-parse.h>
+
+// Size of the buffer that ip6_cbst_address_range() needs:
+#define IP6_CBST_RANGE_MAX 512
+
+// The IPv6 counterpart of ip_cbst_node. The ranges are stored in the
+// same binary database as the IPv4 ones; see ip_cbst_ip6():
+struct ip6_cbst_node {
+    ip6_addr  addr_lo;
+    ip6_addr  addr_hi;
+    char      cc[3];
+    char      flag;
+};
+
+// a <= b, as two 64-bit compares and no branches:
+static inline int ip6_addr_le(ip6_addr a, ip6_addr b) {
+    return (a.hi < b.hi) | ((a.hi == b.hi) & (a.lo <= b.lo));
+}
+
+// IPv4-mapped addresses, ::ffff:a.b.c.d, belong in the IPv4 tree:
+static inline int ip6_addr_is_v4mapped(ip6_addr ip) {
+    return ip.hi==0 && (ip.lo>>32)==0xffff;
+}
+
+const ip6_cbst_node* ip6_cbst_lookup_ip(const ip6_cbst_node *root, size_t nmemb, ip6_addr ip);
+const ip6_cbst_node* ip6_cbst_lookup_ip_generic(const ip6_cbst_node *root, size_t nmemb, ip6_addr ip);
+void                 ip6_cbst_lookup_batch(const ip6_cbst_node *root, size_t nmemb, const ip6_addr *ips, const ip6_cbst_node **out, size_t n);
+const ip6_cbst_node* ip6_cbst_lookup_str(const ip6_cbst_node *root, size_t nmemb, const char *s);
+
+char*                ip6_cbst_ntop(ip6_addr ip, char *buf);
+char*                ip6_cbst_address_range(const ip6_cbst_node *node, char *buf);
@@ -0,0 +1,106 @@
+// cbst.hpp, in each layout, must answer as the standard algorithms do
+// over the sorted elements, for tables from empty to a few thousand
+// elements with runs of equal keys, and keys below, between, equal to
+// and above them. Elements carry their sorted position, so an answer
+// is checked to be the very element std::lower_bound() would give, not
+// just an equal one. The eytzinger layout must also be the one that
+// cbst_from_sorted_array() builds.
+
+#include <cbst.hpp>
+extern "C" {
+#include <cbst.h>
+}
+
+#include <algorithm>    // For std::lower_bound(), std::upper_bound()
+#include <cstdio>
+#include <cstdlib>
+#include <vector>
+
+#define CHECK(cond) do { \
+        if( !(cond) ) { \
+            std::fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, #cond); \
+            std::exit(EXIT_FAILURE); \
+        } \
+    } while(0)
+
+struct elem {
+    int         key;
+    std::size_t pos;    // In sorted order
+};
+
+struct by_key {
+    bool operator()(const elem &e, int k) const { return e.key < k; }
+    bool operator()(int k, const elem &e) const { return k < e.key; }
+    bool operator()(int a, int b) const { return a < b; }
+};
+
+struct key_of {
+    int operator()(const elem &e) const { return e.key; }
+};
+
+// The answer expected where the standard algorithm returns 'it':
+static const elem* expected(const std::vector<elem> &v, std::vector<elem>::const_iterator it) {
+    return it==v.end() ? nullptr : &*it;
+}
+
+static void same(const elem *got, const elem *want) {
+    CHECK( (got==nullptr)==(want==nullptr) );
+    CHECK( got==nullptr || (got->key==want->key && got->pos==want->pos) );
+}
+
+template<class Layout>
+static void check(const std::vector<elem> &v) {
+    cbst<elem, by_key, Layout> t(v.begin(), v.end());
+    by_key comp;
+    int    k, hi = v.empty() ? 0 : v.back().key+1;
+
+    CHECK( t.size()==v.size() && t.empty()==v.empty() );
+    for(k=-1; k<=hi; k++) {
+        auto lb = std::lower_bound(v.begin(), v.end(), k, comp);
+        auto ub = std::upper_bound(v.begin(), v.end(), k, comp);
+
+        same(t.lower_bound(k), expected(v, lb));
+        same(t.upper_bound(k), expected(v, ub));
+        same(t.floor(k), ub==v.begin() ? nullptr : &*(ub-1));
+        same(t.find(k), lb!=v.end() && lb->key==k ? &*lb : nullptr);
+    }
+}
+
+// The same elements as cbst_from_sorted_array() places them:
+static void check_interchangeable(const std::vector<elem> &v) {
+    cbst<elem, by_key> t(v.begin(), v.end());
+    void *c = cbst_from_sorted_array(v.data(), v.size(), sizeof(elem));
+    std::size_t i;
+
+    CHECK( v.empty() || c!=nullptr );
+    for(i=0; i<v.size(); i++) {
+        CHECK( t.data()[i].key==static_cast<elem*>(c)[i].key );
+        CHECK( t.data()[i].pos==static_cast<elem*>(c)[i].pos );
+    }
+    std::free(c);
+}
+
+
+int main() {
+    static const std::size_t sizes[] = { 0, 1, 2, 3, 4, 5, 15, 16, 17, 31, 32, 33, 100, 255, 256, 1000, 4097 };
+    std::vector<elem> v;
+    std::size_t i;
+
+    for(std::size_t n : sizes) {
+        // Keys 0, 2, 4, 4, 6, 8, 8, ...: a run of two every third
+        // element, and gaps for the odd keys:
+        v.clear();
+        for(i=0; i<n; i++) {
+            v.push_back(elem{ 2*static_cast<int>(i - i/3), i });
+        }
+        check<eytzinger>(v);
+        check<soa<key_of>>(v);
+        check<kary<>>(v);
+        check<kary<1>>(v);
+        check<kary<3>>(v);
+        check_interchangeable(v);
+    }
+
+    std::printf("test-cbst-hpp: ok\n");
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,73 @@
+// A CBST built concurrently must be the one built in a single pass,
+// element for element, whatever the split: for sizes from empty to
+// several times CBST_MT_MIN_CHUNK, with more threads than elements, and
+// with chunks that do not divide the input evenly.
+
+#include <cbst.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+
+#define CHECK(cond) do { \
+        if( !(cond) ) { \
+            fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, #cond); \
+            exit(EXIT_FAILURE); \
+        } \
+    } while(0)
+
+// Elements wider than a word, so a misplaced half would show:
+typedef struct {
+    uint64_t key;
+    uint32_t tag;
+} elem;
+
+
+static void check(const elem *sorted, size_t nmemb, size_t nthreads)
+{
+    elem *one  = cbst_from_sorted_array(sorted, nmemb, sizeof(elem));
+    elem *many = cbst_from_sorted_array_mt(sorted, nmemb, sizeof(elem), nthreads);
+    elem *back;
+
+    CHECK( nmemb==0 || (one!=NULL && many!=NULL) );
+    if( nmemb>0 && 0!=memcmp(one, many, nmemb*sizeof(elem)) ) {
+        fprintf(stderr, "%zu elements, %zu threads: trees differ\n", nmemb, nthreads);
+        exit(EXIT_FAILURE);
+    }
+    back = cbst_to_sorted_array(many, nmemb, sizeof(elem));
+    CHECK( nmemb==0 || (back!=NULL && 0==memcmp(back, sorted, nmemb*sizeof(elem))) );
+
+    free(back);
+    free(many);
+    free(one);
+}
+
+
+int main(void)
+{
+    static const size_t sizes[] = {
+        0, 1, 2, 3, 7, 8, 100, 1023, 1024,
+        CBST_MT_MIN_CHUNK-1, CBST_MT_MIN_CHUNK, 3*CBST_MT_MIN_CHUNK+7, 1000003
+    };
+    static const size_t threads[] = { 0, 1, 2, 3, 5, 8, 64 };
+    size_t max = sizes[sizeof(sizes)/sizeof(sizes[0])-1];
+    elem  *sorted = calloc(max, sizeof(elem));
+    size_t i, s, t;
+
+    CHECK( sorted!=NULL );
+    for(i=0; i<max; i++) {
+        sorted[i].key = 3*i+1;
+        sorted[i].tag = (uint32_t)i;
+    }
+
+    for(s=0; s<sizeof(sizes)/sizeof(sizes[0]); s++) {
+        for(t=0; t<sizeof(threads)/sizeof(threads[0]); t++) {
+            check(sorted, sizes[s], threads[t]);
+        }
+    }
+
+    free(sorted);
+    printf("test-cbst: ok\n");
+    return 0;
+}
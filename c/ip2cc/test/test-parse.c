@@ -0,0 +1,155 @@
+// ip_parse_dq() must accept exactly four fields of 1-3 decimal digits,
+// none above 255, with leading zeros read as decimal, and leave what
+// follows the fourth field to the caller. It must also not read past
+// the input where that crosses into an unmapped page. The Makefile
+// builds this twice, against the scalar parser and the SSSE3 one.
+
+#define _DEFAULT_SOURCE
+
+#include <ip-parse.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+#define CHECK(cond) do { \
+        if( !(cond) ) { \
+            fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, #cond); \
+            exit(EXIT_FAILURE); \
+        } \
+    } while(0)
+
+typedef struct {
+    const char *s;
+    size_t      len;    // Parsed, 0 for none
+    in_addr_t   ip;
+} parse_case;
+
+static const parse_case cases[] = {
+    { "1.2.3.4",            7, 0x01020304 },
+    { "0.0.0.0",            7, 0x00000000 },
+    { "255.255.255.255",   15, 0xffffffff },
+    { "192.168.100.1",     13, 0xc0a86401 },
+    // Empty fields:
+    { "",                   0, 0 },
+    { ".1.2.3",             0, 0 },
+    { "1..2.3",             0, 0 },
+    { "1.2..3",             0, 0 },
+    { "1.2.3.",             0, 0 },
+    { "...",                0, 0 },
+    // Fields out of range or too long:
+    { "256.1.1.1",          0, 0 },
+    { "1.256.1.1",          0, 0 },
+    { "1.1.256.1",          0, 0 },
+    { "1.1.1.256",          0, 0 },
+    { "999.1.1.1",          0, 0 },
+    { "1.1.1.1000",         0, 0 },
+    { "1234.1.1.1",         0, 0 },
+    // Too few fields:
+    { "1.2.3",              0, 0 },
+    { "1.2",                0, 0 },
+    { "1",                  0, 0 },
+    // Leading zeros are decimal, not octal:
+    { "010.001.000.09",    14, 0x0a010009 },
+    { "08.09.010.0377",     0, 0 },
+    { "00.00.00.00",       11, 0x00000000 },
+    { "0255.1.1.1",         0, 0 },
+    // What follows the fourth field is left to the caller:
+    { "1.2.3.4.",           7, 0x01020304 },
+    { "1.2.3.4.5",          7, 0x01020304 },
+    { "1.2.3.4..",          7, 0x01020304 },
+    { "10.0.0.1 x",         8, 0x0a000001 },
+    { "10.0.0.1/24",        8, 0x0a000001 },
+    { "10.0.0.1:80",        8, 0x0a000001 },
+    { "1.2.3.4abcdefghijk", 7, 0x01020304 },
+    // Not a dotted quad at the start:
+    { " 1.2.3.4",           0, 0 },
+    { "a1.2.3.4",           0, 0 },
+    { "1.2.3.x",            0, 0 },
+    { "1.2.-3.4",           0, 0 },
+};
+
+
+// Parses 's' with ip_parse_dq() and ip_parse_dq_str(), both of which
+// must give 'c':
+static void check_at(const char *s, const parse_case *c)
+{
+    in_addr_t ip = 0;
+    size_t    len;
+
+    len = ip_parse_dq(s, strlen(s), &ip);
+    if( len!=c->len || (len>0 && ip!=c->ip) ) {
+        fprintf(stderr, "ip_parse_dq(\"%s\"): %zu %08x, not %zu %08x\n",
+                s, len, (unsigned)ip, c->len, (unsigned)c->ip);
+        exit(EXIT_FAILURE);
+    }
+    ip  = 0;
+    len = ip_parse_dq_str(s, &ip);
+    if( len!=c->len || (len>0 && ip!=c->ip) ) {
+        fprintf(stderr, "ip_parse_dq_str(\"%s\"): %zu %08x, not %zu %08x\n",
+                s, len, (unsigned)ip, c->len, (unsigned)c->ip);
+        exit(EXIT_FAILURE);
+    }
+}
+
+
+// A length shorter than the string must stop the parse there, as if
+// the string ended:
+static void check_truncated(void)
+{
+    in_addr_t ip;
+
+    CHECK( 7==ip_parse_dq("1.2.3.45", 7, &ip) && ip==0x01020304 );
+    CHECK( 0==ip_parse_dq("1.2.3.4", 6, &ip) );
+    CHECK( 0==ip_parse_dq("1.2.3.4", 0, &ip) );
+    CHECK( 15==ip_parse_dq("255.255.255.2550", 15, &ip) && ip==0xffffffff );
+}
+
+
+int main(void)
+{
+    size_t page = sysconf(_SC_PAGESIZE), i, off;
+    char  *map, *end, buf[64];
+
+    for(i=0; i<sizeof(cases)/sizeof(cases[0]); i++) {
+        // In the middle of a buffer, at every alignment:
+        for(off=0; off<16; off++) {
+            memset(buf, 'x', sizeof(buf));
+            strcpy(buf+off, cases[i].s);
+            check_at(buf+off, &cases[i]);
+        }
+    }
+    check_truncated();
+
+    // Ending right before an unmapped page, so any read past the input
+    // faults:
+    map = mmap(NULL, 2*page, PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+    CHECK( map!=MAP_FAILED );
+    CHECK( 0==mprotect(map+page, page, PROT_NONE) );
+    end = map+page;
+    for(i=0; i<sizeof(cases)/sizeof(cases[0]); i++) {
+        size_t    n = strlen(cases[i].s);
+        in_addr_t ip = 0;
+        size_t    len;
+
+        // Without a NUL, the last byte of the input is the last byte
+        // of the page:
+        memcpy(end-n, cases[i].s, n);
+        len = ip_parse_dq(end-n, n, &ip);
+        CHECK( len==cases[i].len && (len==0 || ip==cases[i].ip) );
+
+        // With one, the NUL is the last byte of the page:
+        memcpy(end-n-1, cases[i].s, n+1);
+        check_at(end-n-1, &cases[i]);
+    }
+    CHECK( 0==munmap(map, 2*page) );
+
+#if defined(__SSSE3__)
+    printf("test-parse-ssse3: ok\n");
+#else
+    printf("test-parse: ok\n");
+#endif
+    return 0;
+}
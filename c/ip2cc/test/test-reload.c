@@ -0,0 +1,123 @@
+// A running reload is fed a text database with a malformed line, then a
+// good one: the first must leave the database being served as it was,
+// and the process running; the second must be swapped in.
+
+#define _DEFAULT_SOURCE 1       // For mkdtemp(), setenv()
+
+#include <defaults.h>
+#include <ip-cbst.h>
+#include <ip-engine.h>
+#include <ip-reload.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>       // For nanosleep()
+#include <unistd.h>     // For chdir(), getcwd()
+#include <limits.h>     // For PATH_MAX
+
+#define CHECK(cond) do { \
+        if( !(cond) ) { \
+            fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, #cond); \
+            exit(EXIT_FAILURE); \
+        } \
+    } while(0)
+
+static char dir[] = "/tmp/test-reload.XXXXXX";
+
+
+// Replaces the text database the way a feed would, by renaming a new
+// file into place:
+static void write_db(const char *text)
+{
+    FILE *fp = fopen("ip2cc.txt.new", "w");
+
+    CHECK( fp!=NULL );
+    CHECK( EOF!=fputs(text, fp) );
+    CHECK( 0==fclose(fp) );
+    CHECK( 0==rename("ip2cc.txt.new", "ip2cc.txt") );
+}
+
+
+// The country code for 'dq' in the generation being served:
+static const char* served_cc(ip_reload *reload, const char *dq, char *cc)
+{
+    const ip_db *db = ip_reload_enter(reload, 0);
+    const ip_cbst_node *node;
+    in_addr_t ip = ntohl(inet_addr(dq));
+
+    node = ip_engine_lookup(db->engine, ip);
+    strcpy(cc, node!=NULL ? node->cc : "--");
+    ip_reload_leave(reload, 0);
+    return cc;
+}
+
+
+// Waits for a rebuild to have had time to happen, or for one to have
+// happened if 'until' is set:
+static void wait_rebuild(ip_reload *reload, const char *dq, const char *until)
+{
+    const struct timespec pause = { 0, 10*1000*1000 };
+    char cc[3];
+    int  i;
+
+    for(i=0; i<500; i++) {
+        nanosleep(&pause, NULL);
+        if( until!=NULL ? 0==strcmp(served_cc(reload, dq, cc), until)
+                        : i*10 > 3*IP_RELOAD_QUIET_MS ) {
+            return;
+        }
+    }
+}
+
+
+int main(void)
+{
+    const ip_cbst_node *cbst;
+    ip_reload *reload;
+    ip_engine *engine;
+    ip_db     *db;
+    size_t     nmemb;
+    char       path[PATH_MAX], cc[3];
+
+    CHECK( NULL!=mkdtemp(dir) && 0==chdir(dir) );
+    snprintf(path, sizeof(path), "%s/ip2cc.txt", dir);
+    setenv(IP2CC_TXTDB_ENVAR, path, 1);
+    snprintf(path, sizeof(path), "%s/ip2cc6.txt", dir);
+    setenv(IP2CC_TXTDB6_ENVAR, path, 1);
+    snprintf(path, sizeof(path), "%s/ip2cc.bin", dir);
+    setenv(IP2CC_BINDB_ENVAR, path, 1);
+
+    write_db("1.0.0.0 1.0.0.255 aa\n2.0.0.0 2.0.0.255 bb\n");
+    cbst = ip_cbst_load_text(NULL, &nmemb);
+    CHECK( cbst!=NULL && nmemb==2 );
+    engine = ip_engine_new(NULL, cbst, nmemb);
+    db     = engine!=NULL ? ip_db_new(cbst, nmemb, engine, true) : NULL;
+    reload = db!=NULL ? ip_reload_new(db, NULL, 1) : NULL;
+    CHECK( reload!=NULL );
+    CHECK( 0==ip_reload_watch(reload) );
+    CHECK( 0==strcmp(served_cc(reload, "1.0.0.1", cc), "aa") );
+
+    // The loader reports a malformed line rather than exiting:
+    write_db("1.2.3 oops XX\n");
+    errno = 0;
+    CHECK( NULL==ip_cbst_load_text(NULL, &nmemb) && errno==EINVAL );
+
+    // And the reload keeps serving what it had:
+    wait_rebuild(reload, "1.0.0.1", NULL);
+    CHECK( 0==strcmp(served_cc(reload, "1.0.0.1", cc), "aa") );
+    CHECK( 0==strcmp(served_cc(reload, "2.0.0.1", cc), "bb") );
+
+    // Until the next good one:
+    write_db("1.0.0.0 1.0.0.255 cc\n2.0.0.0 2.0.0.255 bb\n");
+    wait_rebuild(reload, "1.0.0.1", "cc");
+    CHECK( 0==strcmp(served_cc(reload, "1.0.0.1", cc), "cc") );
+
+    ip_reload_free(reload);
+    unlink("ip2cc.txt");
+    unlink("ip2cc.bin");
+    CHECK( 0==chdir("/") && 0==rmdir(dir) );
+    printf("test-reload: ok\n");
+    return EXIT_SUCCESS;
+}
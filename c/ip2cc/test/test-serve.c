@@ -0,0 +1,365 @@
+// A server is started on a small database and spoken to over its
+// socket: batches of IPv4 and IPv6 addresses, lines, both on one
+// connection, a last line without its newline, and a batch that breaks
+// the protocol. A second server must not take over the socket of a
+// live one, and must replace one left behind by a server that is gone.
+
+#define _DEFAULT_SOURCE 1       // For mkdtemp(), setenv()
+
+#include <defaults.h>
+#include <ip-cbst.h>
+#include <ip-engine.h>
+#include <ip-parse.h>
+#include <ip-reload.h>
+#include <ip-serve.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <signal.h>
+#include <pthread.h>
+#include <time.h>       // For nanosleep()
+#include <unistd.h>     // For chdir(), access()
+#include <limits.h>     // For PATH_MAX
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+
+#define CHECK(cond) do { \
+        if( !(cond) ) { \
+            fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, #cond); \
+            exit(EXIT_FAILURE); \
+        } \
+    } while(0)
+
+#define NWORKERS 2
+
+static char dir[] = "/tmp/test-serve.XXXXXX";
+static char sock[PATH_MAX];
+
+
+static void write_file(const char *name, const char *text)
+{
+    FILE *fp = fopen(name, "w");
+
+    CHECK( fp!=NULL );
+    CHECK( EOF!=fputs(text, fp) );
+    CHECK( 0==fclose(fp) );
+}
+
+
+// The line protocol's answers are up to the caller; this one answers
+// each line with the country code of the address on it:
+static void lines(ip_block *block, const ip_db *db)
+{
+    const char *p = block->in, *end = block->in+block->len, *nl;
+    const ip_cbst_node *node;
+    in_addr_t ip;
+
+    for(; p<end && NULL!=(nl=memchr(p, '\n', end-p)); p=nl+1) {
+        node = (size_t)(nl-p)==ip_parse_dq(p, nl-p, &ip) ? ip_engine_lookup(db->engine, ip) : NULL;
+        ip_block_printf(block, "%s\n", node!=NULL ? node->cc : "--");
+    }
+}
+
+
+typedef struct {
+    ip_serve_conf conf;
+    pthread_t     tid;
+    int           ret;
+} server;
+
+static void* server_main(void *arg)
+{
+    server *s = arg;
+
+    s->ret = ip_serve_run(&s->conf);
+    return NULL;
+}
+
+static int dial(void)
+{
+    struct sockaddr_un addr;
+    int fd;
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, sock);
+    fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    CHECK( fd>=0 );
+    if( 0!=connect(fd, (struct sockaddr*)&addr, sizeof(addr)) ) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+// Starts a server in a thread of its own, and waits for it to answer:
+static void start(server *s, ip_reload *reload)
+{
+    const struct timespec pause = { 0, 10*1000*1000 };
+    int fd = -1, i;
+
+    memset(s, 0, sizeof(server));
+    s->conf.path     = sock;
+    s->conf.nworkers = NWORKERS;
+    s->conf.reload   = reload;
+    s->conf.lines    = lines;
+    s->ret           = -2;
+    CHECK( 0==pthread_create(&s->tid, NULL, server_main, s) );
+    for(i=0; i<500 && 0>(fd=dial()); i++) {
+        nanosleep(&pause, NULL);
+    }
+    CHECK( fd>=0 );
+    close(fd);
+}
+
+// The server takes SIGTERM as its signal to stop; every other thread
+// has it blocked:
+static void stop(server *s)
+{
+    CHECK( 0==pthread_kill(s->tid, SIGTERM) );
+    CHECK( 0==pthread_join(s->tid, NULL) );
+    CHECK( s->ret==0 );
+}
+
+
+static void send_all(int fd, const void *buf, size_t len)
+{
+    CHECK( (ssize_t)len==send(fd, buf, len, MSG_NOSIGNAL) );
+}
+
+static void recv_all(int fd, void *buf, size_t len)
+{
+    size_t  got = 0;
+    ssize_t n;
+
+    while( got<len ) {
+        n = recv(fd, (char*)buf+got, len-got, 0);
+        CHECK( n>0 );
+        got += n;
+    }
+}
+
+static void send_hdr(int fd, uint8_t family, uint32_t count)
+{
+    ip_serve_hdr hdr;
+
+    memset(&hdr, 0, sizeof(hdr));
+    hdr.kind   = IP_SERVE_BATCH;
+    hdr.family = family;
+    hdr.count  = htonl(count);
+    send_all(fd, &hdr, IP_SERVE_HDR_SIZE);
+}
+
+static void recv_hdr(int fd, uint8_t family, uint32_t count)
+{
+    ip_serve_hdr hdr;
+
+    recv_all(fd, &hdr, IP_SERVE_HDR_SIZE);
+    CHECK( hdr.kind==IP_SERVE_BATCH && hdr.family==family && ntohl(hdr.count)==count );
+}
+
+static void check_rec(const ip_serve_rec *rec, const char *lo, const char *hi, const char *cc)
+{
+    in_addr_t a;
+
+    CHECK( 0==memcmp(rec->cc, cc, 2) );
+    if( lo==NULL ) {
+        CHECK( rec->flag==0 );
+        return;
+    }
+    CHECK( rec->flag==IP_SERVE_FOUND );
+    a = inet_addr(lo);
+    CHECK( 0==memcmp(rec->addr_lo, &a, 4) );
+    a = inet_addr(hi);
+    CHECK( 0==memcmp(rec->addr_hi, &a, 4) );
+}
+
+static void check_rec6(const ip_serve_rec6 *rec, const char *lo, const char *hi, const char *cc)
+{
+    uint8_t a[16];
+
+    CHECK( 0==memcmp(rec->cc, cc, 2) );
+    if( lo==NULL ) {
+        CHECK( rec->flag==0 );
+        return;
+    }
+    CHECK( rec->flag==IP_SERVE_FOUND );
+    CHECK( 1==inet_pton(AF_INET6, lo, a) && 0==memcmp(rec->addr_lo, a, 16) );
+    CHECK( 1==inet_pton(AF_INET6, hi, a) && 0==memcmp(rec->addr_hi, a, 16) );
+}
+
+static void check_line(int fd, const char *expect)
+{
+    char buf[8];
+    size_t n = strlen(expect);
+
+    recv_all(fd, buf, n);
+    CHECK( 0==memcmp(buf, expect, n) );
+}
+
+
+static void batches(void)
+{
+    static const char *dq[] = { "1.0.0.1", "2.0.0.255", "3.0.0.1" };
+    static const char *ip6[] = { "::ffff:1.0.0.1", "2001:db8::1", "2001:db9::1", "::ffff:3.0.0.1" };
+    ip_serve_rec  rec[3];
+    ip_serve_rec6 rec6[4];
+    in_addr_t     a;
+    uint8_t       a6[16];
+    int fd = dial();
+    size_t i;
+
+    CHECK( fd>=0 );
+    send_hdr(fd, 4, 3);
+    for(i=0; i<3; i++) {
+        a = inet_addr(dq[i]);
+        send_all(fd, &a, 4);
+    }
+    recv_hdr(fd, 4, 3);
+    recv_all(fd, rec, sizeof(rec));
+    check_rec(rec+0, "1.0.0.0", "1.0.0.255", "aa");
+    check_rec(rec+1, "2.0.0.0", "2.0.0.255", "bb");
+    check_rec(rec+2, NULL, NULL, "--");
+
+    // IPv4-mapped addresses are answered from the IPv4 ranges:
+    send_hdr(fd, 6, 4);
+    for(i=0; i<4; i++) {
+        CHECK( 1==inet_pton(AF_INET6, ip6[i], a6) );
+        send_all(fd, a6, 16);
+    }
+    recv_hdr(fd, 6, 4);
+    recv_all(fd, rec6, sizeof(rec6));
+    check_rec6(rec6+0, "::ffff:1.0.0.0", "::ffff:1.0.0.255", "aa");
+    check_rec6(rec6+1, "2001:db8::", "2001:db8::ffff", "cc");
+    check_rec6(rec6+2, NULL, NULL, "--");
+    check_rec6(rec6+3, NULL, NULL, "--");
+    close(fd);
+}
+
+
+// Lines and batches on one connection, each request sent in pieces,
+// are answered in order; the last line needs no newline:
+static void mixed(void)
+{
+    static const char req[] = "1.0.0.1\nnot an address\n";
+    ip_serve_rec rec;
+    in_addr_t    a = inet_addr("2.0.0.1");
+    int fd = dial();
+
+    CHECK( fd>=0 );
+    send_all(fd, req, 5);
+    send_all(fd, req+5, sizeof(req)-1-5);
+    check_line(fd, "aa\n--\n");
+
+    send_hdr(fd, 4, 1);
+    send_all(fd, &a, 2);
+    send_all(fd, (char*)&a+2, 2);
+    send_all(fd, "2.0.0.1", 7);
+    CHECK( 0==shutdown(fd, SHUT_WR) );
+    recv_hdr(fd, 4, 1);
+    recv_all(fd, &rec, sizeof(rec));
+    check_rec(&rec, "2.0.0.0", "2.0.0.255", "bb");
+    check_line(fd, "bb\n");
+    CHECK( 0==recv(fd, &rec, 1, 0) );
+    close(fd);
+}
+
+
+// A batch of an unknown family, or of too many addresses, gets the
+// client disconnected:
+static void broken(void)
+{
+    char c;
+    int  fd;
+
+    fd = dial();
+    CHECK( fd>=0 );
+    send_hdr(fd, 5, 1);
+    CHECK( 0==recv(fd, &c, 1, 0) );
+    close(fd);
+
+    fd = dial();
+    CHECK( fd>=0 );
+    send_hdr(fd, 4, IP_SERVE_BATCH_MAX+1);
+    CHECK( 0==recv(fd, &c, 1, 0) );
+    close(fd);
+}
+
+
+int main(void)
+{
+    const ip_cbst_node *cbst;
+    ip_serve_conf conf;
+    ip_reload *reload;
+    ip_engine *engine;
+    ip_db     *db;
+    server     s;
+    sigset_t   sigs;
+    size_t     nmemb;
+    char       path[PATH_MAX];
+    struct sockaddr_un addr;
+    int        fd;
+
+    // Only the servers take the signal, in sigwait():
+    sigemptyset(&sigs);
+    sigaddset(&sigs, SIGINT);
+    sigaddset(&sigs, SIGTERM);
+    CHECK( 0==pthread_sigmask(SIG_BLOCK, &sigs, NULL) );
+
+    CHECK( NULL!=mkdtemp(dir) && 0==chdir(dir) );
+    snprintf(path, sizeof(path), "%s/ip2cc.txt", dir);
+    setenv(IP2CC_TXTDB_ENVAR, path, 1);
+    snprintf(path, sizeof(path), "%s/ip2cc6.txt", dir);
+    setenv(IP2CC_TXTDB6_ENVAR, path, 1);
+    snprintf(path, sizeof(path), "%s/ip2cc.bin", dir);
+    setenv(IP2CC_BINDB_ENVAR, path, 1);
+    snprintf(sock, sizeof(sock), "%s/ip2cc.sock", dir);
+
+    write_file("ip2cc.txt", "1.0.0.0 1.0.0.255 aa\n2.0.0.0 2.0.0.255 bb\n");
+    write_file("ip2cc6.txt", "2001:db8:: 2001:db8::ffff cc\n");
+    cbst = ip_cbst_load_text(NULL, &nmemb);
+    CHECK( cbst!=NULL && nmemb==2 );
+    engine = ip_engine_new(NULL, cbst, nmemb);
+    db     = engine!=NULL ? ip_db_new(cbst, nmemb, engine, true) : NULL;
+    reload = db!=NULL ? ip_reload_new(db, NULL, NWORKERS) : NULL;
+    CHECK( reload!=NULL );
+
+    start(&s, reload);
+    batches();
+    mixed();
+    broken();
+
+    // Another server must leave a live one's socket alone:
+    memset(&conf, 0, sizeof(conf));
+    conf.path     = sock;
+    conf.nworkers = 1;
+    conf.reload   = reload;
+    conf.lines    = lines;
+    CHECK( -1==ip_serve_run(&conf) );
+    batches();
+
+    stop(&s);
+    CHECK( -1==access(sock, F_OK) );
+
+    // But take over one that nothing answers on:
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, sock);
+    fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    CHECK( fd>=0 && 0==bind(fd, (struct sockaddr*)&addr, sizeof(addr)) );
+    close(fd);
+    CHECK( 0==access(sock, F_OK) && -1==dial() );
+    start(&s, reload);
+    batches();
+    stop(&s);
+
+    ip_reload_free(reload);
+    unlink("ip2cc.txt");
+    unlink("ip2cc6.txt");
+    unlink("ip2cc.bin");
+    CHECK( 0==chdir("/") && 0==rmdir(dir) );
+    printf("test-serve: ok\n");
+    return EXIT_SUCCESS;
+}